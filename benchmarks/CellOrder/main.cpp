@@ -0,0 +1,152 @@
+#include "unicubemaker.hpp"
+#include "../common.hpp"
+
+#include <vector>
+#include <upcxx/upcxx.hpp>
+#include <iostream>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+//Compares numbering the cells of a periodic FCC box in natural (x-major), Morton and Hilbert order, with
+//the ranks given slabs or runs along the curve from partitionCurve(). Reports the fraction of neighbors stored
+//within near_cells of a cell, the cache misses and cells per second of
+//applyStencil() on the CSR layout, the time to pack the halos, and for the partitions the largest rank's cell,
+//neighbor and halo counts. Cache misses are -1 where perf events are not available.
+//usage: CellOrder.out [box edge] [steps]
+
+//a few cache lines of floats either side
+const long long near_cells = 64;
+
+//counts the cache misses of the calling thread with perf_event_open
+class CacheMisses {
+    public:
+    CacheMisses(){
+#ifdef __linux__
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        m_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+    }
+    ~CacheMisses(){
+        if(m_fd >= 0) close(m_fd);
+    }
+    void start(){
+#ifdef __linux__
+        if(m_fd < 0) return;
+        ioctl(m_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(m_fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+    }
+    long long stop(){
+        long long count = -1;
+#ifdef __linux__
+        if(m_fd < 0) return -1;
+        ioctl(m_fd, PERF_EVENT_IOC_DISABLE, 0);
+        if(read(m_fd, &count, sizeof(count)) != sizeof(count)) count = -1;
+#endif
+        return count;
+    }
+
+    private:
+    int m_fd = -1;
+};
+
+double secondsSince(std::chrono::steady_clock::time_point start){
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void measure(const std::string& order, const std::string& partition, const LatticeDecomposition& decomp, int num_steps){
+    ProcessNode<float> proc_node;
+    proc_node.m_layout = CellLayout::CSR;
+    decomp.build(proc_node);
+    for(size_t i = 0; i < proc_node.m_num_data_nodes; i++) proc_node.m_values[i] = (float)(proc_node.m_global_ids[i] % 97);
+    proc_node.allocateBuffers();
+    proc_node.compileStencil();
+
+    size_t num_owned = proc_node.m_interior_cells.size() + proc_node.m_boundary_cells.size();
+    double near = 0.0;
+    for(size_t i = 0; i < num_owned; i++){
+        for(int32_t j : proc_node.neighbors(i)) near += std::abs((long long)j - (long long)i) <= near_cells;
+    }
+    size_t num_edges = proc_node.m_adj_offsets[num_owned];
+
+    StencilCoeffs<float> diffusion = {1.0f, 0.01f, -0.01f};
+    CacheMisses misses;
+    upcxx::barrier();
+    auto start = std::chrono::steady_clock::now();
+    misses.start();
+    for(int ts = 0; ts < num_steps; ts++){
+        applyStencil(diffusion, proc_node);
+        proc_node.swap();
+    }
+    long long stencil_misses = misses.stop();
+    double stencil_seconds = secondsSince(start);
+
+    size_t packed_cells = 0;
+    for(auto& pair : proc_node.m_pack_map) packed_cells += pair.second.size();
+    proc_node.compileExchangePlan(ExchangeMode::Push);
+    upcxx::barrier();
+    start = std::chrono::steady_clock::now();
+    for(int ts = 0; ts < num_steps; ts++){
+        proc_node.packData();
+        proc_node.recvAndUnpack();
+    }
+    double exchange_seconds = secondsSince(start);
+
+    double cells = sumOverRanks((double)num_owned);
+    double near_fraction = sumOverRanks(near) / sumOverRanks((double)num_edges);
+    double all_misses = sumOverRanks((double)stencil_misses);
+    double max_seconds = maxOverRanks(stencil_seconds);
+    double max_exchange_us = maxOverRanks(exchange_seconds*1e6/num_steps);
+    double max_cells = maxOverRanks((double)num_owned);
+    double max_neighbors = maxOverRanks((double)proc_node.m_pack_map.size());
+    double max_halo = maxOverRanks((double)(proc_node.m_num_data_nodes - num_owned));
+    double max_packed = maxOverRanks((double)packed_cells);
+    bool counted = upcxx::reduce_one(stencil_misses < 0 ? 1 : 0, upcxx::op_fast_add, 0).wait() == 0;
+    if(upcxx::rank_me() == 0){
+        std::cout << upcxx::rank_n() << "," << order << "," << partition << "," << cells << "," << near_fraction << "," <<
+                     (counted ? all_misses/(cells*num_steps) : -1.0) << "," << cells*num_steps/max_seconds << "," <<
+                     max_exchange_us << "," << max_cells << "," << max_neighbors << "," << max_halo << "," << max_packed << std::endl;
+    }
+    proc_node.clearExchangePlan();
+    for(auto it : proc_node.m_packed_data){
+        upcxx::delete_array(it.second);
+    }
+}
+
+int main(int argc, char** argv){
+    upcxx::init();
+
+    int edge = argc > 1 ? std::atoi(argv[1]) : 64;
+    int num_steps = argc > 2 ? std::atoi(argv[2]) : 50;
+    const char* order_names[3] = {"natural", "morton", "hilbert"};
+
+    if(upcxx::rank_me() == 0){
+        std::cout << "ranks,order,partition,cells,near_neighbor_fraction,stencil_misses_per_cell,cells_per_second," <<
+                     "exchange_us,max_cells,max_neighbor_ranks,max_halo_cells,max_packed_cells" << std::endl;
+    }
+    for(int order = 0; order < 3; order++){
+        LatticeDecomposition decomp = {{edge, edge, edge}, {upcxx::rank_n(), 1, 1}, LatticeType::FCC, {true, true, true}};
+        decomp.m_order = (CellOrder)order;
+        measure(order_names[order], "slabs", decomp, num_steps);
+        if(order == 0) continue;
+        decomp.partitionCurve(upcxx::rank_n());
+        measure(order_names[order], "curve", decomp, num_steps);
+    }
+
+    upcxx::barrier();
+    upcxx::finalize();
+    return 0;
+}
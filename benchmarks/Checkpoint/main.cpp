@@ -0,0 +1,105 @@
+
+#include "unicubemaker.hpp"
+#include "../common.hpp"
+
+#include <vector>
+#include <upcxx/upcxx.hpp>
+#include <iostream>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <cerrno>
+#include <cstring>
+#include <sys/stat.h>
+
+//Compares restarting from ProcessNode::restore() with rebuilding the decomposition from scratch on an FCC
+//box as the global size grows with a fixed rank count. Restore only touches a rank's own file and neighbors.
+//Checkpoints go to ./output/checkpoint.<rank>, the directory is created if missing. saved and restored tell
+//whether every rank's checkpoint() and restore() succeeded, valid whether the restored node matches.
+//usage: Checkpoint.out [largest box edge]
+
+double elapsedMs(std::chrono::steady_clock::time_point start){
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+//prints why a checkpoint call failed on this rank, errno is cleared before the call
+void reportFailure(const char* call, const std::string& path){
+    std::cerr << "rank " << upcxx::rank_me() << ": " << call << " of " << path << "." << upcxx::rank_me() <<
+                 " failed: " << (errno != 0 ? std::strerror(errno) : "file does not match this run") << std::endl;
+}
+
+bool allRanks(bool value){
+    return upcxx::reduce_one(value ? 0 : 1, upcxx::op_fast_add, 0).wait() == 0;
+}
+
+void freePacked(ProcessNode<float>& proc_node){
+    proc_node.clearExchangePlan();
+    for(auto it : proc_node.m_packed_data){
+        upcxx::delete_array(it.second);
+    }
+}
+
+int main(int argc, char** argv){
+    upcxx::init();
+
+    int max_edge = argc > 1 ? std::atoi(argv[1]) : 128;
+    int rank_dims[3];
+    factorRanks(upcxx::rank_n(), rank_dims);
+    std::string path = "./output/checkpoint";
+    if(::mkdir("./output", 0755) != 0 && errno != EEXIST){
+        std::cerr << "rank " << upcxx::rank_me() << ": cannot create ./output: " << std::strerror(errno) << std::endl;
+    }
+
+    if(upcxx::rank_me() == 0){
+        std::cout << "ranks,edge,max_local_cells,build_ms,checkpoint_ms,restore_ms,saved,restored,valid" << std::endl;
+    }
+    for(int edge = 16; edge <= max_edge; edge *= 2){
+        LatticeDecomposition decomp = {{edge, edge, edge}, {rank_dims[0], rank_dims[1], rank_dims[2]},
+                                       LatticeType::FCC, {true, true, true}};
+
+        ProcessNode<float> proc_node;
+        proc_node.m_layout = CellLayout::CSR;
+        upcxx::barrier();
+        auto start = std::chrono::steady_clock::now();
+        decomp.build(proc_node);
+        proc_node.compileExchangePlan(ExchangeMode::Push);
+        double build_ms = elapsedMs(start);
+        for(size_t i = 0; i < proc_node.m_num_data_nodes; i++) proc_node.m_values[i] = (float)proc_node.m_global_ids[i];
+        proc_node.allocateBuffers();
+
+        upcxx::barrier();
+        start = std::chrono::steady_clock::now();
+        errno = 0;
+        bool saved = proc_node.checkpoint(path);
+        double checkpoint_ms = elapsedMs(start);
+        if(!saved) reportFailure("checkpoint()", path);
+
+        ProcessNode<float> restored;
+        upcxx::barrier();
+        start = std::chrono::steady_clock::now();
+        errno = 0;
+        bool loaded = restored.restore(path);
+        double restore_ms = elapsedMs(start);
+        if(!loaded) reportFailure("restore()", path);
+        bool valid = loaded && restored.m_values == proc_node.m_values && restored.m_pack_map == proc_node.m_pack_map &&
+                     restored.m_plan.m_recv_ranks == proc_node.m_plan.m_recv_ranks;
+
+        long long max_cells = upcxx::reduce_one((long long)proc_node.m_num_data_nodes, upcxx::op_fast_max, 0).wait();
+        build_ms = maxOverRanks(build_ms);
+        checkpoint_ms = maxOverRanks(checkpoint_ms);
+        restore_ms = maxOverRanks(restore_ms);
+        bool all_saved = allRanks(saved);
+        bool all_loaded = allRanks(loaded);
+        bool all_valid = allRanks(valid);
+        if(upcxx::rank_me() == 0){
+            std::cout << upcxx::rank_n() << "," << edge << "," << max_cells << "," << build_ms << "," << checkpoint_ms <<
+                         "," << restore_ms << "," << all_saved << "," << all_loaded << "," << all_valid << std::endl;
+        }
+        freePacked(proc_node);
+        freePacked(restored);
+    }
+
+    upcxx::barrier();
+    upcxx::finalize();
+    return 0;
+}
@@ -0,0 +1,81 @@
+
+#include "unicubemaker.hpp"
+#include "../common.hpp"
+
+#include <vector>
+#include <upcxx/upcxx.hpp>
+#include <iostream>
+#include <chrono>
+#include <cstdlib>
+#include <unordered_map>
+
+//Measures LatticeDecomposition::build() on an FCC box as the global size grows with a fixed rank count,
+//next to the first pass of the old hand-rolled 3DFCC setup, which scanned the whole global box on every
+//rank and hashed the sites inside its block.
+//usage: DecompositionSetup.out [largest box edge]
+
+int main(int argc, char** argv){
+    upcxx::init();
+
+    int max_edge = argc > 1 ? std::atoi(argv[1]) : 128;
+    int rank_dims[3];
+    factorRanks(upcxx::rank_n(), rank_dims);
+
+    if(upcxx::rank_me() == 0){
+        std::cout << "ranks,edge,global_sites,max_local_cells,build_ms,hand_rolled_scan_ms" << std::endl;
+    }
+    for(int edge = 16; edge <= max_edge; edge *= 2){
+        LatticeDecomposition decomp = {{edge, edge, edge}, {rank_dims[0], rank_dims[1], rank_dims[2]},
+                                       LatticeType::FCC, {true, true, true}};
+
+        ProcessNode<float> proc_node;
+        upcxx::barrier();
+        auto start = std::chrono::steady_clock::now();
+        decomp.build(proc_node);
+        auto end = std::chrono::steady_clock::now();
+        double build_ms = std::chrono::duration<double, std::milli>(end - start).count();
+
+        //what every rank used to do before it could even start wiring its own block
+        int block_start[3], block_end[3];
+        decomp.rankBlock(upcxx::rank_me(), block_start, block_end);
+        start = std::chrono::steady_clock::now();
+        std::unordered_map<long long, int> global_to_local;
+        int idx = 0;
+        for(int x = 0; x < edge; x++){
+            for(int y = 0; y < edge; y++){
+                for(int z = 0; z < edge; z++){
+                    int p[3] = {x, y, z};
+                    if(!decomp.isSite(p)) continue;
+                    if(x >= block_start[0] && x < block_end[0] && y >= block_start[1] && y < block_end[1] &&
+                       z >= block_start[2] && z < block_end[2]){
+                        global_to_local[idx] = global_to_local.size();
+                    }
+                    idx++;
+                }
+            }
+        }
+        end = std::chrono::steady_clock::now();
+        double scan_ms = std::chrono::duration<double, std::milli>(end - start).count();
+
+        double max_build_ms = maxOverRanks(build_ms);
+        double max_scan_ms = maxOverRanks(scan_ms);
+        double max_local_cells = maxOverRanks((double)proc_node.m_num_data_nodes);
+        if(upcxx::rank_me() == 0){
+            std::cout << upcxx::rank_n() << "," << edge << "," << (long long)edge*edge*edge/2 << "," <<
+                         (long long)max_local_cells << "," << max_build_ms << "," << max_scan_ms << std::endl;
+        }
+
+        //memory clean up
+        for(size_t i = 0; i < proc_node.m_num_data_nodes; i++){
+            delete[] proc_node.m_data_nodes[i].m_neighbors;
+        }
+        delete[] proc_node.m_data_nodes;
+        for(auto it : proc_node.m_packed_data){
+            upcxx::delete_array(it.second);
+        }
+    }
+
+    upcxx::barrier();
+    upcxx::finalize();
+    return 0;
+}
@@ -0,0 +1,114 @@
+#include "unicubemaker.hpp"
+#include "../common.hpp"
+
+#include <vector>
+#include <upcxx/upcxx.hpp>
+#include <iostream>
+#include <chrono>
+#include <cstdlib>
+#include <cmath>
+#include <string>
+
+//Runs diffusion on a periodic box split over a 3D grid of ranks with halos 1 to max_width layers deep. A
+//halo k layers deep is exchanged every k steps and the steps in between also update the ghost layers they
+//still have valid inputs for, so latency is paid k times less often in exchange for bigger messages and
+//redundant work. Reports the time per step, the largest per-rank exchange, the cells updated per step
+//relative to the owned cells and the largest difference from the result with a one layer halo.
+//usage: DeepHalo.out [box edge] [steps] [max halo width]
+
+//runs num_steps steps with the given halo width and returns the owned cells in index order
+template <typename Lattice> std::vector<float> run(const std::string& lattice, int edge, int num_steps, int width){
+    int global_dims[3] = {edge, edge, edge};
+    int rank_dims[3];
+    factorRanks(upcxx::rank_n(), rank_dims);
+    bool periodic[3] = {true, true, true};
+    LatticeProcessNode<float, Lattice> proc_node;
+    proc_node.m_halo_width = width;
+    proc_node.build(global_dims, rank_dims, periodic);
+    proc_node.compileExchangePlan(ExchangeMode::Push);
+    proc_node.allocateBuffers();
+    proc_node.forEachRow(CellRegion::Owned, [&](int begin, int length){
+        for(int i = begin; i < begin + length; i++){
+            int p[3];
+            proc_node.globalCoords(i, p);
+            proc_node.m_values[i] = (float)(proc_node.m_decomp.globalIndex(p) % 101);
+        }
+    });
+
+    long long cells = 0;
+    for(int s = 0; s < width; s++){
+        for(int ring = 0; ring < width - 1 - s; ring++){
+            for(auto& row : proc_node.m_halo_rows[ring]) cells += row.second;
+        }
+    }
+    long long owned = (long long)proc_node.m_extent[0]*proc_node.m_extent[1]*proc_node.m_extent[2];
+    double work = (double)(owned*width + cells) / (owned*width);
+
+    float D = 0.05f;
+    StencilCoeffs<float> diffusion = {1.0f, D, -D};
+    upcxx::barrier();
+    auto start = std::chrono::steady_clock::now();
+    for(int step = 0; step < num_steps; step++){
+        int substep = step % width;
+        if(substep == 0){
+            proc_node.packData();
+            proc_node.beginExchange();
+            applyStencil(diffusion, proc_node, CellRegion::Interior);
+            proc_node.finishExchange();
+            applyStencil(diffusion, proc_node, CellRegion::Boundary, width - 1);
+        } else {
+            applyStencil(diffusion, proc_node, CellRegion::Owned, width - 1 - substep);
+        }
+        proc_node.swap();
+    }
+    auto end = std::chrono::steady_clock::now();
+    double local_us = std::chrono::duration<double, std::micro>(end - start).count() / num_steps;
+
+    double us = upcxx::reduce_one(local_us, upcxx::op_fast_max, 0).wait();
+    long long max_cells = upcxx::reduce_one((long long)proc_node.m_plan.m_send_indices.size(), upcxx::op_fast_max, 0).wait();
+    double max_work = upcxx::reduce_one(work, upcxx::op_fast_max, 0).wait();
+
+    std::vector<float> result;
+    proc_node.forEachRow(CellRegion::Owned, [&](int begin, int length){
+        result.insert(result.end(), proc_node.m_values.begin() + begin, proc_node.m_values.begin() + begin + length);
+    });
+    proc_node.clearExchangePlan();
+    for(auto it : proc_node.m_packed_data){
+        upcxx::delete_array(it.second);
+    }
+    if(upcxx::rank_me() == 0){
+        std::cout << upcxx::rank_n() << "," << lattice << "," << edge << "," << width << "," << us << "," <<
+                     max_cells << "," << max_work << ",";
+    }
+    return result;
+}
+
+template <typename Lattice> void sweepWidths(const std::string& lattice, int edge, int num_steps, int max_width){
+    std::vector<float> reference = run<Lattice>(lattice, edge, num_steps, 1);
+    if(upcxx::rank_me() == 0) std::cout << 0 << std::endl;
+    for(int width = 2; width <= max_width; width++){
+        std::vector<float> result = run<Lattice>(lattice, edge, num_steps, width);
+        float error = 0.0f;
+        for(size_t i = 0; i < result.size(); i++) error = std::max(error, std::fabs(result[i] - reference[i]));
+        error = upcxx::reduce_one(error, upcxx::op_fast_max, 0).wait();
+        if(upcxx::rank_me() == 0) std::cout << error << std::endl;
+    }
+}
+
+int main(int argc, char** argv){
+    upcxx::init();
+
+    int edge = argc > 1 ? std::atoi(argv[1]) : 32;
+    int num_steps = argc > 2 ? std::atoi(argv[2]) : 1200;
+    int max_width = argc > 3 ? std::atoi(argv[3]) : 4;
+
+    if(upcxx::rank_me() == 0){
+        std::cout << "ranks,lattice,edge,halo_width,us_per_step,max_cells_sent_per_exchange,work_per_owned_cell,max_error" << std::endl;
+    }
+    sweepWidths<CubicLattice<3>>("cubic", edge, num_steps, max_width);
+    sweepWidths<FCCLattice>("fcc", edge, num_steps, max_width);
+
+    upcxx::barrier();
+    upcxx::finalize();
+    return 0;
+}
@@ -0,0 +1,15 @@
+#!/bin/sh
+# Runs DeepHalo.out at every power of two rank count up to the given one, one CSV row per rank count,
+# lattice and halo width.
+# usage: sweep.sh [max ranks] [box edge] [steps] [max halo width]
+MAX_RANKS=${1:-64}
+EDGE=${2:-32}
+STEPS=${3:-1200}
+WIDTH=${4:-4}
+SKIP=1
+RANKS=1
+while [ $RANKS -le $MAX_RANKS ]; do
+    upcxx-run -n $RANKS ./DeepHalo.out $EDGE $STEPS $WIDTH | tail -n +$SKIP
+    SKIP=2
+    RANKS=$((RANKS * 2))
+done
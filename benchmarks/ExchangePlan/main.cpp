@@ -0,0 +1,114 @@
+
+#include "unicubemaker.hpp"
+
+#include <vector>
+#include <upcxx/upcxx.hpp>
+#include <iostream>
+#include <chrono>
+#include <cstdlib>
+
+//Compares the original recvAndUnpack() path (temporary shared heap arrays and hashed maps every call)
+//against the compiled exchange plan on a 1D periodic ring, in pull mode with barriers and in push mode without.
+//usage: ExchangePlan.out [halo cells per side] [iterations]
+
+//sets up a ring where each rank owns num_owned cells with num_halo ghost cells on either side
+void setupRing(ProcessNode<float>& proc_node, int num_owned, int num_halo){
+    int num_local_cells = num_owned + 2*num_halo;
+    proc_node.m_data_nodes = new DataNode<float>[num_local_cells];
+    for(int i = 0; i < num_local_cells; i++){
+        proc_node.m_data_nodes[i].m_num_neighbors = 0;
+        proc_node.m_data_nodes[i].m_neighbors = NULL;
+        proc_node.m_data_nodes[i].m_ghost = (i < num_halo || i >= num_halo + num_owned);
+        proc_node.m_data_nodes[i].m_data = proc_node.m_data_nodes[i].m_ghost ? -1.0f : (float)(upcxx::rank_me()*num_owned + i - num_halo);
+    }
+
+    int left = (upcxx::rank_me() + upcxx::rank_n() - 1) % upcxx::rank_n();
+    int right = (upcxx::rank_me() + 1) % upcxx::rank_n();
+    std::vector<int> first_owned, last_owned, left_ghosts, right_ghosts;
+    for(int i = 0; i < num_halo; i++){
+        first_owned.push_back(num_halo + i);
+        last_owned.push_back(num_owned + i);
+        left_ghosts.push_back(i);
+        right_ghosts.push_back(num_halo + num_owned + i);
+    }
+    //the left neighbor's last cells fill our left ghosts, the right neighbor's first cells fill our right ghosts
+    std::vector<int>& pack_left = proc_node.m_pack_map[left];
+    pack_left.insert(pack_left.end(), first_owned.begin(), first_owned.end());
+    std::vector<int>& pack_right = proc_node.m_pack_map[right];
+    pack_right.insert(pack_right.end(), last_owned.begin(), last_owned.end());
+    std::vector<int>& unpack_right = proc_node.m_unpack_map[right];
+    unpack_right.insert(unpack_right.end(), right_ghosts.begin(), right_ghosts.end());
+    std::vector<int>& unpack_left = proc_node.m_unpack_map[left];
+    unpack_left.insert(unpack_left.end(), left_ghosts.begin(), left_ghosts.end());
+
+    proc_node.allocatePackedData();
+    upcxx::barrier();
+    proc_node.bcastGPTRs();
+    upcxx::barrier();
+}
+
+bool ghostsValid(ProcessNode<float>& proc_node, int num_owned, int num_halo){
+    int num_cells = num_owned*upcxx::rank_n();
+    for(int i = 0; i < num_halo; i++){
+        int left_global = (upcxx::rank_me()*num_owned - num_halo + i + num_cells) % num_cells;
+        int right_global = ((upcxx::rank_me() + 1)*num_owned + i) % num_cells;
+        if(proc_node.m_data_nodes[i].m_data != (float)left_global) return false;
+        if(proc_node.m_data_nodes[num_halo + num_owned + i].m_data != (float)right_global) return false;
+    }
+    return true;
+}
+
+double timeExchange(ProcessNode<float>& proc_node, int num_iterations){
+    bool pull = proc_node.m_exchange_mode == ExchangeMode::Pull;
+    upcxx::barrier();
+    auto start = std::chrono::steady_clock::now();
+    for(int it = 0; it < num_iterations; it++){
+        proc_node.packData();
+        if(pull) upcxx::barrier();
+        proc_node.recvAndUnpack();
+        if(pull) upcxx::barrier();
+    }
+    auto end = std::chrono::steady_clock::now();
+    double local_us = std::chrono::duration<double, std::micro>(end - start).count() / num_iterations;
+    return upcxx::reduce_one(local_us, upcxx::op_fast_max, 0).wait();
+}
+
+int main(int argc, char** argv){
+    upcxx::init();
+
+    int num_halo = argc > 1 ? std::atoi(argv[1]) : 64;
+    int num_iterations = argc > 2 ? std::atoi(argv[2]) : 10000;
+    int num_owned = 4*num_halo;
+
+    ProcessNode<float> proc_node;
+    setupRing(proc_node, num_owned, num_halo);
+
+    double map_us = timeExchange(proc_node, num_iterations);
+    bool map_valid = upcxx::reduce_one(ghostsValid(proc_node, num_owned, num_halo) ? 0 : 1, upcxx::op_fast_add, 0).wait() == 0;
+
+    proc_node.compileExchangePlan();
+    double plan_us = timeExchange(proc_node, num_iterations);
+    bool plan_valid = upcxx::reduce_one(ghostsValid(proc_node, num_owned, num_halo) ? 0 : 1, upcxx::op_fast_add, 0).wait() == 0;
+
+    proc_node.compileExchangePlan(ExchangeMode::Push);
+    double push_us = timeExchange(proc_node, num_iterations);
+    bool push_valid = upcxx::reduce_one(ghostsValid(proc_node, num_owned, num_halo) ? 0 : 1, upcxx::op_fast_add, 0).wait() == 0;
+
+    if(upcxx::rank_me() == 0){
+        std::cout << "ranks,halo_cells,iterations,path,us_per_exchange,valid" << std::endl;
+        std::cout << upcxx::rank_n() << "," << num_halo << "," << num_iterations << ",maps," << map_us << "," << map_valid << std::endl;
+        std::cout << upcxx::rank_n() << "," << num_halo << "," << num_iterations << ",plan," << plan_us << "," << plan_valid << std::endl;
+        std::cout << upcxx::rank_n() << "," << num_halo << "," << num_iterations << ",push," << push_us << "," << push_valid << std::endl;
+    }
+
+    //memory clean up
+    proc_node.clearExchangePlan();
+    for(auto it : proc_node.m_packed_data){
+        upcxx::delete_array(it.second);
+    }
+    delete[] proc_node.m_data_nodes;
+
+    upcxx::barrier();
+    upcxx::finalize();
+    return 0;
+}
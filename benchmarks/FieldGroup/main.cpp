@@ -0,0 +1,133 @@
+#include "unicubemaker.hpp"
+
+#include <vector>
+#include <memory>
+#include <upcxx/upcxx.hpp>
+#include <iostream>
+#include <chrono>
+#include <cstdlib>
+
+//Exchanges the halos of several fields on a periodic FCC box, half of them float and half double, once with a
+//push mode plan per field and once through a FieldGroup that sends one message per neighbor for all of them.
+//The group is also timed with a mask holding only the float fields. Small boxes are dominated by per message
+//latency, which is what the group saves.
+//usage: FieldGroup.out [box edge] [fields] [iterations]
+
+struct Fields {
+    std::vector<std::unique_ptr<ProcessNode<float>>> m_floats;
+    std::vector<std::unique_ptr<ProcessNode<double>>> m_doubles;
+};
+
+void fill(Fields& fields, int it){
+    for(size_t f = 0; f < fields.m_floats.size(); f++){
+        ProcessNode<float>& node = *fields.m_floats[f];
+        for(size_t i = 0; i < node.m_num_data_nodes; i++) node.value(i) = node.isGhost(i) ? -1.0f : (float)(node.m_global_ids[i] + f + it);
+    }
+    for(size_t f = 0; f < fields.m_doubles.size(); f++){
+        ProcessNode<double>& node = *fields.m_doubles[f];
+        for(size_t i = 0; i < node.m_num_data_nodes; i++) node.value(i) = node.isGhost(i) ? -1.0 : (double)(node.m_global_ids[i] + f + it);
+    }
+}
+
+//counts the ghosts of fields in mask that do not hold their owner's value
+int countBad(Fields& fields, int it, unsigned long long mask){
+    int bad = 0;
+    int k = 0;
+    for(size_t f = 0; f < fields.m_floats.size(); f++, k++){
+        ProcessNode<float>& node = *fields.m_floats[f];
+        if(!(mask >> k & 1)) continue;
+        for(size_t i = 0; i < node.m_num_data_nodes; i++) if(node.value(i) != (float)(node.m_global_ids[i] + f + it)) bad++;
+    }
+    for(size_t f = 0; f < fields.m_doubles.size(); f++, k++){
+        ProcessNode<double>& node = *fields.m_doubles[f];
+        if(!(mask >> k & 1)) continue;
+        for(size_t i = 0; i < node.m_num_data_nodes; i++) if(node.value(i) != (double)(node.m_global_ids[i] + f + it)) bad++;
+    }
+    return upcxx::reduce_all(bad, upcxx::op_fast_add).wait();
+}
+
+double finish(std::chrono::steady_clock::time_point start, int num_iterations){
+    double local_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / num_iterations;
+    return upcxx::reduce_all(local_us, upcxx::op_fast_max).wait();
+}
+
+int main(int argc, char** argv){
+    upcxx::init();
+
+    int edge = argc > 1 ? std::atoi(argv[1]) : 16;
+    int num_fields = argc > 2 ? std::atoi(argv[2]) : 4;
+    int num_iterations = argc > 3 ? std::atoi(argv[3]) : 1000;
+
+    LatticeDecomposition decomp = {{edge, edge, edge}, {upcxx::rank_n(), 1, 1}, LatticeType::FCC, {true, true, true}};
+    decomp.m_order = CellOrder::Hilbert;
+    decomp.partitionCurve(upcxx::rank_n());
+    Fields fields;
+    for(int f = 0; f < num_fields; f++){
+        if(f < (num_fields + 1)/2){
+            fields.m_floats.emplace_back(new ProcessNode<float>());
+            fields.m_floats.back()->m_layout = CellLayout::CSR;
+            decomp.build(*fields.m_floats.back());
+        } else {
+            fields.m_doubles.emplace_back(new ProcessNode<double>());
+            fields.m_doubles.back()->m_layout = CellLayout::CSR;
+            decomp.build(*fields.m_doubles.back());
+        }
+    }
+    unsigned long long float_mask = (1ull << fields.m_floats.size()) - 1;
+
+    //one plan and one message per neighbor for every field
+    for(auto& node : fields.m_floats) node->compileExchangePlan(ExchangeMode::Push);
+    for(auto& node : fields.m_doubles) node->compileExchangePlan(ExchangeMode::Push);
+    fill(fields, 0);
+    upcxx::barrier();
+    auto start = std::chrono::steady_clock::now();
+    for(int it = 0; it < num_iterations; it++){
+        for(auto& node : fields.m_floats){ node->packData(); node->beginExchange(); }
+        for(auto& node : fields.m_doubles){ node->packData(); node->beginExchange(); }
+        for(auto& node : fields.m_floats) node->finishExchange();
+        for(auto& node : fields.m_doubles) node->finishExchange();
+    }
+    double separate_us = finish(start, num_iterations);
+    bool separate_valid = countBad(fields, 0, FieldGroup::all_fields) == 0;
+    for(auto& node : fields.m_floats) node->clearExchangePlan();
+    for(auto& node : fields.m_doubles) node->clearExchangePlan();
+
+    FieldGroup group;
+    for(auto& node : fields.m_floats) group.addField(*node);
+    for(auto& node : fields.m_doubles) group.addField(*node);
+    group.compile();
+    fill(fields, 1);
+    upcxx::barrier();
+    start = std::chrono::steady_clock::now();
+    for(int it = 0; it < num_iterations; it++){
+        group.packData();
+        group.recvAndUnpack();
+    }
+    double group_us = finish(start, num_iterations);
+    bool group_valid = countBad(fields, 1, FieldGroup::all_fields) == 0;
+
+    fill(fields, 2);
+    upcxx::barrier();
+    start = std::chrono::steady_clock::now();
+    for(int it = 0; it < num_iterations; it++){
+        group.packData(float_mask);
+        group.recvAndUnpack();
+    }
+    double masked_us = finish(start, num_iterations);
+    bool masked_valid = countBad(fields, 2, float_mask) == 0;
+    group.clear();
+
+    if(upcxx::rank_me() == 0){
+        std::cout << "ranks,edge,fields,iterations,exchange,fields_sent,us_per_exchange,valid" << std::endl;
+        std::cout << upcxx::rank_n() << "," << edge << "," << num_fields << "," << num_iterations << ",separate," <<
+                     num_fields << "," << separate_us << "," << separate_valid << std::endl;
+        std::cout << upcxx::rank_n() << "," << edge << "," << num_fields << "," << num_iterations << ",group," <<
+                     num_fields << "," << group_us << "," << group_valid << std::endl;
+        std::cout << upcxx::rank_n() << "," << edge << "," << num_fields << "," << num_iterations << ",group_masked," <<
+                     fields.m_floats.size() << "," << masked_us << "," << masked_valid << std::endl;
+    }
+
+    upcxx::barrier();
+    upcxx::finalize();
+    return 0;
+}
@@ -0,0 +1,132 @@
+#include "unicubemaker.hpp"
+
+#include <vector>
+#include <upcxx/upcxx.hpp>
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <string>
+#include <cstdlib>
+
+//Partitions an unstructured graph with the naive block split of its ids and with the multilevel partitioner,
+//then builds a ProcessNode from each and times push mode halo exchanges. The graph is read from an edge list
+//when a path is given, and is otherwise a random geometric graph in the unit square, a stand-in for an
+//irregular 2D mesh, whose ids are shuffled the way meshes from generators often are.
+//Prints the edge cut, imbalance, ghost cells over all ranks, partitioning time and exchange time of both.
+//usage: GraphPartition.out [vertices] [iterations] [edge list path]
+
+void randomGeometricGraph(GraphDecomposition& graph, long long num_vertices){
+    std::mt19937 rng(2024);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    //about 6 neighbors per vertex, found through a grid of buckets as wide as the connection radius
+    double radius = std::sqrt(6.0/(3.14159265358979*num_vertices));
+    int num_buckets = std::max(1, (int)(1.0/radius));
+    std::vector<double> x(num_vertices), y(num_vertices);
+    std::vector<std::vector<long long>> buckets((size_t)num_buckets*num_buckets);
+    std::vector<long long> ids(num_vertices);
+    for(long long v = 0; v < num_vertices; v++) ids[v] = v;
+    for(long long v = num_vertices - 1; v > 0; v--) std::swap(ids[v], ids[rng() % (v + 1)]);
+    for(long long v = 0; v < num_vertices; v++){
+        x[v] = uniform(rng);
+        y[v] = uniform(rng);
+        int bx = std::min(num_buckets - 1, (int)(x[v]*num_buckets));
+        int by = std::min(num_buckets - 1, (int)(y[v]*num_buckets));
+        buckets[(size_t)by*num_buckets + bx].push_back(v);
+    }
+    std::vector<std::pair<long long, long long>> edges;
+    for(int by = 0; by < num_buckets; by++){
+        for(int bx = 0; bx < num_buckets; bx++){
+            for(long long v : buckets[(size_t)by*num_buckets + bx]){
+                for(int ny = std::max(0, by - 1); ny <= std::min(num_buckets - 1, by + 1); ny++){
+                    for(int nx = std::max(0, bx - 1); nx <= std::min(num_buckets - 1, bx + 1); nx++){
+                        for(long long u : buckets[(size_t)ny*num_buckets + nx]){
+                            double dx = x[u] - x[v], dy = y[u] - y[v];
+                            if(u > v && dx*dx + dy*dy < radius*radius) edges.push_back(std::make_pair(ids[v], ids[u]));
+                        }
+                    }
+                }
+            }
+        }
+    }
+    graph.setEdges(num_vertices, edges);
+}
+
+struct RunResult {
+    long long edge_cut;
+    double imbalance;
+    long long ghosts;
+    double partition_seconds;
+    double us_per_exchange;
+    bool valid;
+};
+
+RunResult run(GraphDecomposition& graph, bool multilevel, int num_iterations){
+    RunResult result;
+    auto start = std::chrono::steady_clock::now();
+    if(multilevel) graph.partitionMultilevel(upcxx::rank_n());
+    else graph.partitionBlock(upcxx::rank_n());
+    result.partition_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.edge_cut = graph.edgeCut();
+    result.imbalance = graph.imbalance(upcxx::rank_n());
+
+    ProcessNode<double> proc_node;
+    proc_node.m_layout = CellLayout::CSR;
+    graph.build(proc_node);
+    size_t num_owned = proc_node.m_layer_ends[0];
+    result.ghosts = upcxx::reduce_all((long long)(proc_node.m_num_data_nodes - num_owned), upcxx::op_fast_add).wait();
+    for(size_t i = 0; i < proc_node.m_num_data_nodes; i++) proc_node.m_values[i] = i < num_owned ? proc_node.m_global_ids[i] : -1.0;
+    proc_node.compileExchangePlan(ExchangeMode::Push);
+
+    upcxx::barrier();
+    start = std::chrono::steady_clock::now();
+    for(int it = 0; it < num_iterations; it++){
+        proc_node.packData();
+        proc_node.recvAndUnpack();
+    }
+    double local_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / num_iterations;
+    result.us_per_exchange = upcxx::reduce_all(local_us, upcxx::op_fast_max).wait();
+
+    int bad = 0;
+    for(size_t i = 0; i < proc_node.m_num_data_nodes; i++){
+        if(proc_node.m_values[i] != (double)proc_node.m_global_ids[i]) bad++;
+    }
+    result.valid = upcxx::reduce_all(bad, upcxx::op_fast_add).wait() == 0;
+    proc_node.clearExchangePlan();
+    proc_node.releasePackedData();
+    return result;
+}
+
+int main(int argc, char** argv){
+    upcxx::init();
+
+    long long num_vertices = argc > 1 ? std::atoll(argv[1]) : 200000;
+    int num_iterations = argc > 2 ? std::atoi(argv[2]) : 1000;
+
+    GraphDecomposition graph;
+    bool loaded = true;
+    if(argc > 3) loaded = graph.loadEdgeList(argv[3]);
+    else randomGeometricGraph(graph, num_vertices);
+    if(!loaded){
+        if(upcxx::rank_me() == 0) std::cerr << "could not read edge list " << argv[3] << std::endl;
+        upcxx::finalize();
+        return 1;
+    }
+
+    RunResult block = run(graph, false, num_iterations);
+    RunResult multilevel = run(graph, true, num_iterations);
+
+    if(upcxx::rank_me() == 0){
+        std::cout << "ranks,vertices,edges,partition,edge_cut,imbalance,ghosts,partition_seconds,us_per_exchange,valid" << std::endl;
+        long long num_edges = graph.m_adjacency.size()/2;
+        std::cout << upcxx::rank_n() << "," << graph.numVertices() << "," << num_edges << ",block," << block.edge_cut << "," <<
+                     block.imbalance << "," << block.ghosts << "," << block.partition_seconds << "," << block.us_per_exchange <<
+                     "," << block.valid << std::endl;
+        std::cout << upcxx::rank_n() << "," << graph.numVertices() << "," << num_edges << ",multilevel," << multilevel.edge_cut << "," <<
+                     multilevel.imbalance << "," << multilevel.ghosts << "," << multilevel.partition_seconds << "," <<
+                     multilevel.us_per_exchange << "," << multilevel.valid << std::endl;
+    }
+
+    upcxx::barrier();
+    upcxx::finalize();
+    return 0;
+}
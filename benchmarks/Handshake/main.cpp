@@ -0,0 +1,101 @@
+#include "unicubemaker.hpp"
+
+#include <vector>
+#include <upcxx/upcxx.hpp>
+#include <iostream>
+#include <chrono>
+#include <cstdlib>
+
+//Times the setup handshake, in which every rank tells the ranks it packs for where their data is, as the
+//number of neighbors per rank grows. bcastGPTRs() has all RPCs in flight at once, the sequential version
+//waits for each one before sending the next, as bcastGPTRs() used to. Each rank packs for the next few ranks
+//on a ring only, so receivers have to learn their senders from the handshake.
+//usage: Handshake.out [largest neighbor count] [repetitions]
+
+//rank r packs one cell for each of the ranks r+1 .. r+num_neighbors
+void setupNeighbors(ProcessNode<float>& proc_node, int num_neighbors){
+    for(int k = 1; k <= num_neighbors; k++){
+        int process_id = (upcxx::rank_me() + k) % upcxx::rank_n();
+        proc_node.m_pack_map[process_id].push_back(0);
+    }
+    proc_node.allocatePackedData();
+}
+
+void sequentialHandshake(ProcessNode<float>& proc_node, upcxx::dist_object<ProcessNode<float>*>& self){
+    for(auto& pair : proc_node.m_packed_data){
+        int process_id = pair.first;
+        upcxx::rpc(process_id,
+                    [](upcxx::dist_object<ProcessNode<float>*>& self, upcxx::global_ptr<float> gptr, int source_rank,
+                       size_t data_size){
+                (*self)->m_neighbor_data[source_rank] = gptr;
+                (*self)->m_neighbor_data_sizes[source_rank] = data_size;
+            }, self, pair.second, upcxx::rank_me(), proc_node.m_packed_data_sizes.at(process_id)).wait();
+    }
+}
+
+//every rank heard from exactly the ranks that pack for it
+bool sendersValid(ProcessNode<float>& proc_node, int num_neighbors){
+    bool valid = (int)proc_node.m_neighbor_data.size() == num_neighbors;
+    for(int k = 1; k <= num_neighbors; k++){
+        int process_id = (upcxx::rank_me() - k + upcxx::rank_n()) % upcxx::rank_n();
+        if(proc_node.m_neighbor_data.count(process_id) == 0) valid = false;
+    }
+    return upcxx::reduce_one(valid ? 0 : 1, upcxx::op_fast_add, 0).wait() == 0;
+}
+
+void freeNeighbors(ProcessNode<float>& proc_node){
+    for(auto it : proc_node.m_packed_data){
+        upcxx::delete_array(it.second);
+    }
+}
+
+int main(int argc, char** argv){
+    upcxx::init();
+
+    int max_neighbors = argc > 1 ? std::atoi(argv[1]) : 64;
+    int num_repetitions = argc > 2 ? std::atoi(argv[2]) : 20;
+    max_neighbors = std::min(max_neighbors, upcxx::rank_n() - 1);
+
+    if(upcxx::rank_me() == 0){
+        std::cout << "ranks,neighbors,method,ms_per_handshake,valid" << std::endl;
+    }
+    for(int num_neighbors = 1; num_neighbors <= max_neighbors; num_neighbors *= 2){
+        double sequential_ms = 0.0, concurrent_ms = 0.0;
+        bool sequential_valid = true, concurrent_valid = true;
+        for(int rep = 0; rep < num_repetitions; rep++){
+            ProcessNode<float> sequential;
+            upcxx::dist_object<ProcessNode<float>*> self(&sequential);
+            setupNeighbors(sequential, num_neighbors);
+            upcxx::barrier();
+            auto start = std::chrono::steady_clock::now();
+            sequentialHandshake(sequential, self);
+            upcxx::barrier();
+            auto end = std::chrono::steady_clock::now();
+            sequential_ms += std::chrono::duration<double, std::milli>(end - start).count();
+            sequential_valid = sendersValid(sequential, num_neighbors) && sequential_valid;
+            freeNeighbors(sequential);
+
+            ProcessNode<float> concurrent;
+            setupNeighbors(concurrent, num_neighbors);
+            upcxx::barrier();
+            start = std::chrono::steady_clock::now();
+            concurrent.bcastGPTRs();
+            upcxx::barrier();
+            end = std::chrono::steady_clock::now();
+            concurrent_ms += std::chrono::duration<double, std::milli>(end - start).count();
+            concurrent_valid = sendersValid(concurrent, num_neighbors) && concurrent_valid;
+            freeNeighbors(concurrent);
+            upcxx::barrier();
+        }
+        sequential_ms = upcxx::reduce_one(sequential_ms / num_repetitions, upcxx::op_fast_max, 0).wait();
+        concurrent_ms = upcxx::reduce_one(concurrent_ms / num_repetitions, upcxx::op_fast_max, 0).wait();
+        if(upcxx::rank_me() == 0){
+            std::cout << upcxx::rank_n() << "," << num_neighbors << ",sequential," << sequential_ms << "," << sequential_valid << std::endl;
+            std::cout << upcxx::rank_n() << "," << num_neighbors << ",concurrent," << concurrent_ms << "," << concurrent_valid << std::endl;
+        }
+    }
+
+    upcxx::barrier();
+    upcxx::finalize();
+    return 0;
+}
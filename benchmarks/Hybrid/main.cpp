@@ -0,0 +1,78 @@
+#include "unicubemaker.hpp"
+#include "../common.hpp"
+
+#include <vector>
+#include <upcxx/upcxx.hpp>
+#include <iostream>
+#include <chrono>
+#include <cstdlib>
+
+//Runs the FCC diffusion with split-phase push exchanges on a fixed periodic box, with each rank driving a
+//ThreadPool for packing, unpacking and the stencil. Launched by scaling.sh with ranks*threads held at a
+//fixed core count, it compares one process per core against a few processes with many threads each.
+//halo_cells is the number of ghost cells summed over all ranks and total_amount checks that every
+//configuration computed the same thing.
+//usage: Hybrid.out [threads per rank] [box edge] [steps]
+
+int main(int argc, char** argv){
+    upcxx::init();
+
+    int num_threads = argc > 1 ? std::atoi(argv[1]) : 1;
+    int edge = argc > 2 ? std::atoi(argv[2]) : 128;
+    int num_steps = argc > 3 ? std::atoi(argv[3]) : 100;
+    int rank_dims[3];
+    factorRanks(upcxx::rank_n(), rank_dims);
+
+    LatticeDecomposition decomp = {{edge, edge, edge}, {rank_dims[0], rank_dims[1], rank_dims[2]},
+                                   LatticeType::FCC, {true, true, true}};
+    ThreadPool pool(num_threads);
+    ProcessNode<float> proc_node;
+    proc_node.m_layout = CellLayout::CSR;
+    proc_node.m_thread_pool = &pool;
+    decomp.build(proc_node);
+    proc_node.compileExchangePlan(ExchangeMode::Push);
+    for(size_t i = 0; i < proc_node.m_num_data_nodes; i++){
+        proc_node.m_values[i] = (float)(proc_node.m_global_ids[i] % 97);
+    }
+    proc_node.allocateBuffers();
+
+    float D = 0.01;
+    StencilCoeffs<float> diffusion = {1.0f, D, -D};
+    upcxx::barrier();
+    auto start = std::chrono::steady_clock::now();
+    for(int ts = 0; ts < num_steps; ts++){
+        proc_node.packData();
+        proc_node.beginExchange();
+        applyStencil(diffusion, proc_node, CellRegion::Interior);
+        proc_node.finishExchange();
+        applyStencil(diffusion, proc_node, CellRegion::Boundary);
+        proc_node.swap();
+    }
+    auto end = std::chrono::steady_clock::now();
+    double local_seconds = std::chrono::duration<double>(end - start).count();
+
+    size_t num_owned = proc_node.m_interior_cells.size() + proc_node.m_boundary_cells.size();
+    double local_amount = 0.0;
+    for(size_t i = 0; i < num_owned; i++) local_amount += proc_node.m_values[i];
+    double seconds = upcxx::reduce_one(local_seconds, upcxx::op_fast_max, 0).wait();
+    double total_amount = upcxx::reduce_one(local_amount, upcxx::op_fast_add, 0).wait();
+    long long num_cells = upcxx::reduce_one((long long)num_owned, upcxx::op_fast_add, 0).wait();
+    long long halo_cells = upcxx::reduce_one((long long)(proc_node.m_num_data_nodes - num_owned), upcxx::op_fast_add, 0).wait();
+
+    if(upcxx::rank_me() == 0){
+        std::cout << "ranks,threads_per_rank,cores,cells,halo_cells,ms_per_step,cells_per_second,total_amount" << std::endl;
+        std::cout << upcxx::rank_n() << "," << num_threads << "," << upcxx::rank_n()*num_threads << "," << num_cells << "," <<
+                     halo_cells << "," << 1000.0*seconds/num_steps << "," << (double)num_cells*num_steps/seconds << "," <<
+                     total_amount << std::endl;
+    }
+
+    //memory clean up
+    proc_node.clearExchangePlan();
+    for(auto it : proc_node.m_packed_data){
+        upcxx::delete_array(it.second);
+    }
+
+    upcxx::barrier();
+    upcxx::finalize();
+    return 0;
+}
@@ -0,0 +1,15 @@
+#!/bin/sh
+# Runs Hybrid.out at a fixed core count with every split into ranks x threads, one CSV row per split.
+# usage: scaling.sh [cores] [box edge] [steps]
+CORES=${1:-64}
+EDGE=${2:-128}
+STEPS=${3:-100}
+SKIP=1
+RANKS=$CORES
+while [ $RANKS -ge 1 ]; do
+    if [ $((CORES % RANKS)) -eq 0 ]; then
+        upcxx-run -n $RANKS ./Hybrid.out $((CORES / RANKS)) $EDGE $STEPS | tail -n +$SKIP
+        SKIP=2
+    fi
+    RANKS=$((RANKS - 1))
+done
@@ -0,0 +1,90 @@
+
+#include "unicubemaker.hpp"
+
+#include <vector>
+#include <upcxx/upcxx.hpp>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <thread>
+#include <cstdlib>
+
+//Runs push exchanges on a 1D periodic ring where the last rank sleeps before packing, then writes each rank's
+//counters to ./output/<rank>_comms.csv and the load imbalance summary to stdout. The straggler should show
+//up as the rank with the least wait time, its neighbors as the slowest.
+//Build with -DUNICUBE_INSTRUMENT, without it the counters stay empty.
+//usage: Instrumentation.out [halo cells per side] [iterations] [straggler delay in us]
+
+void setupRing(ProcessNode<float>& proc_node, int num_owned, int num_halo){
+    int num_local_cells = num_owned + 2*num_halo;
+    proc_node.m_data_nodes = new DataNode<float>[num_local_cells];
+    for(int i = 0; i < num_local_cells; i++){
+        proc_node.m_data_nodes[i].m_num_neighbors = 0;
+        proc_node.m_data_nodes[i].m_neighbors = NULL;
+        proc_node.m_data_nodes[i].m_ghost = (i < num_halo || i >= num_halo + num_owned);
+        proc_node.m_data_nodes[i].m_data = (float)i;
+    }
+
+    int left = (upcxx::rank_me() + upcxx::rank_n() - 1) % upcxx::rank_n();
+    int right = (upcxx::rank_me() + 1) % upcxx::rank_n();
+    for(int i = 0; i < num_halo; i++){
+        proc_node.m_pack_map[left].push_back(num_halo + i);
+        proc_node.m_pack_map[right].push_back(num_owned + i);
+        proc_node.m_unpack_map[right].push_back(num_halo + num_owned + i);
+        proc_node.m_unpack_map[left].push_back(i);
+    }
+
+    proc_node.allocatePackedData();
+    upcxx::barrier();
+    proc_node.bcastGPTRs();
+    upcxx::barrier();
+}
+
+int main(int argc, char** argv){
+    upcxx::init();
+
+    int num_halo = argc > 1 ? std::atoi(argv[1]) : 64;
+    int num_iterations = argc > 2 ? std::atoi(argv[2]) : 1000;
+    int delay_us = argc > 3 ? std::atoi(argv[3]) : 200;
+    int num_owned = 4*num_halo;
+
+    ProcessNode<float> proc_node;
+    setupRing(proc_node, num_owned, num_halo);
+    proc_node.compileExchangePlan(ExchangeMode::Push);
+
+    //only the exchanges are counted, not the setup
+    proc_node.m_stats.clear();
+    bool straggler = upcxx::rank_me() == upcxx::rank_n() - 1;
+    for(int it = 0; it < num_iterations; it++){
+        if(straggler) std::this_thread::sleep_for(std::chrono::microseconds(delay_us));
+        proc_node.packData();
+        proc_node.recvAndUnpack();
+    }
+    //the pull path needs a barrier per exchange, which is counted as well
+    proc_node.compileExchangePlan(ExchangeMode::Pull);
+    for(int it = 0; it < num_iterations; it++){
+        proc_node.packData();
+        proc_node.barrier();
+        proc_node.recvAndUnpack();
+        proc_node.barrier();
+    }
+
+    std::stringstream output_name;
+    output_name << "./output/" << upcxx::rank_me() << "_comms.csv";
+    std::ofstream output(output_name.str());
+    proc_node.m_stats.dump(output);
+    output.close();
+    proc_node.m_stats.summarize(std::cout);
+
+    //memory clean up
+    proc_node.clearExchangePlan();
+    for(auto it : proc_node.m_packed_data){
+        upcxx::delete_array(it.second);
+    }
+    delete[] proc_node.m_data_nodes;
+
+    upcxx::barrier();
+    upcxx::finalize();
+    return 0;
+}
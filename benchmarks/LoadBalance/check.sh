@@ -0,0 +1,9 @@
+#!/bin/sh
+# Builds LoadBalance.out for the smp conduit and runs it, failing unless the rebalanced run matches the
+# static one and ends less imbalanced than it started.
+# usage: check.sh [ranks]
+RANKS=${1:-4}
+make -s NETWORK=smp || exit 1
+upcxx-run -n $RANKS ./LoadBalance.out > check.csv || exit 1
+cat check.csv
+tail -n 1 check.csv | awk -F, '{ exit !($9 == 1 && $5 > 0 && $7 < $6) }'
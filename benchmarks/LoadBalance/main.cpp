@@ -0,0 +1,120 @@
+#include "unicubemaker.hpp"
+
+#include <vector>
+#include <upcxx/upcxx.hpp>
+#include <iostream>
+#include <chrono>
+#include <cstdlib>
+#include <cmath>
+
+//Runs diffusion on a periodic FCC box split along a Hilbert curve, where the cells near a hotspot cost many
+//times more than the rest, once with the initial equal split and once calling rebalance() every few steps.
+//Prints the compute imbalance (slowest rank over the mean) at the start and end of each run and the wall
+//time, and checks the rebalanced run ends with the same cells as the static one.
+//usage: LoadBalance.out [box edge] [steps] [steps between rebalances] [hot cell cost]
+
+//stands in for expensive physics at the cells within radius of the hotspot
+volatile double sink = 0.0;
+void hotWork(int cost){
+    double x = sink;
+    for(int k = 0; k < cost; k++) x = std::sqrt(x + k);
+    sink = x;
+}
+
+struct RunResult {
+    double first_imbalance;
+    double last_imbalance;
+    double seconds;
+    double checksum;
+    int rebalances;
+};
+
+double imbalance(double local_seconds){
+    double slowest = upcxx::reduce_all(local_seconds, upcxx::op_fast_max).wait();
+    double total = upcxx::reduce_all(local_seconds, upcxx::op_fast_add).wait();
+    return total > 0.0 ? slowest/(total/upcxx::rank_n()) : 1.0;
+}
+
+RunResult run(int edge, int num_steps, int interval, int cost){
+    LatticeDecomposition decomp = {{edge, edge, edge}, {upcxx::rank_n(), 1, 1}, LatticeType::FCC, {true, true, true}};
+    decomp.partitionCurve(upcxx::rank_n());
+    ProcessNode<double> proc_node;
+    proc_node.m_layout = CellLayout::CSR;
+    decomp.build(proc_node);
+    for(size_t i = 0; i < proc_node.m_num_data_nodes; i++) proc_node.m_values[i] = (double)(proc_node.m_global_ids[i] % 101);
+    proc_node.allocateBuffers();
+    proc_node.compileExchangePlan(ExchangeMode::Push);
+
+    StencilCoeffs<double> diffusion = {1.0, 0.01, -0.01};
+    int hotspot[3] = {edge/4, edge/4, edge/4};
+    double radius2 = (edge/6.0)*(edge/6.0);
+    RunResult result = {0.0, 0.0, 0.0, 0.0, 0};
+    StepTimer timer;
+    upcxx::barrier();
+    auto start = std::chrono::steady_clock::now();
+    for(int ts = 1; ts <= num_steps; ts++){
+        proc_node.packData();
+        proc_node.beginExchange();
+        timer.start();
+        applyStencil(diffusion, proc_node, CellRegion::Interior);
+        timer.stop();
+        proc_node.finishExchange();
+        timer.start();
+        applyStencil(diffusion, proc_node, CellRegion::Boundary);
+        size_t num_owned = proc_node.m_layer_ends[0];
+        for(size_t i = 0; i < num_owned; i++){
+            int p[3];
+            decomp.globalCoords(proc_node.m_global_ids[i], p);
+            double r2 = 0.0;
+            for(int d = 0; d < 3; d++) r2 += (double)(p[d] - hotspot[d])*(p[d] - hotspot[d]);
+            if(r2 < radius2) hotWork(cost);
+        }
+        timer.stop();
+        proc_node.swap();
+
+        if(ts % interval == 0){
+            double measured = imbalance(timer.m_seconds);
+            if(ts == interval) result.first_imbalance = measured;
+            result.last_imbalance = measured;
+            if(interval < num_steps && decomp.rebalance(proc_node, timer.m_seconds)) result.rebalances++;
+            timer.reset();
+        }
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    //order independent fingerprint of the owned cells
+    double checksum = 0.0;
+    for(size_t i = 0; i < proc_node.m_layer_ends[0]; i++){
+        checksum += proc_node.m_values[i]*(1.0 + (proc_node.m_global_ids[i] % 13));
+    }
+    result.checksum = upcxx::reduce_all(checksum, upcxx::op_fast_add).wait();
+    result.seconds = upcxx::reduce_all(result.seconds, upcxx::op_fast_max).wait();
+    proc_node.clearExchangePlan();
+    proc_node.releasePackedData();
+    return result;
+}
+
+int main(int argc, char** argv){
+    upcxx::init();
+
+    int edge = argc > 1 ? std::atoi(argv[1]) : 32;
+    int num_steps = argc > 2 ? std::atoi(argv[2]) : 200;
+    int interval = argc > 3 ? std::atoi(argv[3]) : 20;
+    int cost = argc > 4 ? std::atoi(argv[4]) : 2000;
+
+    RunResult fixed = run(edge, num_steps, num_steps, cost);
+    RunResult balanced = run(edge, num_steps, interval, cost);
+    bool valid = std::fabs(fixed.checksum - balanced.checksum) <= 1e-9*std::fabs(fixed.checksum);
+
+    if(upcxx::rank_me() == 0){
+        std::cout << "ranks,edge,steps,run,rebalances,first_imbalance,last_imbalance,seconds,valid" << std::endl;
+        std::cout << upcxx::rank_n() << "," << edge << "," << num_steps << ",static,0," << fixed.first_imbalance << "," <<
+                     fixed.last_imbalance << "," << fixed.seconds << ",1" << std::endl;
+        std::cout << upcxx::rank_n() << "," << edge << "," << num_steps << ",rebalanced," << balanced.rebalances << "," <<
+                     balanced.first_imbalance << "," << balanced.last_imbalance << "," << balanced.seconds << "," << valid << std::endl;
+    }
+
+    upcxx::barrier();
+    upcxx::finalize();
+    return 0;
+}
@@ -0,0 +1,111 @@
+#include "unicubemaker.hpp"
+#include "../common.hpp"
+
+#include <vector>
+#include <upcxx/upcxx.hpp>
+#include <iostream>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+
+//Compares the direct halo exchange of a LatticeProcessNode, which sends to every rank whose block the lattice
+//reaches (up to 26 in 3D), with the x->y->z sweep from compileSweep(), which sends only to face neighbors and
+//forwards edges and corners. Reports the largest per-rank message and cell counts of one exchange and its
+//latency on a periodic box split over a 3D grid of ranks.
+//usage: Schedule.out [box edge] [iterations]
+
+//every halo cell an owned cell reads holds the global index of the site it images
+template <typename Lattice> bool ghostsValid(LatticeProcessNode<double, Lattice>& proc_node){
+    bool valid = true;
+    proc_node.forEachRow(CellRegion::Owned, [&](int begin, int length){
+        for(int i = begin; i < begin + length; i++){
+            for(int k = 0; k < Lattice::num_neighbors; k++){
+                int j = i + proc_node.m_strides[k];
+                int p[3];
+                proc_node.globalCoords(j, p);
+                proc_node.m_decomp.wrap(p);
+                if(proc_node.m_values[j] != (double)proc_node.m_decomp.globalIndex(p)) valid = false;
+            }
+        }
+    });
+    return upcxx::reduce_one(valid ? 0 : 1, upcxx::op_fast_add, 0).wait() == 0;
+}
+
+template <typename Lattice> void report(LatticeProcessNode<double, Lattice>& proc_node, const std::string& lattice,
+                                        const std::string& mode, int edge, int num_iterations){
+    long long messages = 0, cells = 0;
+    if(proc_node.m_schedule_plans.empty()){
+        messages = proc_node.m_plan.m_send_ranks.size();
+        cells = proc_node.m_plan.m_send_indices.size();
+    }
+    for(auto& plan : proc_node.m_schedule_plans){
+        messages += plan.m_send_ranks.size();
+        cells += plan.m_send_indices.size();
+    }
+
+    //every exchange rewrites the halos from the owned cells, which never change
+    upcxx::barrier();
+    auto start = std::chrono::steady_clock::now();
+    for(int it = 0; it < num_iterations; it++){
+        proc_node.packData();
+        proc_node.beginExchange();
+        proc_node.finishExchange();
+    }
+    auto end = std::chrono::steady_clock::now();
+    double local_us = std::chrono::duration<double, std::micro>(end - start).count() / num_iterations;
+
+    double us = upcxx::reduce_one(local_us, upcxx::op_fast_max, 0).wait();
+    long long max_messages = upcxx::reduce_one(messages, upcxx::op_fast_max, 0).wait();
+    long long max_cells = upcxx::reduce_one(cells, upcxx::op_fast_max, 0).wait();
+    bool valid = ghostsValid(proc_node);
+    if(upcxx::rank_me() == 0){
+        std::cout << upcxx::rank_n() << "," << lattice << "," << edge << "," << mode << "," << max_messages << "," <<
+                     max_cells << "," << us << "," << valid << std::endl;
+    }
+}
+
+template <typename Lattice> void compare(const std::string& lattice, int edge, int num_iterations){
+    int global_dims[3] = {edge, edge, edge};
+    int rank_dims[3];
+    factorRanks(upcxx::rank_n(), rank_dims);
+    bool periodic[3] = {true, true, true};
+    LatticeProcessNode<double, Lattice> proc_node;
+    proc_node.build(global_dims, rank_dims, periodic);
+    proc_node.forEachRow(CellRegion::Owned, [&](int begin, int length){
+        for(int i = begin; i < begin + length; i++){
+            int p[3];
+            proc_node.globalCoords(i, p);
+            proc_node.m_values[i] = proc_node.m_decomp.globalIndex(p);
+        }
+    });
+
+    proc_node.compileExchangePlan(ExchangeMode::Push);
+    report(proc_node, lattice, "direct", edge, num_iterations);
+    proc_node.compileSweep();
+    report(proc_node, lattice, "sweep", edge, num_iterations);
+
+    proc_node.clearSchedule();
+    proc_node.clearExchangePlan();
+    for(auto it : proc_node.m_packed_data){
+        upcxx::delete_array(it.second);
+    }
+}
+
+int main(int argc, char** argv){
+    upcxx::init();
+
+    int edge = argc > 1 ? std::atoi(argv[1]) : 32;
+    int num_iterations = argc > 2 ? std::atoi(argv[2]) : 1000;
+
+    if(upcxx::rank_me() == 0){
+        std::cout << "ranks,lattice,edge,mode,max_messages_per_rank,max_cells_sent_per_rank,us_per_exchange,valid" << std::endl;
+    }
+    compare<CubicLattice<3>>("cubic", edge, num_iterations);
+    compare<FCCLattice>("fcc", edge, num_iterations);
+    compare<BCCLattice>("bcc", edge, num_iterations);
+    compare<MooreLattice>("moore", edge, num_iterations);
+
+    upcxx::barrier();
+    upcxx::finalize();
+    return 0;
+}
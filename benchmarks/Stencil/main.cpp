@@ -0,0 +1,212 @@
+#include "unicubemaker.hpp"
+#include "../common.hpp"
+
+#include <vector>
+#include <upcxx/upcxx.hpp>
+#include <iostream>
+#include <chrono>
+#include <cstdlib>
+#include <cmath>
+#include <string>
+
+//Measures one diffusion step over the owned cells of a periodic FCC box, without communication, as the
+//loop from the 3DFCC example (a fresh DataNode array every step, pointer chasing and a ghost branch per
+//cell) and as applyStencil() on the CSR layout and on a LatticeProcessNode, at every SIMD level the CPU
+//supports. max_error is against the CSR scalar result, or the dense scalar result for the dense rows. The
+//open rows repeat the CSR and dense steps on a simple cubic box with open boundaries, where max_error is
+//against the CSR scalar result in both, so the dense rows show whether the cells on the faces get their true
+//degree.
+//usage: Stencil.out [box edge] [steps]
+
+const float D = 0.01f;
+
+void report(const std::string& variant, const std::string& simd, size_t local_cells, int num_steps,
+            double local_seconds, double local_error){
+    double cells = sumOverRanks((double)local_cells*num_steps);
+    double seconds = maxOverRanks(local_seconds);
+    double error = maxOverRanks(local_error);
+    if(upcxx::rank_me() == 0){
+        std::cout << upcxx::rank_n() << "," << cells/num_steps << "," << variant << "," << simd << "," <<
+                     cells/seconds << "," << error << std::endl;
+    }
+}
+
+template <typename F> double timeSteps(int num_steps, F step){
+    upcxx::barrier();
+    auto start = std::chrono::steady_clock::now();
+    for(int ts = 0; ts < num_steps; ts++) step();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(end - start).count();
+}
+
+int main(int argc, char** argv){
+    upcxx::init();
+
+    int edge = argc > 1 ? std::atoi(argv[1]) : 64;
+    int num_steps = argc > 2 ? std::atoi(argv[2]) : 100;
+    const char* simd_names[3] = {"scalar", "avx2", "avx512"};
+    int best_level = (int)detectSimdLevel();
+    StencilCoeffs<float> diffusion = {1.0f, D, -D};
+
+    if(upcxx::rank_me() == 0){
+        std::cout << "ranks,cells,variant,simd,cells_per_second,max_error" << std::endl;
+    }
+
+    LatticeDecomposition decomp = {{edge, edge, edge}, {upcxx::rank_n(), 1, 1}, LatticeType::FCC, {true, true, true}};
+
+    //the example loop
+    ProcessNode<float> nodes;
+    decomp.build(nodes);
+    size_t num_local_cells = nodes.m_num_data_nodes;
+    size_t num_owned = 0;
+    for(size_t i = 0; i < num_local_cells; i++){
+        nodes.m_data_nodes[i].m_data = (float)(nodes.m_global_ids[i] % 97);
+        if(!nodes.m_data_nodes[i].m_ghost) num_owned++;
+    }
+    double seconds = timeSteps(num_steps, [&](){
+        DataNode<float>* new_data = new DataNode<float>[num_local_cells];
+        for(size_t i = 0; i < num_local_cells; i++){
+            DataNode<float>* dn = &nodes.m_data_nodes[i];
+            if(dn->m_ghost) continue;
+            new_data[i].m_data = dn->m_data;
+            for(int j = 0; j < dn->m_num_neighbors; j++){
+                new_data[i].m_data += D*dn->m_neighbors[j]->m_data;
+            }
+            new_data[i].m_data -= D*(float)dn->m_num_neighbors*dn->m_data;
+        }
+        for(size_t i = 0; i < num_local_cells; i++){
+            if(!nodes.m_data_nodes[i].m_ghost) nodes.m_data_nodes[i].m_data = new_data[i].m_data;
+        }
+        delete[] new_data;
+    });
+    report("example_loop", "scalar", num_owned, num_steps, seconds, 0.0);
+
+    //CSR, the state is reset before every level so that all of them compute the same steps
+    ProcessNode<float> csr;
+    csr.m_layout = CellLayout::CSR;
+    decomp.build(csr);
+    std::vector<float> initial(csr.m_num_data_nodes), reference;
+    for(size_t i = 0; i < initial.size(); i++) initial[i] = (float)(csr.m_global_ids[i] % 97);
+    for(int level = 0; level <= best_level; level++){
+        csr.m_values = initial;
+        csr.allocateBuffers();
+        seconds = timeSteps(num_steps, [&](){
+            applyStencil(diffusion, csr, CellRegion::Owned, 0, (SimdLevel)level);
+            csr.swap();
+        });
+        if(level == 0) reference = csr.m_values;
+        double error = 0.0;
+        for(size_t i = 0; i < initial.size(); i++){
+            if(!csr.isGhost(i)) error = std::max(error, (double)std::fabs(csr.m_values[i] - reference[i]));
+        }
+        report("csr", simd_names[level], csr.m_interior_cells.size() + csr.m_boundary_cells.size(), num_steps, seconds, error);
+    }
+
+    //dense lattice in primitive coordinates with the same number of sites
+    LatticeProcessNode<float, FCCLattice> dense;
+    int global_dims[3] = {edge, edge, edge/2};
+    int rank_dims[3] = {upcxx::rank_n(), 1, 1};
+    bool periodic[3] = {true, true, true};
+    dense.build(global_dims, rank_dims, periodic);
+    size_t num_dense_owned = 0;
+    dense.forEachRow(CellRegion::Owned, [&](int, int length){ num_dense_owned += length; });
+    initial.assign(dense.m_num_data_nodes, 0.0f);
+    for(size_t i = 0; i < initial.size(); i++){
+        int p[3];
+        dense.globalCoords(i, p);
+        initial[i] = (float)((p[0]*31 + p[1]*7 + p[2]) % 97);
+    }
+    for(int level = 0; level <= best_level; level++){
+        dense.m_values = initial;
+        dense.allocateBuffers();
+        seconds = timeSteps(num_steps, [&](){
+            applyStencil(diffusion, dense, CellRegion::Owned, 0, (SimdLevel)level);
+            dense.swap();
+        });
+        if(level == 0) reference = dense.m_values;
+        double error = 0.0;
+        dense.forEachRow(CellRegion::Owned, [&](int begin, int length){
+            for(int i = begin; i < begin + length; i++){
+                error = std::max(error, (double)std::fabs(dense.m_values[i] - reference[i]));
+            }
+        });
+        report("dense", simd_names[level], num_dense_owned, num_steps, seconds, error);
+    }
+
+    //open boundaries, the CSR result is kept by global coordinates for the dense rows to compare against
+    LatticeDecomposition open_decomp = {{edge, edge, edge}, {upcxx::rank_n(), 1, 1}, LatticeType::SimpleCubic,
+                                        {false, false, false}};
+    auto open_initial = [&](const int p[3]){ return (float)((p[0]*31 + p[1]*7 + p[2]) % 97); };
+    ProcessNode<float> open_csr;
+    open_csr.m_layout = CellLayout::CSR;
+    open_decomp.build(open_csr);
+    initial.assign(open_csr.m_num_data_nodes, 0.0f);
+    for(size_t i = 0; i < initial.size(); i++){
+        int p[3];
+        open_decomp.globalCoords(open_csr.m_global_ids[i], p);
+        initial[i] = open_initial(p);
+    }
+    std::vector<float> open_reference((size_t)edge*edge*edge, 0.0f);
+    for(int level = 0; level <= best_level; level++){
+        open_csr.m_values = initial;
+        open_csr.allocateBuffers();
+        seconds = timeSteps(num_steps, [&](){
+            applyStencil(diffusion, open_csr, CellRegion::Owned, 0, (SimdLevel)level);
+            open_csr.swap();
+        });
+        if(level == 0) reference = open_csr.m_values;
+        double error = 0.0;
+        for(size_t i = 0; i < initial.size(); i++){
+            if(open_csr.isGhost(i)) continue;
+            error = std::max(error, (double)std::fabs(open_csr.m_values[i] - reference[i]));
+            if(level == 0) open_reference[open_csr.m_global_ids[i]] = reference[i];
+        }
+        report("csr_open", simd_names[level], open_csr.m_interior_cells.size() + open_csr.m_boundary_cells.size(),
+               num_steps, seconds, error);
+    }
+
+    //the halo past the open faces holds a value no neighbor sum should ever see
+    LatticeProcessNode<float, CubicLattice<3>> open_dense;
+    int open_dims[3] = {edge, edge, edge};
+    bool open_periodic[3] = {false, false, false};
+    open_dense.build(open_dims, rank_dims, open_periodic);
+    initial.assign(open_dense.m_num_data_nodes, 0.0f);
+    for(size_t i = 0; i < initial.size(); i++){
+        int p[3];
+        open_dense.globalCoords(i, p);
+        bool inside = true;
+        for(int d = 0; d < 3; d++) inside = inside && p[d] >= 0 && p[d] < edge;
+        initial[i] = inside ? open_initial(p) : 1e6f;
+    }
+    for(int level = 0; level <= best_level; level++){
+        open_dense.m_values = initial;
+        open_dense.allocateBuffers();
+        seconds = timeSteps(num_steps, [&](){
+            applyStencil(diffusion, open_dense, CellRegion::Owned, 0, (SimdLevel)level);
+            open_dense.swap();
+        });
+        double error = 0.0;
+        open_dense.forEachRow(CellRegion::Owned, [&](int begin, int length){
+            for(int i = begin; i < begin + length; i++){
+                int p[3];
+                open_dense.globalCoords(i, p);
+                size_t id = ((size_t)p[0]*edge + p[1])*edge + p[2];
+                error = std::max(error, (double)std::fabs(open_dense.m_values[i] - open_reference[id]));
+            }
+        });
+        report("dense_open", simd_names[level], (size_t)open_dense.m_extent[0]*edge*edge, num_steps, seconds, error);
+    }
+
+    //memory clean up
+    for(auto proc_node : {&nodes, &csr, &open_csr}){
+        for(auto it : proc_node->m_packed_data) upcxx::delete_array(it.second);
+    }
+    for(auto it : dense.m_packed_data) upcxx::delete_array(it.second);
+    for(auto it : open_dense.m_packed_data) upcxx::delete_array(it.second);
+    for(size_t i = 0; i < num_local_cells; i++) delete[] nodes.m_data_nodes[i].m_neighbors;
+    delete[] nodes.m_data_nodes;
+
+    upcxx::barrier();
+    upcxx::finalize();
+    return 0;
+}
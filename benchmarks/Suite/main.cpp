@@ -0,0 +1,155 @@
+#include "unicubemaker.hpp"
+#include "../common.hpp"
+
+#include <vector>
+#include <upcxx/upcxx.hpp>
+#include <iostream>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <type_traits>
+
+//Baseline suite for the halo exchange and stencil paths. For every payload size, block size and shape of the
+//rank grid it builds a periodic cubic box with one block of edge^3 cells per rank and measures the setup
+//time, the latency of push-mode exchanges (percentiles over iterations, the worst rank's for each), the
+//aggregate bandwidth and, for float and double payloads, the stencil update rate. Output is CSV or one JSON
+//object per line, see run.sh for sweeping the rank count.
+//usage: Suite.out [csv|json] [largest block edge] [exchanges]
+
+//an opaque payload of the given size, which only gets copied
+template <int Bytes> struct Payload {
+    char m_bytes[Bytes];
+};
+
+double elapsedUs(std::chrono::steady_clock::time_point start){
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+}
+
+struct Result {
+    std::string m_payload;
+    size_t m_payload_bytes;
+    int m_shape;
+    int m_edge;
+    double m_setup_ms;
+    double m_latency_us[4];
+    long long m_bytes_per_exchange;
+    double m_bytes_per_s;
+    double m_cells_per_s;
+};
+
+void printResult(const Result& r, bool json){
+    static const char* percentiles[4] = {"p50", "p90", "p99", "max"};
+    if(!json){
+        std::cout << upcxx::rank_n() << "," << r.m_payload << "," << r.m_payload_bytes << "," << r.m_shape << "D," <<
+                     r.m_edge << "," << (long long)r.m_edge*r.m_edge*r.m_edge << "," << r.m_setup_ms;
+        for(int p = 0; p < 4; p++) std::cout << "," << r.m_latency_us[p];
+        std::cout << "," << r.m_bytes_per_exchange << "," << r.m_bytes_per_s << ",";
+        if(r.m_cells_per_s > 0) std::cout << r.m_cells_per_s;
+        std::cout << std::endl;
+        return;
+    }
+    std::cout << "{\"ranks\":" << upcxx::rank_n() << ",\"payload\":\"" << r.m_payload << "\",\"payload_bytes\":" <<
+                 r.m_payload_bytes << ",\"shape\":\"" << r.m_shape << "D\",\"block_edge\":" << r.m_edge <<
+                 ",\"cells_per_rank\":" << (long long)r.m_edge*r.m_edge*r.m_edge << ",\"setup_ms\":" << r.m_setup_ms;
+    for(int p = 0; p < 4; p++) std::cout << ",\"exchange_" << percentiles[p] << "_us\":" << r.m_latency_us[p];
+    std::cout << ",\"max_bytes_per_exchange\":" << r.m_bytes_per_exchange << ",\"aggregate_bytes_per_s\":" <<
+                 r.m_bytes_per_s << ",\"cells_per_s\":";
+    if(r.m_cells_per_s > 0) std::cout << r.m_cells_per_s;
+    else std::cout << "null";
+    std::cout << "}" << std::endl;
+}
+
+template <typename T> Result run(const std::string& payload, int shape, int edge, int num_exchanges){
+    Result result;
+    result.m_payload = payload;
+    result.m_payload_bytes = sizeof(T);
+    result.m_shape = shape;
+    result.m_edge = edge;
+
+    int rank_dims[3];
+    factorRanks(upcxx::rank_n(), rank_dims, shape);
+    int global_dims[3] = {rank_dims[0]*edge, rank_dims[1]*edge, rank_dims[2]*edge};
+    bool periodic[3] = {true, true, true};
+    LatticeProcessNode<T, CubicLattice<3>> proc_node;
+    upcxx::barrier();
+    auto start = std::chrono::steady_clock::now();
+    proc_node.build(global_dims, rank_dims, periodic);
+    proc_node.compileExchangePlan(ExchangeMode::Push);
+    result.m_setup_ms = upcxx::reduce_all(elapsedUs(start) / 1000.0, upcxx::op_fast_max).wait();
+
+    //a few untimed exchanges so every rank has joined before the samples start
+    std::vector<double> samples;
+    for(int it = -num_exchanges/10 - 1; it < num_exchanges; it++){
+        start = std::chrono::steady_clock::now();
+        proc_node.packData();
+        proc_node.beginExchange();
+        proc_node.finishExchange();
+        if(it >= 0) samples.push_back(elapsedUs(start));
+    }
+    std::sort(samples.begin(), samples.end());
+    const double fractions[4] = {0.5, 0.9, 0.99, 1.0};
+    for(int p = 0; p < 4; p++){
+        double local = samples[std::min(samples.size() - 1, (size_t)(fractions[p]*samples.size()))];
+        result.m_latency_us[p] = upcxx::reduce_all(local, upcxx::op_fast_max).wait();
+    }
+    double mean_us = 0.0;
+    for(double sample : samples) mean_us += sample;
+    mean_us /= samples.size();
+    long long bytes = (long long)proc_node.m_plan.m_send_indices.size()*sizeof(typename PackTraits<T>::packed_type);
+    result.m_bytes_per_exchange = upcxx::reduce_all(bytes, upcxx::op_fast_max).wait();
+    result.m_bytes_per_s = upcxx::reduce_all(bytes / (mean_us*1e-6), upcxx::op_fast_add).wait();
+
+    result.m_cells_per_s = 0.0;
+    if constexpr(std::is_floating_point<T>::value){
+        proc_node.allocateBuffers();
+        StencilCoeffs<T> diffusion = {1, (T)0.1, (T)-0.1};
+        int num_steps = std::max(1, (int)(1e8 / ((double)edge*edge*edge)));
+        num_steps = std::min(num_steps, num_exchanges);
+        upcxx::barrier();
+        start = std::chrono::steady_clock::now();
+        for(int step = 0; step < num_steps; step++){
+            applyStencil(diffusion, proc_node);
+            proc_node.swap();
+        }
+        double local_us = elapsedUs(start);
+        double max_us = upcxx::reduce_all(local_us, upcxx::op_fast_max).wait();
+        result.m_cells_per_s = (double)edge*edge*edge*upcxx::rank_n()*num_steps / (max_us*1e-6);
+    }
+
+    proc_node.clearExchangePlan();
+    for(auto it : proc_node.m_packed_data){
+        upcxx::delete_array(it.second);
+    }
+    return result;
+}
+
+template <typename T> void sweep(const std::string& payload, int max_edge, int num_exchanges, bool json){
+    for(int shape = 1; shape <= 3; shape++){
+        for(int edge = 8; edge <= max_edge; edge *= 2){
+            Result result = run<T>(payload, shape, edge, num_exchanges);
+            if(upcxx::rank_me() == 0) printResult(result, json);
+        }
+    }
+}
+
+int main(int argc, char** argv){
+    upcxx::init();
+
+    bool json = argc > 1 && std::string(argv[1]) == "json";
+    int max_edge = argc > 2 ? std::atoi(argv[2]) : 64;
+    int num_exchanges = argc > 3 ? std::atoi(argv[3]) : 200;
+
+    if(upcxx::rank_me() == 0 && !json){
+        std::cout << "ranks,payload,payload_bytes,shape,block_edge,cells_per_rank,setup_ms,exchange_p50_us," <<
+                     "exchange_p90_us,exchange_p99_us,exchange_max_us,max_bytes_per_exchange,aggregate_bytes_per_s," <<
+                     "cells_per_s" << std::endl;
+    }
+    sweep<float>("float", max_edge, num_exchanges, json);
+    sweep<double>("double", max_edge, num_exchanges, json);
+    sweep<Payload<32>>("bytes32", max_edge, num_exchanges, json);
+    sweep<Payload<128>>("bytes128", max_edge, num_exchanges, json);
+
+    upcxx::barrier();
+    upcxx::finalize();
+    return 0;
+}
@@ -0,0 +1,19 @@
+#!/bin/sh
+# Runs Suite.out at every power of two rank count up to the given one and concatenates the output, a single
+# CSV table or one JSON object per line.
+# usage: run.sh [csv|json] [max ranks] [largest block edge] [exchanges]
+FORMAT=${1:-csv}
+MAX_RANKS=${2:-$(nproc)}
+EDGE=${3:-64}
+EXCHANGES=${4:-200}
+SKIP=1
+RANKS=1
+while [ $RANKS -le $MAX_RANKS ]; do
+    if [ "$FORMAT" = "json" ]; then
+        upcxx-run -n $RANKS ./Suite.out json $EDGE $EXCHANGES
+    else
+        upcxx-run -n $RANKS ./Suite.out csv $EDGE $EXCHANGES | tail -n +$SKIP
+        SKIP=2
+    fi
+    RANKS=$((RANKS * 2))
+done
@@ -0,0 +1,33 @@
+//Helpers shared by the benchmarks, included by path from each benchmark's main.cpp.
+
+#pragma once
+
+#include <upcxx/upcxx.hpp>
+
+//splits the ranks over the first num_dims dimensions with as even a shape as possible
+inline void factorRanks(int num_ranks, int rank_dims[3], int num_dims = 3){
+    rank_dims[0] = rank_dims[1] = rank_dims[2] = 1;
+    int remaining = num_ranks;
+    for(int f = 2; remaining > 1;){
+        if(remaining % f != 0){
+            f++;
+            continue;
+        }
+        int smallest = 0;
+        for(int d = 1; d < num_dims; d++){
+            if(rank_dims[d] < rank_dims[smallest]) smallest = d;
+        }
+        rank_dims[smallest] *= f;
+        remaining /= f;
+    }
+}
+
+//the largest value over all ranks, only valid on rank 0
+inline double maxOverRanks(double value){
+    return upcxx::reduce_one(value, upcxx::op_fast_max, 0).wait();
+}
+
+//the sum over all ranks, only valid on rank 0
+inline double sumOverRanks(double value){
+    return upcxx::reduce_one(value, upcxx::op_fast_add, 0).wait();
+}
@@ -4,9 +4,7 @@
 #include <vector>
 #include <upcxx/upcxx.hpp>
 #include <iostream>
-#include <fstream>
 #include <string>
-#include <sstream>
 
 int main(int argc, char** argv){
     upcxx::init();
@@ -24,97 +22,85 @@ int main(int argc, char** argv){
 
     //initialize our local process node
     ProcessNode<float> proc_node;
-    proc_node.m_data = new DataNode<float>[num_local_cells];
+    proc_node.m_data_nodes = new DataNode<float>[num_local_cells];
+    proc_node.m_num_data_nodes = num_local_cells;
 
     //set up the local data node network
     for(int i = 0; i < num_local_cells; i++){
         if(i == 0 || i == num_local_cells - 1){
-            proc_node.m_data[i].m_num_neighbors = 1;
-            proc_node.m_data[i].m_neighbors = new DataNode<float>*[1];
-            if(i == 0) proc_node.m_data[i].m_neighbors[0] = &proc_node.m_data[1];
-            else proc_node.m_data[i].m_neighbors[0] = &proc_node.m_data[num_local_cells - 2];
-            proc_node.m_data[i].m_ghost = true;
-            proc_node.m_data[i].m_data = 0.0f;
+            proc_node.m_data_nodes[i].m_num_neighbors = 1;
+            proc_node.m_data_nodes[i].m_neighbors = new DataNode<float>*[1];
+            if(i == 0) proc_node.m_data_nodes[i].m_neighbors[0] = &proc_node.m_data_nodes[1];
+            else proc_node.m_data_nodes[i].m_neighbors[0] = &proc_node.m_data_nodes[num_local_cells - 2];
+            proc_node.m_data_nodes[i].m_ghost = true;
+            proc_node.m_data_nodes[i].m_data = 0.0f;
         } else {
-            proc_node.m_data[i].m_num_neighbors = 2;
-            proc_node.m_data[i].m_neighbors = new DataNode<float>*[2];
+            proc_node.m_data_nodes[i].m_num_neighbors = 2;
+            proc_node.m_data_nodes[i].m_neighbors = new DataNode<float>*[2];
             int leftIDX = i - 1;
             int rightIDX = i + 1;
-            proc_node.m_data[i].m_neighbors[0] = &proc_node.m_data[leftIDX];
-            proc_node.m_data[i].m_neighbors[1] = &proc_node.m_data[rightIDX];
-            proc_node.m_data[i].m_data = 0.0f;
-            proc_node.m_data[i].m_ghost = false;
+            proc_node.m_data_nodes[i].m_neighbors[0] = &proc_node.m_data_nodes[leftIDX];
+            proc_node.m_data_nodes[i].m_neighbors[1] = &proc_node.m_data_nodes[rightIDX];
+            proc_node.m_data_nodes[i].m_data = 0.0f;
+            proc_node.m_data_nodes[i].m_ghost = false;
         }
         int worldX = i + upcxx::rank_me()*(num_cells_per_rank) - 1 - 2*(upcxx::rank_me());
-        if(worldX == 5 && !proc_node.m_data[i].m_ghost) proc_node.m_data[i].m_data = 10000.0f;
+        if(worldX == 5 && !proc_node.m_data_nodes[i].m_ghost) proc_node.m_data_nodes[i].m_data = 10000.0f;
+        //snapshots label cells with their global id
+        proc_node.m_global_ids.push_back(worldX);
     }
 
-    //set up this process node with a left and right neighbor
-    proc_node.m_neighbor_gptrs.push_back(NULL);
-    proc_node.m_neighbor_gptrs.push_back(NULL);
-    
-    proc_node.m_packed_gptrs.push_back(upcxx::new_array<DataNode<float>>(1));
-    proc_node.m_packed_gptrs.push_back(upcxx::new_array<DataNode<float>>(1));
-    
-    proc_node.m_neighbor_gptr_sizes.push_back(1);
-    proc_node.m_neighbor_gptr_sizes.push_back(1);
+    //set up this process node with a left and right neighbor, our first owned cell is the left neighbor's
+    //right ghost and our last owned cell is the right neighbor's left ghost
+    int left_rank = upcxx::rank_me() - 1;
+    if(left_rank == -1) left_rank = upcxx::rank_n() - 1;
+    int right_rank = upcxx::rank_me() + 1;
+    if(right_rank == upcxx::rank_n()) right_rank = 0;
+    proc_node.m_pack_map[left_rank].push_back(1);
+    proc_node.m_pack_map[right_rank].push_back(num_local_cells - 2);
+    //with two or fewer ranks both neighbors are the same rank, which packs its first cell before its last
+    proc_node.m_unpack_map[right_rank].push_back(num_local_cells - 1);
+    proc_node.m_unpack_map[left_rank].push_back(0);
 
-    proc_node.m_gptr_to_data.push_back(std::vector<int>());
-    proc_node.m_gptr_to_data.push_back(std::vector<int>());
-    proc_node.m_gptr_to_data[0].push_back(0);
-    proc_node.m_gptr_to_data[1].push_back(num_local_cells - 1);
-    
-    proc_node.m_num_neighbors = 2;
-    
-    proc_node.m_neighbor_ranks.push_back( upcxx::rank_me() - 1 );
-    if(proc_node.m_neighbor_ranks[0] == -1) proc_node.m_neighbor_ranks[0] = upcxx::rank_n() - 1;
-    proc_node.m_neighbor_ranks.push_back( upcxx::rank_me() + 1 );
-    if(proc_node.m_neighbor_ranks[1] == upcxx::rank_n()) proc_node.m_neighbor_ranks[1] = 0;
+    proc_node.allocatePackedData();
 
     upcxx::barrier(); //setup finished
 
     //broadcast global pointers to establish the comms network
     proc_node.bcastGPTRs();
+    upcxx::barrier();
+    proc_node.compileExchangePlan(ExchangeMode::Push);
+    proc_node.classifyCells();
+    //switches to CSR storage with a second buffer that each step writes into
+    proc_node.allocateBuffers();
+
+    //every rank writes its cells into one shared file every 10 steps, read it with tools/snapshot.py
+    int global_dims[3] = {num_cells, 1, 1};
+    int rank_dims[3] = {upcxx::rank_n(), 1, 1};
+    SnapshotWriter<float> snapshots;
+    snapshots.open(proc_node, "./output/1DPeriodic.ucs", 10, SnapshotMode::Shared, global_dims, rank_dims);
 
-    //write output to file
-    std::stringstream outputFileStream;
-    outputFileStream << "./output/" << upcxx::rank_me() << "_log.csv";
-    std::ofstream outputFile;
-    outputFile.open(outputFileStream.str());
-    
-    outputFile << "it,x,amount,ghost" << std::endl;
     //run simulation
     int num_steps = 10000;
     float D = 0.1;
+    StencilCoeffs<float> diffusion = {1.0f, D, -D};
     for(int it = 0; it < num_steps; it++){
-        DataNode<float>* new_data = new DataNode<float>[num_local_cells];
-        //diffusion
-        for(int i = 0; i < num_local_cells; i++){
-            DataNode<float>* dn = &(proc_node.m_data[i]);
-            if (dn->m_ghost) continue;
-            new_data[i].m_data = dn->m_data;
-            for(int j = 0; j < dn->m_num_neighbors; j++){
-                new_data[i].m_data += D*dn->m_neighbors[j]->m_data;
-            }
-            new_data[i].m_data -= D*(float)dn->m_num_neighbors*dn->m_data;
-        }
-        //swap vectors
-        for(int i = 0; i < num_local_cells; i++){
-            proc_node.m_data[i].m_data = new_data[i].m_data;
-            int worldX = i + upcxx::rank_me()*(num_cells_per_rank) - 1 - 2*(upcxx::rank_me());
-            outputFile << it << "," << worldX << "," << proc_node.m_data[i].m_data << "," << proc_node.m_data[i].m_ghost << std::endl;
-        }
-        delete[] new_data;
+        //communicate, interior cells do not read ghosts so they are updated while the halos are in flight
+        proc_node.packData();
+        proc_node.beginExchange();
+        applyStencil(diffusion, proc_node, CellRegion::Interior);
+        proc_node.finishExchange();
+        applyStencil(diffusion, proc_node, CellRegion::Boundary);
 
-        proc_node.m_packed_gptrs[0].local()[0] = proc_node.m_data[1];
-        proc_node.m_packed_gptrs[1].local()[0] = proc_node.m_data[num_local_cells - 2];
-        proc_node.gatherGhosts();
+        proc_node.swap();
+        snapshots.write(proc_node, it);
     }
-    outputFile.close();
+    snapshots.close();
 
     //memory clean up
-    delete[] proc_node.m_data;
+    delete[] proc_node.m_data_nodes;
 
+    upcxx::barrier();
     upcxx::finalize();
     return 0;
 }
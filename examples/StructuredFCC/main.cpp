@@ -0,0 +1,63 @@
+#include "unicubemaker.hpp"
+
+#include <vector>
+#include <upcxx/upcxx.hpp>
+#include <iostream>
+
+//The 3DFCC diffusion on a periodic FCC lattice stored as a dense field with implicit neighbors. Sites are in
+//primitive coordinates, so a 16x16x16 box holds 4096 sites and nothing but one float per cell is stored.
+
+float totalAmount(LatticeProcessNode<float, FCCLattice>& proc_node){
+    float local_sum = 0.0f;
+    proc_node.forEachRow(CellRegion::Owned, [&](int begin, int length){
+        for(int i = begin; i < begin + length; i++) local_sum += proc_node.m_values[i];
+    });
+    return upcxx::reduce_one(local_sum, upcxx::op_fast_add, 0).wait();
+}
+
+int main(int argc, char** argv){
+    upcxx::init();
+
+    //split into slabs along the first primitive axis
+    int global_dims[3] = {16, 16, 16};
+    int rank_dims[3] = {upcxx::rank_n(), 1, 1};
+    bool periodic[3] = {true, true, true};
+    LatticeProcessNode<float, FCCLattice> proc_node;
+    proc_node.build(global_dims, rank_dims, periodic);
+    proc_node.compileExchangePlan(ExchangeMode::Push);
+
+    int setPoint[3] = {8, 8, 8};
+    int set_index = proc_node.localIndex(setPoint);
+    if(set_index >= 0) proc_node.m_values[set_index] = 10000.0f;
+
+    float total = totalAmount(proc_node);
+    if(upcxx::rank_me() == 0) std::cout << "total amount before: " << total << std::endl;
+
+    proc_node.allocateBuffers();
+
+    int num_steps = 10000;
+    float D = 0.01;
+    StencilCoeffs<float> diffusion = {1.0f, D, -D};
+    for(int ts = 0; ts < num_steps; ts++){
+        proc_node.packData();
+        proc_node.beginExchange();
+        applyStencil(diffusion, proc_node, CellRegion::Interior);
+        proc_node.finishExchange();
+        applyStencil(diffusion, proc_node, CellRegion::Boundary);
+
+        proc_node.swap();
+    }
+
+    total = totalAmount(proc_node);
+    if(upcxx::rank_me() == 0) std::cout << "total amount after: " << total << std::endl;
+
+    // memory clean up
+    proc_node.clearExchangePlan();
+    for(auto it : proc_node.m_packed_data){
+        upcxx::delete_array(it.second);
+    }
+
+    upcxx::barrier();
+    upcxx::finalize();
+    return 0;
+}
@@ -0,0 +1,102 @@
+"""Reads the binary snapshots written by SnapshotWriter in unicubemaker.hpp.
+
+    import snapshot
+    snap = snapshot.read("output/3DFCC.*")
+    snap.values[f]       # the cells of frame f, in the order of snap.ids
+    snap.steps[f]        # the step frame f was written at
+    snap.coords()        # x, y, z of every cell for LatticeDecomposition style ids
+
+From the command line it converts snapshots to CSV:
+
+    python3 snapshot.py "output/3DFCC.*" > 3DFCC.csv
+"""
+
+import glob
+import sys
+
+import numpy as np
+
+MAGIC = b"UCSNAP\0\0"
+VERSION = 1
+HEADER = np.dtype([
+    ("magic", "S8"), ("version", "<u4"), ("value_bytes", "<u4"), ("value_type", "<u4"),
+    ("global_dims", "<i4", 3), ("rank_dims", "<i4", 3), ("num_ranks", "<i4"), ("first_rank", "<i4"),
+    ("file_ranks", "<i4"), ("every", "<i4"), ("reserved", "<i4"), ("num_cells", "<u8"),
+])
+VALUE_TYPES = {1: np.float32, 2: np.float64, 3: np.int32, 4: np.int64}
+
+
+class Snapshot:
+    def __init__(self, header, ids, steps, values):
+        self.global_dims = tuple(int(d) for d in header["global_dims"])
+        self.rank_dims = tuple(int(d) for d in header["rank_dims"])
+        self.num_ranks = int(header["num_ranks"])
+        self.every = int(header["every"])
+        self.ids = ids
+        self.steps = steps
+        self.values = values
+
+    def coords(self):
+        """Global coordinates of every cell, for ids numbered z + y*dims[2] + x*dims[1]*dims[2]."""
+        _, ny, nz = self.global_dims
+        return self.ids // (ny*nz), (self.ids // nz) % ny, self.ids % nz
+
+    def sorted(self):
+        """The same snapshot with cells ordered by global id."""
+        order = np.argsort(self.ids, kind="stable")
+        snap = Snapshot.__new__(Snapshot)
+        snap.__dict__.update(self.__dict__)
+        snap.ids = self.ids[order]
+        snap.values = self.values[:, order]
+        return snap
+
+
+def read_file(path, dtype=None):
+    """Header, rank table, ids, steps and values of one file. Frames cut short at the end are dropped."""
+    raw = np.memmap(path, dtype=np.uint8, mode="r")
+    header = np.frombuffer(raw[:HEADER.itemsize].tobytes(), dtype=HEADER)[0]
+    if header["magic"] != MAGIC.rstrip(b"\0") or header["version"] != VERSION:
+        raise ValueError("{} is not a version {} snapshot".format(path, VERSION))
+    if dtype is None:
+        dtype = VALUE_TYPES.get(int(header["value_type"]), np.dtype(("V", int(header["value_bytes"]))))
+    dtype = np.dtype(dtype)
+    if dtype.itemsize != header["value_bytes"]:
+        raise ValueError("{} stores {} byte values".format(path, header["value_bytes"]))
+
+    num_cells = int(header["num_cells"])
+    offset = HEADER.itemsize
+    table = np.frombuffer(raw[offset:offset + 16*header["file_ranks"]].tobytes(), dtype="<u8").reshape(-1, 2)
+    offset += table.nbytes
+    ids = np.frombuffer(raw[offset:offset + 8*num_cells].tobytes(), dtype="<i8")
+    offset += ids.nbytes
+
+    frame = np.dtype([("step", "<i8"), ("values", dtype, (num_cells,))])
+    num_frames = (len(raw) - offset) // frame.itemsize
+    frames = np.frombuffer(raw[offset:offset + num_frames*frame.itemsize].tobytes(), dtype=frame)
+    return header, table, ids, frames["step"], frames["values"].reshape(num_frames, num_cells)
+
+
+def read(paths, dtype=None):
+    """Reads a shared file or the per-rank files of one run, given as a list or a glob pattern."""
+    if isinstance(paths, str):
+        paths = sorted(glob.glob(paths)) or [paths]
+    parts = [read_file(path, dtype) for path in paths]
+    parts.sort(key=lambda part: int(part[0]["first_rank"]))
+    #per-rank files may hold different numbers of frames if a run stopped early
+    num_frames = min(len(part[3]) for part in parts)
+    ids = np.concatenate([part[2] for part in parts])
+    values = np.concatenate([part[4][:num_frames] for part in parts], axis=1)
+    return Snapshot(parts[0][0], ids, parts[0][3][:num_frames], values)
+
+
+def write_csv(snap, out):
+    out.write("step,i,value\n")
+    for f, step in enumerate(snap.steps):
+        for i, value in zip(snap.ids, snap.values[f]):
+            out.write("{},{},{}\n".format(step, i, value))
+
+
+if __name__ == "__main__":
+    if len(sys.argv) < 2:
+        sys.exit("usage: snapshot.py <file or glob>... > out.csv")
+    write_csv(read(sys.argv[1] if len(sys.argv) == 2 else sys.argv[1:]).sorted(), sys.stdout)
@@ -18,15 +18,53 @@
 *
 */
 
-//TODO: 10/04/24, for some setups it is helpful to do communication in waves, and so there needs to be some way
-//to do copies in a specific order from the application side
-
 #pragma once
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
 #include <algorithm>
+#include <memory>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <tuple>
+#include <map>
+#include <array>
+#include <chrono>
+#include <limits>
+#include <ostream>
+#include <fstream>
+#include <string>
+#include <stdexcept>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <upcxx/upcxx.hpp>
 
+//applyStencil() has AVX2 and AVX-512 paths picked at run time when compiled by GCC or Clang for x86
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define UNICUBE_X86_SIMD
+#endif
+
+//ProcessNode only times its communication when UNICUBE_INSTRUMENT is defined, otherwise the timing code is
+//discarded at compile time, see CommStats
+#ifdef UNICUBE_INSTRUMENT
+static constexpr bool instrument_comms = true;
+#else
+static constexpr bool instrument_comms = false;
+#endif
+
 template <typename T> struct DataNode {
     int m_num_neighbors;
     DataNode** m_neighbors;
@@ -34,63 +72,1244 @@ template <typename T> struct DataNode {
     T m_data;
 };
 
-template <typename T> class ProcessNode {
+//How a ProcessNode stores its cells. Nodes uses m_data_nodes, CSR uses m_values with the m_adj_* arrays, and
+//Dense uses m_values alone with adjacency implied by a structured lattice (see LatticeProcessNode).
+enum class CellLayout { Nodes, CSR, Dense };
+
+//Owned cells split by whether they read any ghost. Interior cells can be updated while a split-phase
+//exchange is in flight, Boundary cells only after it has finished.
+enum class CellRegion { Owned, Interior, Boundary };
+
+//Range over a cell's neighbor indices in a ProcessNode's CSR adjacency, for(int32_t j : proc_node.neighbors(i)).
+struct NeighborRange {
+    const int32_t* m_begin;
+    const int32_t* m_end;
+
+    const int32_t* begin() const { return m_begin; }
+    const int32_t* end() const { return m_end; }
+    size_t size() const { return m_end - m_begin; }
+};
+
+//Describes what is sent over the wire for each packed cell. The default sends the whole payload,
+//specialize PackTraits or pass another packer such as MemberPack as ProcessNode's second template
+//parameter to send only the parts of T that change between exchanges.
+template <typename T> struct PackTraits {
+    typedef T packed_type;
+    static void pack(const T& data, packed_type& packed){ packed = data; }
+    static void unpack(const packed_type& packed, T& data){ data = packed; }
+};
+
+//Sends a single member of T, e.g. MemberPack<FCCDiffuser, float, &FCCDiffuser::amount>.
+template <typename T, typename M, M T::*Member> struct MemberPack {
+    typedef M packed_type;
+    static void pack(const T& data, packed_type& packed){ packed = data.*Member; }
+    static void unpack(const packed_type& packed, T& data){ data.*Member = packed; }
+};
+
+//Flattened, rank-sorted view of the pack/unpack maps built once by ProcessNode::compileExchangePlan().
+//Neighbor i's cell indices live in m_*_indices[m_*_offsets[i] .. m_*_offsets[i+1]), and all neighbors
+//share one receive buffer allocated at compile time so that exchanges do not touch the shared heap.
+template <typename P> struct ExchangePlan {
+    std::vector<int> m_send_ranks;
+    std::vector<size_t> m_send_offsets;
+    std::vector<int> m_send_indices;
+    std::vector<P*> m_send_buffers;
+
+    std::vector<int> m_recv_ranks;
+    std::vector<size_t> m_recv_offsets;
+    std::vector<int> m_recv_indices;
+    std::vector<upcxx::global_ptr<P>> m_recv_sources;
+    upcxx::global_ptr<P> m_recv_buffer;
+
+    //push mode only, where each receiver's buffer holds two slots of m_recv_slot_size so
+    //that a neighbor one step ahead never overwrites data that has not been unpacked yet
+    size_t m_recv_slot_size = 0;
+    std::vector<upcxx::global_ptr<P>> m_send_targets;
+    std::vector<size_t> m_send_slot_strides;
+
+    //push mode arrivals are counted per receive slot and the slot alternates every exchange
+    std::unique_ptr<upcxx::promise<>> m_arrivals[2];
+    upcxx::future<> m_arrived[2];
+    std::unique_ptr<upcxx::promise<>> m_send_promise;
+    unsigned long m_exchange_count = 0;
+
+    //with UNICUBE_INSTRUMENT, when our latest exchange started and when each neighbor's data arrived per slot
+    double m_begin_us = 0.0;
+    std::vector<double> m_arrival_us[2];
+
+    //send buffers of schedule phases, private memory is enough since they are only ever put from
+    std::vector<P> m_send_storage;
+
+    //Neighbors on our node are read or written through plain pointers instead of RMA, which saves a copy.
+    //In pull mode m_recv_locals[n] is neighbor n's packed buffer and we unpack straight from it, in push mode
+    //m_send_locals[n] is slot 0 of neighbor n's receive buffer and we pack straight into it. Both hold NULL
+    //for neighbors on other nodes and are empty in the other mode.
+    std::vector<const P*> m_recv_locals;
+    std::vector<P*> m_send_locals;
+
+    //sparse push mode only, see SparseExchange. m_sent_values holds what each neighbor last received from us in
+    //send order and m_recv_mirror what we last received in receive order. Neighbors that sent runs instead of
+    //dense data have m_recv_dense[slot][n] cleared and their runs staged as (position, length) pairs with the
+    //values until finishExchange() applies them. m_encode_* is scratch for the runs of one neighbor.
+    bool m_sparse = false;
+    std::vector<P> m_sent_values;
+    std::vector<P> m_recv_mirror;
+    std::vector<unsigned char> m_recv_dense[2];
+    std::vector<uint32_t> m_staged_runs[2];
+    std::vector<P> m_staged_values[2];
+    std::vector<uint32_t> m_encode_runs;
+    std::vector<P> m_encode_values;
+};
+
+//One wave of an exchange schedule, see ProcessNode::compileSchedule(). Unlike ProcessNode::m_pack_map the pack
+//lists may name ghost cells, which are packed after the earlier phases filled them so that data can be
+//forwarded through intermediate ranks. The unpack list for a rank must be as long as its pack list for us.
+struct ExchangePhase {
+    std::unordered_map<int, std::vector<int>> m_pack_map;
+    std::unordered_map<int, std::vector<int>> m_unpack_map;
+};
+
+//Parts of an exchange that CommStats tells apart. Transfer runs from issuing a put or get until it completes
+//locally, Wait from the start of our exchange until a neighbor's data arrives in push mode and, for neighbor
+//-1, the time finishExchange() spent blocked.
+enum class CommPhase { Pack, Transfer, Wait, Unpack, Barrier };
+
+struct PhaseStats {
+    unsigned long m_calls = 0;
+    unsigned long long m_bytes = 0;
+    double m_total_us = 0.0;
+    double m_min_us = std::numeric_limits<double>::max();
+    double m_max_us = 0.0;
+
+    void record(double us, size_t bytes);
+    double meanUs() const;
+};
+
+//Call counts, bytes and times per neighbor rank and per CommPhase, filled by ProcessNode in builds with
+//UNICUBE_INSTRUMENT. Neighbor -1 holds entries that belong to a whole exchange rather than one neighbor.
+class CommStats {
+    public:
+    static constexpr int num_phases = 5;
+    static double nowUs();
+
+    void record(int neighbor, CommPhase phase, double us, size_t bytes = 0);
+    void clear();
+    double rankTotalUs(CommPhase phase) const;
+    void dump(std::ostream& out, bool header = true) const;
+    void summarize(std::ostream& out) const;
+
+    //pool threads record packing and unpacking concurrently
+    std::mutex m_mutex;
+    std::map<int, std::array<PhaseStats, num_phases>> m_counters;
+};
+
+inline void PhaseStats::record(double us, size_t bytes){
+    m_calls++;
+    m_bytes += bytes;
+    m_total_us += us;
+    m_min_us = std::min(m_min_us, us);
+    m_max_us = std::max(m_max_us, us);
+}
+
+inline double PhaseStats::meanUs() const {
+    return m_calls > 0 ? m_total_us / m_calls : 0.0;
+}
+
+inline double CommStats::nowUs(){
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline void CommStats::record(int neighbor, CommPhase phase, double us, size_t bytes){
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_counters[neighbor][(int)phase].record(us, bytes);
+}
+
+inline void CommStats::clear(){
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_counters.clear();
+}
+
+//the time this rank spent in phase, taken from the whole-exchange entry where there is one since the
+//per-neighbor entries of such phases overlap
+inline double CommStats::rankTotalUs(CommPhase phase) const {
+    auto all = m_counters.find(-1);
+    if(all != m_counters.end() && all->second[(int)phase].m_calls > 0) return all->second[(int)phase].m_total_us;
+    double total = 0.0;
+    for(auto& pair : m_counters){
+        if(pair.first >= 0) total += pair.second[(int)phase].m_total_us;
+    }
+    return total;
+}
+
+//Writes this rank's counters as CSV, one row per neighbor and phase that was recorded.
+inline void CommStats::dump(std::ostream& out, bool header) const {
+    static const char* phase_names[num_phases] = {"pack", "transfer", "wait", "unpack", "barrier"};
+    if(header) out << "rank,neighbor,phase,calls,bytes,min_us,mean_us,max_us,total_us\n";
+    for(auto& pair : m_counters){
+        for(int phase = 0; phase < num_phases; phase++){
+            const PhaseStats& stats = pair.second[phase];
+            if(stats.m_calls == 0) continue;
+            out << upcxx::rank_me() << "," << pair.first << "," << phase_names[phase] << "," << stats.m_calls << "," <<
+                   stats.m_bytes << "," << stats.m_min_us << "," << stats.meanUs() << "," << stats.m_max_us << "," <<
+                   stats.m_total_us << "\n";
+        }
+    }
+}
+
+//Reduces every rank's counters to a load imbalance summary written by rank 0: per phase the min, mean and
+//max over ranks of the time spent in it, the slowest rank, and the neighbor pair with the most time in it.
+//Collective.
+inline void CommStats::summarize(std::ostream& out) const {
+    static const char* phase_names[num_phases] = {"pack", "transfer", "wait", "unpack", "barrier"};
+    if(upcxx::rank_me() == 0){
+        out << "phase,calls,bytes,min_rank_us,mean_rank_us,max_rank_us,slowest_rank,imbalance,hottest_rank," <<
+               "hottest_neighbor,hottest_us\n";
+    }
+    for(int phase = 0; phase < num_phases; phase++){
+        unsigned long long calls = 0, bytes = 0;
+        double hottest_us = -1.0;
+        int hottest_neighbor = -1;
+        for(auto& pair : m_counters){
+            const PhaseStats& stats = pair.second[phase];
+            calls += stats.m_calls;
+            bytes += stats.m_bytes;
+            if(pair.first >= 0 && stats.m_calls > 0 && stats.m_total_us > hottest_us){
+                hottest_us = stats.m_total_us;
+                hottest_neighbor = pair.first;
+            }
+        }
+        double us = rankTotalUs((CommPhase)phase);
+        calls = upcxx::reduce_one(calls, upcxx::op_fast_add, 0).wait();
+        bytes = upcxx::reduce_one(bytes, upcxx::op_fast_add, 0).wait();
+        double min_us = upcxx::reduce_one(us, upcxx::op_fast_min, 0).wait();
+        double sum_us = upcxx::reduce_one(us, upcxx::op_fast_add, 0).wait();
+        double max_us = upcxx::reduce_all(us, upcxx::op_fast_max).wait();
+        int slowest = upcxx::reduce_one(us == max_us ? upcxx::rank_me() : upcxx::rank_n(), upcxx::op_fast_min, 0).wait();
+        double max_hottest_us = upcxx::reduce_all(hottest_us, upcxx::op_fast_max).wait();
+        int hottest_rank = upcxx::reduce_all(hottest_us == max_hottest_us ? upcxx::rank_me() : upcxx::rank_n(),
+                                             upcxx::op_fast_min).wait();
+        if(hottest_rank == upcxx::rank_n()) hottest_rank = 0;
+        int neighbor = upcxx::broadcast(hottest_neighbor, hottest_rank).wait();
+        if(upcxx::rank_me() != 0 || calls == 0) continue;
+        double mean_us = sum_us / upcxx::rank_n();
+        out << phase_names[phase] << "," << calls << "," << bytes << "," << min_us << "," << mean_us << "," << max_us <<
+               "," << slowest << "," << (mean_us > 0.0 ? max_us / mean_us : 1.0) << "," << hottest_rank << "," <<
+               neighbor << "," << std::max(0.0, max_hottest_us) << "\n";
+    }
+}
+
+//A list of cells in column-major ELLPACK form, which lets applyStencil() process several cells per
+//instruction without branching on their degree. Neighbor k of m_cells[c] is m_indices[k*m_cells.size() + c].
+//Rows shorter than m_width are padded with the cell itself and m_cells is padded by repeating its last entry.
+struct EllBlock {
+    //the number of floats in the widest vector applyStencil() uses
+    static constexpr size_t padding = 16;
+
+    std::vector<int32_t> m_cells;
+    std::vector<int32_t> m_indices;
+    std::vector<int32_t> m_degrees;
+    int m_width = 0;
+};
+
+//Pull mode gets neighbors' packed buffers, so every rank must have packed before anyone begins an
+//exchange (e.g. with a barrier). Push mode puts packed data into the neighbors' receive buffers and
+//signals arrival per neighbor, so no global synchronization is needed. Push mode assumes that ranks
+//which send to each other also receive from each other, as in any halo exchange.
+enum class ExchangeMode { Pull, Push };
+
+//Opt-in sparse halo exchange for the compiled push mode plan. Each neighbor on another node is sent only the
+//packed cells that changed since it last heard from us, as runs of positions and values, and a neighbor with
+//nothing new gets an empty message that only signals arrival. When more than m_dense_fraction of a neighbor's
+//cells changed, or the runs would be no smaller than the data, that neighbor is sent dense data as usual.
+//Cells count as changed when their packed bytes differ, or, for arithmetic packed types and a positive
+//m_tolerance, when they moved by more than m_tolerance, so ghosts may then lag their owners by up to that much.
+//Must be the same on every rank and set before compileExchangePlan(), pull mode and schedules ignore it.
+struct SparseExchange {
+    bool m_enabled = false;
+    double m_tolerance = 0.0;
+    double m_dense_fraction = 0.25;
+};
+
+template <typename P> inline bool packedChanged(const P& sent, const P& packed, double tolerance){
+    if constexpr(std::is_arithmetic<P>::value){
+        if(tolerance > 0.0) return std::fabs((double)packed - (double)sent) > tolerance;
+    }
+    return std::memcmp(&sent, &packed, sizeof(P)) != 0;
+}
+
+//A fixed set of threads for running loops over cells inside one rank. parallelFor() splits a range into
+//chunks that are dealt out evenly to per-thread queues, and a thread that runs out of its own chunks steals
+//from the back of another's. The calling thread works too, so a pool of size n starts n - 1 threads.
+//Pool threads never communicate: every UPC++ call stays on the thread that holds the master persona, which
+//is also where remote completions of the exchanges run, so any UPC++ threading mode works.
+class ThreadPool {
+    public:
+    explicit ThreadPool(int num_threads);
+    ~ThreadPool();
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int size() const { return m_queues.size(); }
+    template <typename F> void parallelFor(size_t begin, size_t end, size_t grain, F f);
+
+    private:
+    struct ChunkQueue {
+        std::mutex m_mutex;
+        size_t m_next = 0;
+        size_t m_end = 0;
+    };
+
+    void workerLoop(int id);
+    void runChunks(int id);
+    bool takeChunk(int queue, bool from_back, size_t& chunk);
+
+    std::vector<std::thread> m_threads;
+    std::vector<std::unique_ptr<ChunkQueue>> m_queues;
+
+    //the current loop, valid while m_active > 0 or the caller is inside parallelFor()
+    std::function<void(size_t, size_t)> m_body;
+    size_t m_begin = 0;
+    size_t m_end = 0;
+    size_t m_grain = 1;
+
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+    unsigned long m_generation = 0;
+    int m_active = 0;
+    bool m_stop = false;
+};
+
+inline ThreadPool::ThreadPool(int num_threads){
+    if(num_threads < 1) num_threads = 1;
+    for(int t = 0; t < num_threads; t++) m_queues.emplace_back(new ChunkQueue());
+    for(int t = 1; t < num_threads; t++) m_threads.emplace_back(&ThreadPool::workerLoop, this, t);
+}
+
+inline ThreadPool::~ThreadPool(){
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wake.notify_all();
+    for(std::thread& thread : m_threads) thread.join();
+}
+
+//Calls f(chunk_begin, chunk_end) over [begin, end) in chunks of grain and returns once all of them ran.
+//Without other threads f is called once on the whole range.
+template <typename F> void ThreadPool::parallelFor(size_t begin, size_t end, size_t grain, F f){
+    if(end <= begin) return;
+    if(grain < 1) grain = 1;
+    size_t num_chunks = (end - begin + grain - 1) / grain;
+    if(m_threads.empty() || num_chunks == 1){
+        f(begin, end);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_body = f;
+        m_begin = begin;
+        m_end = end;
+        m_grain = grain;
+        size_t num_queues = m_queues.size();
+        for(size_t q = 0; q < num_queues; q++){
+            std::lock_guard<std::mutex> queue_lock(m_queues[q]->m_mutex);
+            m_queues[q]->m_next = num_chunks*q / num_queues;
+            m_queues[q]->m_end = num_chunks*(q + 1) / num_queues;
+        }
+        m_generation++;
+    }
+    m_wake.notify_all();
+    runChunks(0);
+    //stealing means an empty queue does not imply finished chunks, so wait for every thread to leave the loop
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done.wait(lock, [this]{ return m_active == 0; });
+    m_body = nullptr;
+}
+
+inline void ThreadPool::workerLoop(int id){
+    unsigned long seen = 0;
+    while(true){
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wake.wait(lock, [&]{ return m_stop || m_generation != seen; });
+            if(m_stop) return;
+            seen = m_generation;
+            m_active++;
+        }
+        runChunks(id);
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_active--;
+        }
+        m_done.notify_all();
+    }
+}
+
+inline void ThreadPool::runChunks(int id){
+    size_t chunk;
+    int num_queues = m_queues.size();
+    for(int k = 0; k < num_queues; k++){
+        int queue = (id + k) % num_queues;
+        while(takeChunk(queue, queue != id, chunk)){
+            size_t chunk_begin = m_begin + chunk*m_grain;
+            m_body(chunk_begin, std::min(chunk_begin + m_grain, m_end));
+        }
+    }
+}
+
+inline bool ThreadPool::takeChunk(int queue, bool from_back, size_t& chunk){
+    ChunkQueue& q = *m_queues[queue];
+    std::lock_guard<std::mutex> lock(q.m_mutex);
+    if(q.m_next == q.m_end) return false;
+    chunk = from_back ? --q.m_end : q.m_next++;
+    return true;
+}
+
+//Runs f over [begin, end) on pool, or directly on this thread when pool is NULL.
+template <typename F> void parallelFor(ThreadPool* pool, size_t begin, size_t end, size_t grain, F f){
+    if(pool) pool->parallelFor(begin, end, grain, f);
+    else if(begin < end) f(begin, end);
+}
+
+//pwrite() until all bytes are written, false on an I/O error
+inline bool writeFully(int fd, const void* data, size_t bytes, off_t offset){
+    const char* begin = (const char*)data;
+    while(bytes > 0){
+        ssize_t written = ::pwrite(fd, begin, bytes, offset);
+        if(written < 0){
+            if(errno == EINTR) continue;
+            return false;
+        }
+        begin += written;
+        bytes -= written;
+        offset += written;
+    }
+    return true;
+}
+
+//A checkpoint holds one rank's state in <path>.<rank>: this header, then m_num_sections pairs of uint64
+//(byte offset, element count), one per CheckpointSection, then the sections. Readers ignore sections they do
+//not know, and sections a file lacks are read as empty, so later versions can add sections at the end.
+struct CheckpointHeader {
+    char m_magic[8];
+    uint32_t m_version;
+    uint32_t m_value_bytes;
+    int32_t m_rank;
+    int32_t m_num_ranks;
+    int32_t m_layout;
+    int32_t m_halo_width;
+    int32_t m_exchange_mode;
+    int32_t m_plan_compiled;
+    uint64_t m_num_cells;
+    uint64_t m_num_buffers;
+    uint64_t m_num_sections;
+};
+static_assert(sizeof(CheckpointHeader) == 64, "CheckpointHeader must keep its on-disk layout");
+
+static constexpr char checkpoint_magic[8] = {'U', 'C', 'C', 'K', 'P', 'T', '\0', '\0'};
+static constexpr uint32_t checkpoint_version = 1;
+
+//Values holds m_values followed by the m_other_buffers, the maps are stored as (rank, cell count) pairs in
+//rank order followed by the cells, and Geometry is left to subclasses such as LatticeProcessNode.
+enum class CheckpointSection { Values, GhostFlags, AdjOffsets, AdjIndices, GlobalIds, LayerEnds,
+                               PackRanks, PackCells, UnpackRanks, UnpackCells, Geometry, Count };
+
+template <typename T, typename Packer = PackTraits<T>> class ProcessNode {
     public:
+    typedef typename Packer::packed_type packed_type;
+
+    //cells handed to a pool thread at a time when packing and unpacking
+    static constexpr size_t pack_grain = 4096;
+
+    void allocatePackedData();
+    void releasePackedData();
     void bcastGPTRs();
+    void compileExchangePlan(ExchangeMode mode = ExchangeMode::Pull);
+    void clearExchangePlan();
+    void compileSchedule();
+    void clearSchedule();
+    void buildCSR();
+    void allocateBuffers(size_t num_buffers = 2);
+    void classifyCells();
+    void compileStencil();
     void recvAndUnpack();
     void packData();
+    upcxx::future<> beginExchange();
+    void finishExchange();
+    void barrier();
+
+    T& value(int i);
+    bool isGhost(int i) const;
+    NeighborRange neighbors(int i) const;
+    T* current();
+    T* next();
+    T* previous(size_t steps = 1);
+    void swap();
+    bool checkpoint(const std::string& path) const;
+    bool restore(const std::string& path);
+
+    protected:
+    bool writeCheckpoint(const std::string& path, const std::vector<int32_t>& geometry) const;
+    bool readCheckpoint(const std::string& path, std::vector<int32_t>& geometry);
+    void rewire(ExchangeMode mode, bool compile_plan);
+
+    private:
+    void setupPush();
+    ExchangePlan<packed_type>& planById(int plan_id);
+    void armArrivals(ExchangePlan<packed_type>& plan, int slot);
+    void markArrival(int plan_id, int slot, int source_rank);
+    void waitPending(ExchangePlan<packed_type>& plan, int slot);
+    void packPlan(ExchangePlan<packed_type>& plan);
+    upcxx::future<> pushPlan(int plan_id);
+    void unpackPlan(ExchangePlan<packed_type>& plan, int slot);
+    bool sendSparse(int plan_id, ExchangePlan<packed_type>& plan, size_t n, int slot);
+    void stageSparse(int plan_id, int slot, int source_rank, const upcxx::view<uint32_t>& runs,
+                     const upcxx::view<packed_type>& values);
+    void applySparse(ExchangePlan<packed_type>& plan, int slot);
 
     public:
-    DataNode<T>* m_data_nodes;
+    DataNode<T>* m_data_nodes = NULL;
+    size_t m_num_data_nodes = 0;
+
+    //in the CSR layout cell i's neighbors are m_adj_indices[m_adj_offsets[i] .. m_adj_offsets[i+1]) and its
+    //payload is m_values[i]. Indices stay valid when the arrays are copied, unlike DataNode's neighbor pointers.
+    CellLayout m_layout = CellLayout::Nodes;
+    std::vector<size_t> m_adj_offsets;
+    std::vector<int32_t> m_adj_indices;
+    std::vector<T> m_values;
+    std::vector<unsigned char> m_ghost_flags;
+
+    //buffers besides m_values set up by allocateBuffers(), the next one first and then older states newest first
+    std::vector<std::vector<T>> m_other_buffers;
 
-    std::unordered_map<int, upcxx::global_ptr<DataNode<T>>> m_packed_data;
+    //global cell id of every local cell and its inverse, filled by the decomposition builders
+    std::vector<long long> m_global_ids;
+    std::unordered_map<long long, int> m_global_to_local;
+
+    //layers of ghosts the decomposition builders set up. A halo m_halo_width hops deep holds everything the
+    //owned cells depend on for that many steps, so an exchange only has to happen every m_halo_width steps
+    //if the ghost layers are updated too, see applyStencil(). Cells [0, m_layer_ends[k]) are the owned cells
+    //and the first k ghost layers, filled by wireProcessNode().
+    int m_halo_width = 1;
+    std::vector<size_t> m_layer_ends;
+
+    //non-ghost cells split by whether any neighbor is a ghost, filled by classifyCells()
+    std::vector<int> m_interior_cells;
+    std::vector<int> m_boundary_cells;
+
+    //m_interior_cells, m_boundary_cells and then every ghost layer but the last in ELLPACK form, filled by
+    //compileStencil()
+    bool m_stencil_compiled = false;
+    std::vector<EllBlock> m_stencil_blocks;
+
+    //when set, packing, unpacking and applyStencil() are spread over the pool's threads
+    ThreadPool* m_thread_pool = NULL;
+
+    //communication counters, only filled when UNICUBE_INSTRUMENT is defined
+    CommStats m_stats;
+
+    //sparse exchange settings, picked up by the next compileExchangePlan()
+    SparseExchange m_sparse;
+
+    bool m_plan_compiled = false;
+    ExchangeMode m_exchange_mode = ExchangeMode::Pull;
+    ExchangePlan<packed_type> m_plan;
+    std::unique_ptr<upcxx::promise<>> m_recv_promise;
+    upcxx::future<> m_pending_exchange;
+
+    //how RPCs from other ranks find this node, created by the first collective that needs it
+    std::unique_ptr<upcxx::dist_object<ProcessNode*>> m_dist_self;
+    //push mode state
+    std::unordered_map<int, std::pair<upcxx::global_ptr<packed_type>, size_t>> m_push_targets;
+
+    //once compileSchedule() has run, packData(), beginExchange() and finishExchange() go through these phases
+    //in order instead of the single exchange described by m_pack_map and m_unpack_map
+    std::vector<ExchangePhase> m_schedule;
+    std::vector<ExchangePlan<packed_type>> m_schedule_plans;
+
+    std::unordered_map<int, upcxx::global_ptr<packed_type>> m_packed_data;
     std::unordered_map<int, size_t> m_packed_data_sizes;
-    std::unordered_map<int, upcxx::global_ptr<DataNode<T>>> m_neighbor_data;
+    std::unordered_map<int, upcxx::global_ptr<packed_type>> m_neighbor_data;
     std::unordered_map<int, size_t> m_neighbor_data_sizes;
     std::unordered_map<int, std::vector<int>> m_unpack_map;
     std::unordered_map<int, std::vector<int>> m_pack_map;
 };
 
-template <typename T> void ProcessNode<T>::bcastGPTRs(){
-    for(auto pair : m_packed_data){
+//Allocates one packed buffer per entry of m_pack_map, sized to hold packed_type rather than whole DataNodes.
+template <typename T, typename Packer> void ProcessNode<T, Packer>::allocatePackedData(){
+    for(auto& pair : m_pack_map){
+        int process_id = pair.first;
+        m_packed_data[process_id] = upcxx::new_array<packed_type>(pair.second.size());
+        m_packed_data_sizes[process_id] = pair.second.size();
+    }
+}
+
+//Frees the packed buffers and forgets the neighbors' ones, so the maps can be wired again. Neighbors must
+//be done reading our buffers, e.g. after a barrier.
+template <typename T, typename Packer> void ProcessNode<T, Packer>::releasePackedData(){
+    for(auto& pair : m_packed_data) upcxx::delete_array(pair.second);
+    m_packed_data.clear();
+    m_packed_data_sizes.clear();
+    m_neighbor_data.clear();
+    m_neighbor_data_sizes.clear();
+    m_push_targets.clear();
+}
+
+//Tells every rank in m_pack_map where to find our packed buffer for it, with all the RPCs in flight at once.
+//Receivers learn who sends to them from the RPCs themselves, so m_unpack_map only has to cover the ranks that
+//actually pack for us. Collective, and m_neighbor_data is complete on every rank after the next barrier.
+template <typename T, typename Packer> void ProcessNode<T, Packer>::bcastGPTRs(){
+    if(!m_dist_self) m_dist_self.reset(new upcxx::dist_object<ProcessNode*>(this));
+    upcxx::future<> all_sent = upcxx::make_future();
+    for(auto& pair : m_packed_data){
         int process_id = pair.first;
-        upcxx::rpc(process_id,
-                    [&](upcxx::global_ptr<DataNode<T>> gptr, int source_rank, size_t data_size){
-                this->m_neighbor_data[source_rank] = gptr;
-                this->m_neighbor_data_sizes[source_rank] = data_size;
-            }, m_packed_data.at(process_id), upcxx::rank_me(), m_packed_data_sizes.at(process_id)).wait();
+        upcxx::future<> f = upcxx::rpc(process_id,
+                    [](upcxx::dist_object<ProcessNode*>& self, upcxx::global_ptr<packed_type> gptr, int source_rank,
+                       size_t data_size){
+                (*self)->m_neighbor_data[source_rank] = gptr;
+                (*self)->m_neighbor_data_sizes[source_rank] = data_size;
+            }, *m_dist_self, pair.second, upcxx::rank_me(), m_packed_data_sizes.at(process_id));
+        all_sent = upcxx::when_all(all_sent, f);
     }
+    all_sent.wait();
 }
 
-template <typename T> void ProcessNode<T>::packData(){
+//Must be called after bcastGPTRs() and again whenever the pack/unpack maps change.
+//In push mode this is collective and must be called with the same mode on every rank.
+//Throws std::out_of_range if a rank we receive from has no m_unpack_map entry or one whose length differs
+//from what that rank packs for us.
+template <typename T, typename Packer> void ProcessNode<T, Packer>::compileExchangePlan(ExchangeMode mode){
+    clearExchangePlan();
+    m_exchange_mode = mode;
+
+    std::vector<int> send_ranks;
+    for(auto& pair : m_pack_map) send_ranks.push_back(pair.first);
+    std::sort(send_ranks.begin(), send_ranks.end());
+    m_plan.m_send_offsets.push_back(0);
+    for(int process_id : send_ranks){
+        const std::vector<int>& locations = m_pack_map.at(process_id);
+        m_plan.m_send_ranks.push_back(process_id);
+        m_plan.m_send_indices.insert(m_plan.m_send_indices.end(), locations.begin(), locations.end());
+        m_plan.m_send_offsets.push_back(m_plan.m_send_indices.size());
+        m_plan.m_send_buffers.push_back(m_packed_data.at(process_id).local());
+    }
+
+    std::vector<int> recv_ranks;
+    for(auto& pair : m_neighbor_data) recv_ranks.push_back(pair.first);
+    std::sort(recv_ranks.begin(), recv_ranks.end());
+    m_plan.m_recv_offsets.push_back(0);
+    for(int process_id : recv_ranks){
+        const std::vector<int>& locations = m_unpack_map.at(process_id);
+        size_t size = m_neighbor_data_sizes.at(process_id);
+        //the plan is reused every step, so a map that does not match what the sender packs must not get in
+        if(locations.size() != size){
+            throw std::out_of_range("compileExchangePlan: m_unpack_map[" + std::to_string(process_id) + "] has " +
+                                    std::to_string(locations.size()) + " cells but rank " +
+                                    std::to_string(process_id) + " packs " + std::to_string(size));
+        }
+        m_plan.m_recv_ranks.push_back(process_id);
+        m_plan.m_recv_indices.insert(m_plan.m_recv_indices.end(), locations.begin(), locations.end());
+        m_plan.m_recv_offsets.push_back(m_plan.m_recv_indices.size());
+        m_plan.m_recv_sources.push_back(m_neighbor_data.at(process_id));
+        if(mode == ExchangeMode::Pull){
+            upcxx::global_ptr<packed_type> source = m_neighbor_data.at(process_id);
+            m_plan.m_recv_locals.push_back(source.is_local() ? source.local() : NULL);
+        }
+    }
+    m_plan.m_recv_slot_size = m_plan.m_recv_indices.size();
+    size_t num_slots = (mode == ExchangeMode::Push) ? 2 : 1;
+    if(m_plan.m_recv_slot_size > 0){
+        m_plan.m_recv_buffer = upcxx::new_array<packed_type>(num_slots*m_plan.m_recv_slot_size);
+    }
+    m_plan.m_sparse = m_sparse.m_enabled && mode == ExchangeMode::Push;
+    if(m_plan.m_sparse){
+        m_plan.m_sent_values.resize(m_plan.m_send_indices.size());
+        m_plan.m_recv_mirror.resize(m_plan.m_recv_slot_size);
+    }
+    m_plan_compiled = true;
+    if(mode == ExchangeMode::Push) setupPush();
+}
+
+//Tells every rank we receive from where in our receive buffer its data goes, then arms the arrival counters.
+template <typename T, typename Packer> void ProcessNode<T, Packer>::setupPush(){
+    if(!m_dist_self) m_dist_self.reset(new upcxx::dist_object<ProcessNode*>(this));
+    //armed before the barrier below since a neighbor may push as soon as it leaves it
+    armArrivals(m_plan, 0);
+    armArrivals(m_plan, 1);
+
+    upcxx::future<> all_sent = upcxx::make_future();
+    for(size_t n = 0; n < m_plan.m_recv_ranks.size(); n++){
+        upcxx::future<> f = upcxx::rpc(m_plan.m_recv_ranks[n],
+                    [](upcxx::dist_object<ProcessNode*>& self, int dest_rank,
+                       upcxx::global_ptr<packed_type> target, size_t slot_stride){
+                (*self)->m_push_targets[dest_rank] = std::make_pair(target, slot_stride);
+            }, *m_dist_self, upcxx::rank_me(), m_plan.m_recv_buffer + m_plan.m_recv_offsets[n], m_plan.m_recv_slot_size);
+        all_sent = upcxx::when_all(all_sent, f);
+    }
+    all_sent.wait();
+    upcxx::barrier();
+
+    for(int process_id : m_plan.m_send_ranks){
+        upcxx::global_ptr<packed_type> target = m_push_targets.at(process_id).first;
+        m_plan.m_send_targets.push_back(target);
+        m_plan.m_send_slot_strides.push_back(m_push_targets.at(process_id).second);
+        m_plan.m_send_locals.push_back(target.is_local() ? target.local() : NULL);
+    }
+    m_push_targets.clear();
+}
+
+//Plan -1 is m_plan and plan k is phase k of the schedule, which is how RPCs name them.
+template <typename T, typename Packer>
+inline ExchangePlan<typename Packer::packed_type>& ProcessNode<T, Packer>::planById(int plan_id){
+    return plan_id < 0 ? m_plan : m_schedule_plans[plan_id];
+}
+
+//Called by the RPC that comes with a neighbor's push.
+template <typename T, typename Packer> void ProcessNode<T, Packer>::markArrival(int plan_id, int slot, int source_rank){
+    ExchangePlan<packed_type>& plan = planById(plan_id);
+    if constexpr(instrument_comms){
+        size_t n = std::lower_bound(plan.m_recv_ranks.begin(), plan.m_recv_ranks.end(), source_rank) - plan.m_recv_ranks.begin();
+        plan.m_arrival_us[slot][n] = CommStats::nowUs();
+    }
+    plan.m_arrivals[slot]->fulfill_anonymous(1);
+}
+
+template <typename T, typename Packer> void ProcessNode<T, Packer>::armArrivals(ExchangePlan<packed_type>& plan, int slot){
+    plan.m_arrivals[slot].reset(new upcxx::promise<>());
+    plan.m_arrivals[slot]->require_anonymous(plan.m_recv_ranks.size());
+    plan.m_arrived[slot] = plan.m_arrivals[slot]->finalize();
+    if(plan.m_sparse) plan.m_recv_dense[slot].assign(plan.m_recv_ranks.size(), 1);
+    if constexpr(instrument_comms) plan.m_arrival_us[slot].assign(plan.m_recv_ranks.size(), 0.0);
+}
+
+//Push mode is torn down collectively as neighbors may still be writing into our receive buffer.
+template <typename T, typename Packer> void ProcessNode<T, Packer>::clearExchangePlan(){
+    if(m_plan_compiled && m_exchange_mode == ExchangeMode::Push) upcxx::barrier();
+    if(m_plan.m_recv_buffer) upcxx::delete_array(m_plan.m_recv_buffer);
+    m_plan = ExchangePlan<packed_type>();
+    m_plan_compiled = false;
+}
+
+//Compiles m_schedule into one push-mode plan per phase. Collective, and every rank needs the same number of
+//phases, some of which may be empty. The schedule is used instead of the plan from compileExchangePlan() until
+//clearSchedule() is called.
+template <typename T, typename Packer> void ProcessNode<T, Packer>::compileSchedule(){
+    clearSchedule();
+    if(!m_dist_self) m_dist_self.reset(new upcxx::dist_object<ProcessNode*>(this));
+
+    for(const ExchangePhase& phase : m_schedule){
+        ExchangePlan<packed_type> plan;
+        for(auto& pair : phase.m_pack_map) plan.m_send_ranks.push_back(pair.first);
+        std::sort(plan.m_send_ranks.begin(), plan.m_send_ranks.end());
+        plan.m_send_offsets.push_back(0);
+        for(int process_id : plan.m_send_ranks){
+            const std::vector<int>& locations = phase.m_pack_map.at(process_id);
+            plan.m_send_indices.insert(plan.m_send_indices.end(), locations.begin(), locations.end());
+            plan.m_send_offsets.push_back(plan.m_send_indices.size());
+        }
+        plan.m_send_storage.resize(plan.m_send_indices.size());
+        for(size_t n = 0; n < plan.m_send_ranks.size(); n++){
+            plan.m_send_buffers.push_back(plan.m_send_storage.data() + plan.m_send_offsets[n]);
+        }
+        plan.m_send_targets.resize(plan.m_send_ranks.size());
+        plan.m_send_slot_strides.resize(plan.m_send_ranks.size());
+
+        for(auto& pair : phase.m_unpack_map) plan.m_recv_ranks.push_back(pair.first);
+        std::sort(plan.m_recv_ranks.begin(), plan.m_recv_ranks.end());
+        plan.m_recv_offsets.push_back(0);
+        for(int process_id : plan.m_recv_ranks){
+            const std::vector<int>& locations = phase.m_unpack_map.at(process_id);
+            plan.m_recv_indices.insert(plan.m_recv_indices.end(), locations.begin(), locations.end());
+            plan.m_recv_offsets.push_back(plan.m_recv_indices.size());
+        }
+        plan.m_recv_slot_size = plan.m_recv_indices.size();
+        if(plan.m_recv_slot_size > 0) plan.m_recv_buffer = upcxx::new_array<packed_type>(2*plan.m_recv_slot_size);
+        armArrivals(plan, 0);
+        armArrivals(plan, 1);
+        m_schedule_plans.push_back(std::move(plan));
+    }
+    //every phase exists and is armed on every rank before anyone learns where to put data
+    upcxx::barrier();
+
+    upcxx::future<> all_sent = upcxx::make_future();
+    for(size_t k = 0; k < m_schedule_plans.size(); k++){
+        ExchangePlan<packed_type>& plan = m_schedule_plans[k];
+        for(size_t n = 0; n < plan.m_recv_ranks.size(); n++){
+            upcxx::future<> f = upcxx::rpc(plan.m_recv_ranks[n],
+                        [](upcxx::dist_object<ProcessNode*>& self, int plan_id, int dest_rank,
+                           upcxx::global_ptr<packed_type> target, size_t slot_stride){
+                    ExchangePlan<packed_type>& sender_plan = (*self)->planById(plan_id);
+                    size_t s = std::lower_bound(sender_plan.m_send_ranks.begin(), sender_plan.m_send_ranks.end(), dest_rank) -
+                               sender_plan.m_send_ranks.begin();
+                    sender_plan.m_send_targets[s] = target;
+                    sender_plan.m_send_slot_strides[s] = slot_stride;
+                }, *m_dist_self, (int)k, upcxx::rank_me(), plan.m_recv_buffer + plan.m_recv_offsets[n], plan.m_recv_slot_size);
+            all_sent = upcxx::when_all(all_sent, f);
+        }
+    }
+    all_sent.wait();
+    upcxx::barrier();
+
+    for(ExchangePlan<packed_type>& plan : m_schedule_plans){
+        for(upcxx::global_ptr<packed_type> target : plan.m_send_targets){
+            plan.m_send_locals.push_back(target.is_local() ? target.local() : NULL);
+        }
+    }
+}
+
+//Collective, like clearExchangePlan() in push mode.
+template <typename T, typename Packer> void ProcessNode<T, Packer>::clearSchedule(){
+    if(m_schedule_plans.empty()) return;
+    upcxx::barrier();
+    for(ExchangePlan<packed_type>& plan : m_schedule_plans){
+        if(plan.m_recv_buffer) upcxx::delete_array(plan.m_recv_buffer);
+    }
+    m_schedule_plans.clear();
+}
+
+template <typename T, typename Packer> inline T& ProcessNode<T, Packer>::value(int i){
+    return m_layout == CellLayout::Nodes ? m_data_nodes[i].m_data : m_values[i];
+}
+
+//Dense layouts compute this from their geometry, see LatticeProcessNode::isGhost().
+template <typename T, typename Packer> inline bool ProcessNode<T, Packer>::isGhost(int i) const {
+    return m_layout == CellLayout::Nodes ? m_data_nodes[i].m_ghost : m_ghost_flags[i] != 0;
+}
+
+//Only valid in the CSR layout.
+template <typename T, typename Packer> inline NeighborRange ProcessNode<T, Packer>::neighbors(int i) const {
+    NeighborRange range = {m_adj_indices.data() + m_adj_offsets[i], m_adj_indices.data() + m_adj_offsets[i+1]};
+    return range;
+}
+
+//Converts the m_data_nodes network into CSR form and switches to it. m_data_nodes is left for the caller to free.
+template <typename T, typename Packer> void ProcessNode<T, Packer>::buildCSR(){
+    m_adj_offsets.assign(1, 0);
+    m_adj_indices.clear();
+    m_values.resize(m_num_data_nodes);
+    m_ghost_flags.resize(m_num_data_nodes);
+    for(size_t i = 0; i < m_num_data_nodes; i++){
+        const DataNode<T>& dn = m_data_nodes[i];
+        for(int j = 0; j < dn.m_num_neighbors; j++){
+            m_adj_indices.push_back(dn.m_neighbors[j] - m_data_nodes);
+        }
+        m_adj_offsets.push_back(m_adj_indices.size());
+        m_values[i] = dn.m_data;
+        m_ghost_flags[i] = dn.m_ghost;
+    }
+    m_layout = CellLayout::CSR;
+}
+
+//Gives the cells num_buffers copies of their state so a timestep can write next() while reading current()
+//and then swap() without allocating or copying. m_values always holds the current state, so exchanges and
+//value() follow swaps on their own. A Nodes layout is converted with buildCSR() first.
+template <typename T, typename Packer> void ProcessNode<T, Packer>::allocateBuffers(size_t num_buffers){
+    if(m_layout == CellLayout::Nodes) buildCSR();
+    //every buffer starts as a copy so halo cells that are never exchanged agree across swaps
+    m_other_buffers.assign(std::max<size_t>(num_buffers, 2) - 1, m_values);
+}
+
+template <typename T, typename Packer> inline T* ProcessNode<T, Packer>::current(){
+    return m_values.data();
+}
+
+template <typename T, typename Packer> inline T* ProcessNode<T, Packer>::next(){
+    return m_other_buffers[0].data();
+}
+
+//The state from steps swaps ago, needs steps + 2 buffers.
+template <typename T, typename Packer> inline T* ProcessNode<T, Packer>::previous(size_t steps){
+    return m_other_buffers[steps].data();
+}
+
+//Makes next() current and current() previous(1). Swaps vector storage only, so it does not depend on the
+//number of cells. The halo cells of the new current state are stale until the next exchange.
+template <typename T, typename Packer> void ProcessNode<T, Packer>::swap(){
+    size_t num_other = m_other_buffers.size();
+    std::swap(m_values, m_other_buffers[0]);
+    //the oldest state is recycled as the new next buffer
+    for(size_t k = num_other - 1; k > 0; k--) std::swap(m_other_buffers[k - 1], m_other_buffers[k]);
+}
+
+//Interior cells only read owned data, so they can be updated while a split-phase exchange is in flight.
+//Dense layouts iterate their regions directly instead, see LatticeProcessNode::forEachRow().
+template <typename T, typename Packer> void ProcessNode<T, Packer>::classifyCells(){
+    m_interior_cells.clear();
+    m_boundary_cells.clear();
+    m_stencil_compiled = false;
+    if(m_layout == CellLayout::Dense) return;
+    for(size_t i = 0; i < m_num_data_nodes; i++){
+        if(isGhost(i)) continue;
+        bool touches_ghost = false;
+        if(m_layout == CellLayout::CSR){
+            for(int32_t j : neighbors(i)){
+                if(m_ghost_flags[j]) touches_ghost = true;
+            }
+        } else {
+            const DataNode<T>& dn = m_data_nodes[i];
+            for(int j = 0; j < dn.m_num_neighbors; j++){
+                if(dn.m_neighbors[j]->m_ghost) touches_ghost = true;
+            }
+        }
+        if(touches_ghost) m_boundary_cells.push_back(i);
+        else m_interior_cells.push_back(i);
+    }
+}
+
+//Only valid in the CSR layout, after classifyCells().
+template <typename T, typename Packer> void ProcessNode<T, Packer>::compileStencil(){
+    std::vector<std::vector<int>> lists = {m_interior_cells, m_boundary_cells};
+    for(size_t layer = 1; layer + 1 < m_layer_ends.size(); layer++){
+        lists.emplace_back();
+        for(size_t i = m_layer_ends[layer - 1]; i < m_layer_ends[layer]; i++) lists.back().push_back(i);
+    }
+    m_stencil_blocks.assign(lists.size(), EllBlock());
+    for(size_t b = 0; b < lists.size(); b++){
+        EllBlock& block = m_stencil_blocks[b];
+        const std::vector<int>& cells = lists[b];
+        if(cells.empty()) continue;
+        for(int i : cells) block.m_width = std::max(block.m_width, (int)neighbors(i).size());
+        //padded so that applyStencil() needs no remainder loop
+        size_t num_padded = (cells.size() + EllBlock::padding - 1) / EllBlock::padding * EllBlock::padding;
+        block.m_cells.assign(cells.begin(), cells.end());
+        block.m_cells.resize(num_padded, cells.back());
+        block.m_indices.resize((size_t)block.m_width*num_padded);
+        block.m_degrees.resize(num_padded);
+        for(size_t c = 0; c < num_padded; c++){
+            int i = block.m_cells[c];
+            NeighborRange nbrs = neighbors(i);
+            block.m_degrees[c] = nbrs.size();
+            for(int k = 0; k < block.m_width; k++){
+                block.m_indices[k*num_padded + c] = k < (int)nbrs.size() ? nbrs.begin()[k] : i;
+            }
+        }
+    }
+    m_stencil_compiled = true;
+}
+
+//Neighbors on our node are packed directly into the slot of their receive buffer that the coming exchange uses.
+template <typename T, typename Packer> void ProcessNode<T, Packer>::packPlan(ExchangePlan<packed_type>& plan){
+    int slot = plan.m_exchange_count % 2;
+    //chunks run over the send indices of all neighbors at once, so one large neighbor is still split up
+    parallelFor(m_thread_pool, 0, plan.m_send_indices.size(), pack_grain, [&](size_t begin, size_t end){
+        size_t n = std::upper_bound(plan.m_send_offsets.begin(), plan.m_send_offsets.end(), begin) -
+                   plan.m_send_offsets.begin() - 1;
+        for(size_t e = begin; e < end; n++){
+            size_t segment_end = std::min(end, plan.m_send_offsets[n+1]);
+            packed_type* buffer = plan.m_send_buffers[n];
+            if(!plan.m_send_locals.empty() && plan.m_send_locals[n]){
+                buffer = plan.m_send_locals[n] + slot*plan.m_send_slot_strides[n];
+            }
+            double start_us = instrument_comms ? CommStats::nowUs() : 0.0;
+            size_t segment_begin = e;
+            for(; e < segment_end; e++){
+                Packer::pack(value(plan.m_send_indices[e]), buffer[e - plan.m_send_offsets[n]]);
+            }
+            if constexpr(instrument_comms){
+                m_stats.record(plan.m_send_ranks[n], CommPhase::Pack, CommStats::nowUs() - start_us,
+                               (segment_end - segment_begin)*sizeof(packed_type));
+            }
+        }
+    });
+}
+
+//The receive buffer is laid out in the same order as m_recv_indices, neighbors on our node in pull mode are
+//unpacked from their own packed buffers instead and sparse plans from m_recv_mirror.
+template <typename T, typename Packer> void ProcessNode<T, Packer>::unpackPlan(ExchangePlan<packed_type>& plan, int slot){
+    packed_type* recv_buffer = plan.m_sparse ? plan.m_recv_mirror.data() : plan.m_recv_buffer.local() + slot*plan.m_recv_slot_size;
+    parallelFor(m_thread_pool, 0, plan.m_recv_indices.size(), pack_grain, [&](size_t begin, size_t end){
+        size_t n = std::upper_bound(plan.m_recv_offsets.begin(), plan.m_recv_offsets.end(), begin) -
+                   plan.m_recv_offsets.begin() - 1;
+        for(size_t i = begin; i < end; n++){
+            size_t segment_end = std::min(end, plan.m_recv_offsets[n+1]);
+            const packed_type* buffer = recv_buffer + plan.m_recv_offsets[n];
+            if(!plan.m_recv_locals.empty() && plan.m_recv_locals[n]) buffer = plan.m_recv_locals[n];
+            double start_us = instrument_comms ? CommStats::nowUs() : 0.0;
+            size_t segment_begin = i;
+            for(; i < segment_end; i++){
+                Packer::unpack(buffer[i - plan.m_recv_offsets[n]], value(plan.m_recv_indices[i]));
+            }
+            if constexpr(instrument_comms){
+                m_stats.record(plan.m_recv_ranks[n], CommPhase::Unpack, CommStats::nowUs() - start_us,
+                               (segment_end - segment_begin)*sizeof(packed_type));
+            }
+        }
+    });
+}
+
+//Puts every neighbor's packed data into its receive buffer and returns a future for both our sends and
+//the neighbors' arrivals. Neighbors on our node already hold their data after packPlan() and are only told.
+template <typename T, typename Packer> upcxx::future<> ProcessNode<T, Packer>::pushPlan(int plan_id){
+    ExchangePlan<packed_type>& plan = planById(plan_id);
+    int slot = plan.m_exchange_count % 2;
+    if constexpr(instrument_comms) plan.m_begin_us = CommStats::nowUs();
+    plan.m_send_promise.reset(new upcxx::promise<>());
+    auto arrival = [](upcxx::dist_object<ProcessNode*>& self, int plan_id, int slot, int source_rank){
+        (*self)->markArrival(plan_id, slot, source_rank);
+    };
+    for(size_t n = 0; n < plan.m_send_ranks.size(); n++){
+        if(plan.m_send_locals[n]){
+            //the packed data must be visible before the neighbor hears of it
+            std::atomic_thread_fence(std::memory_order_release);
+            upcxx::rpc_ff(plan.m_send_ranks[n], arrival, *m_dist_self, plan_id, slot, upcxx::rank_me());
+            continue;
+        }
+        //the first exchange is dense since the neighbor has nothing to apply runs to yet
+        if(plan.m_sparse && plan.m_exchange_count > 0 && sendSparse(plan_id, plan, n, slot)) continue;
+        size_t count = plan.m_send_offsets[n+1] - plan.m_send_offsets[n];
+        if(plan.m_sparse){
+            std::copy(plan.m_send_buffers[n], plan.m_send_buffers[n] + count, plan.m_sent_values.begin() + plan.m_send_offsets[n]);
+        }
+        auto completions = upcxx::remote_cx::as_rpc(arrival, *m_dist_self, plan_id, slot, upcxx::rank_me()) |
+                           upcxx::operation_cx::as_promise(*plan.m_send_promise);
+        upcxx::global_ptr<packed_type> target = plan.m_send_targets[n] + slot*plan.m_send_slot_strides[n];
+        if constexpr(instrument_comms){
+            int rank = plan.m_send_ranks[n];
+            double start_us = CommStats::nowUs();
+            upcxx::rput(plan.m_send_buffers[n], target, count, completions | upcxx::operation_cx::as_future()).then(
+                [this, rank, start_us, count](){
+                    m_stats.record(rank, CommPhase::Transfer, CommStats::nowUs() - start_us, count*sizeof(packed_type));
+                });
+        } else {
+            upcxx::rput(plan.m_send_buffers[n], target, count, completions);
+        }
+    }
+    return upcxx::when_all(plan.m_arrived[slot], plan.m_send_promise->finalize());
+}
+
+//Compares neighbor n's packed cells with what it last received from us and sends the changed ones as
+//(position, length) runs in one RPC that also counts as their arrival. Returns false without sending when
+//pushPlan() should send dense data instead.
+template <typename T, typename Packer>
+bool ProcessNode<T, Packer>::sendSparse(int plan_id, ExchangePlan<packed_type>& plan, size_t n, int slot){
+    double start_us = instrument_comms ? CommStats::nowUs() : 0.0;
+    size_t count = plan.m_send_offsets[n+1] - plan.m_send_offsets[n];
+    const packed_type* packed = plan.m_send_buffers[n];
+    packed_type* sent = plan.m_sent_values.data() + plan.m_send_offsets[n];
+    size_t max_changed = (size_t)(m_sparse.m_dense_fraction*count);
+    plan.m_encode_runs.clear();
+    plan.m_encode_values.clear();
+    for(size_t i = 0; i < count; i++){
+        if(!packedChanged(sent[i], packed[i], m_sparse.m_tolerance)) continue;
+        if(plan.m_encode_values.size() == max_changed) return false;
+        size_t num_runs = plan.m_encode_runs.size();
+        if(num_runs > 0 && plan.m_encode_runs[num_runs-2] + plan.m_encode_runs[num_runs-1] == i){
+            plan.m_encode_runs[num_runs-1]++;
+        } else {
+            plan.m_encode_runs.push_back(i);
+            plan.m_encode_runs.push_back(1);
+        }
+        plan.m_encode_values.push_back(packed[i]);
+    }
+    size_t bytes = plan.m_encode_runs.size()*sizeof(uint32_t) + plan.m_encode_values.size()*sizeof(packed_type);
+    if(plan.m_encode_values.size() > 0 && bytes >= count*sizeof(packed_type)) return false;
+
+    //cells within the tolerance keep their old sent value, so drift never adds up past it
+    const packed_type* value = plan.m_encode_values.data();
+    for(size_t r = 0; r < plan.m_encode_runs.size(); r += 2){
+        std::copy(value, value + plan.m_encode_runs[r+1], sent + plan.m_encode_runs[r]);
+        value += plan.m_encode_runs[r+1];
+    }
+    //views are serialized before rpc_ff() returns, so the scratch vectors can be reused right away
+    upcxx::rpc_ff(plan.m_send_ranks[n],
+                  [](upcxx::dist_object<ProcessNode*>& self, int plan_id, int slot, int source_rank,
+                     const upcxx::view<uint32_t>& runs, const upcxx::view<packed_type>& values){
+            (*self)->stageSparse(plan_id, slot, source_rank, runs, values);
+        }, *m_dist_self, plan_id, slot, upcxx::rank_me(),
+        upcxx::make_view(plan.m_encode_runs.begin(), plan.m_encode_runs.end()),
+        upcxx::make_view(plan.m_encode_values.begin(), plan.m_encode_values.end()));
+    if constexpr(instrument_comms){
+        m_stats.record(plan.m_send_ranks[n], CommPhase::Transfer, CommStats::nowUs() - start_us, bytes);
+    }
+    return true;
+}
+
+//Called by the RPC of a neighbor's sparse send. Runs are kept per slot since a neighbor one exchange ahead
+//may send before we have applied its previous ones.
+template <typename T, typename Packer>
+void ProcessNode<T, Packer>::stageSparse(int plan_id, int slot, int source_rank, const upcxx::view<uint32_t>& runs,
+                                         const upcxx::view<packed_type>& values){
+    ExchangePlan<packed_type>& plan = planById(plan_id);
+    size_t n = std::lower_bound(plan.m_recv_ranks.begin(), plan.m_recv_ranks.end(), source_rank) - plan.m_recv_ranks.begin();
+    plan.m_recv_dense[slot][n] = 0;
+    for(size_t r = 0; r < runs.size(); r += 2){
+        plan.m_staged_runs[slot].push_back(plan.m_recv_offsets[n] + runs[r]);
+        plan.m_staged_runs[slot].push_back(runs[r+1]);
+    }
+    plan.m_staged_values[slot].insert(plan.m_staged_values[slot].end(), values.begin(), values.end());
+    markArrival(plan_id, slot, source_rank);
+}
+
+//Brings m_recv_mirror up to date with the exchange in slot. Neighbors that sent dense data are copied from
+//the receive buffer and the staged runs of the others are written over their old values.
+template <typename T, typename Packer> void ProcessNode<T, Packer>::applySparse(ExchangePlan<packed_type>& plan, int slot){
+    const packed_type* recv_buffer = plan.m_recv_buffer.local() + slot*plan.m_recv_slot_size;
+    for(size_t n = 0; n < plan.m_recv_ranks.size(); n++){
+        if(!plan.m_recv_dense[slot][n]) continue;
+        std::copy(recv_buffer + plan.m_recv_offsets[n], recv_buffer + plan.m_recv_offsets[n+1],
+                  plan.m_recv_mirror.begin() + plan.m_recv_offsets[n]);
+    }
+    const packed_type* value = plan.m_staged_values[slot].data();
+    for(size_t r = 0; r < plan.m_staged_runs[slot].size(); r += 2){
+        std::copy(value, value + plan.m_staged_runs[slot][r+1], plan.m_recv_mirror.begin() + plan.m_staged_runs[slot][r]);
+        value += plan.m_staged_runs[slot][r+1];
+    }
+    plan.m_staged_runs[slot].clear();
+    plan.m_staged_values[slot].clear();
+}
+
+template <typename T, typename Packer> void ProcessNode<T, Packer>::packData(){
+    if(!m_schedule_plans.empty()){
+        packPlan(m_schedule_plans[0]);
+        return;
+    }
+    if(m_plan_compiled){
+        packPlan(m_plan);
+        return;
+    }
     for(auto pair : m_pack_map){
         int process_id = pair.first;
-        DataNode<T>* local_packed_data = m_packed_data.at(process_id).local();
+        double start_us = instrument_comms ? CommStats::nowUs() : 0.0;
+        packed_type* local_packed_data = m_packed_data.at(process_id).local();
         for(unsigned int i = 0; i < pair.second.size(); i++){
-            local_packed_data[i].m_data = m_data_nodes[pair.second[i]].m_data;
+            Packer::pack(value(pair.second[i]), local_packed_data[i]);
+        }
+        if constexpr(instrument_comms){
+            m_stats.record(process_id, CommPhase::Pack, CommStats::nowUs() - start_us, pair.second.size()*sizeof(packed_type));
+        }
+    }
+}
+
+//Starts the exchange of the data staged by packData() and returns without waiting. In pull mode every
+//neighbor must have finished packData() before this is called, in push mode no synchronization is needed.
+//With a schedule only its first phase is started here.
+template <typename T, typename Packer> upcxx::future<> ProcessNode<T, Packer>::beginExchange(){
+    if(!m_schedule_plans.empty()){
+        m_pending_exchange = pushPlan(0);
+        return m_pending_exchange;
+    }
+    if(!m_plan_compiled) compileExchangePlan();
+
+    if(m_exchange_mode == ExchangeMode::Push){
+        m_pending_exchange = pushPlan(-1);
+        return m_pending_exchange;
+    }
+
+    //the promise has to outlive the gets, so it is kept until the next exchange
+    packed_type* recv_buffer = m_plan.m_recv_buffer.local();
+    m_recv_promise.reset(new upcxx::promise<>());
+    for(size_t n = 0; n < m_plan.m_recv_ranks.size(); n++){
+        if(m_plan.m_recv_locals[n]) continue;
+        size_t count = m_plan.m_recv_offsets[n+1] - m_plan.m_recv_offsets[n];
+        packed_type* destination = recv_buffer + m_plan.m_recv_offsets[n];
+        if constexpr(instrument_comms){
+            int rank = m_plan.m_recv_ranks[n];
+            double start_us = CommStats::nowUs();
+            upcxx::rget(m_plan.m_recv_sources[n], destination, count,
+                        upcxx::operation_cx::as_promise(*m_recv_promise) | upcxx::operation_cx::as_future()).then(
+                [this, rank, start_us, count](){
+                    m_stats.record(rank, CommPhase::Transfer, CommStats::nowUs() - start_us, count*sizeof(packed_type));
+                });
+        } else {
+            upcxx::rget(m_plan.m_recv_sources[n], destination, count, upcxx::operation_cx::as_promise(*m_recv_promise));
+        }
+    }
+    m_pending_exchange = m_recv_promise->finalize();
+    return m_pending_exchange;
+}
+
+//Waits for the exchange started by beginExchange() and unpacks it into the ghost cells. With a schedule the
+//remaining phases run here, each packed only once the phases before it have been unpacked.
+template <typename T, typename Packer> void ProcessNode<T, Packer>::finishExchange(){
+    for(size_t k = 0; k < m_schedule_plans.size(); k++){
+        ExchangePlan<packed_type>& plan = m_schedule_plans[k];
+        if(k > 0){
+            packPlan(plan);
+            m_pending_exchange = pushPlan(k);
         }
+        int slot = plan.m_exchange_count % 2;
+        waitPending(plan, slot);
+        unpackPlan(plan, slot);
+        armArrivals(plan, slot);
+        plan.m_exchange_count++;
     }
+    if(!m_schedule_plans.empty()) return;
+
+    int slot = (m_exchange_mode == ExchangeMode::Push) ? m_plan.m_exchange_count % 2 : 0;
+    waitPending(m_plan, slot);
+    if(m_plan.m_sparse) applySparse(m_plan, slot);
+    unpackPlan(m_plan, slot);
+
+    if(m_exchange_mode == ExchangeMode::Push){
+        //a neighbor can only reuse this slot after receiving our next exchange, which happens after this
+        armArrivals(m_plan, slot);
+        m_plan.m_exchange_count++;
+    }
+}
+
+//Waits on m_pending_exchange. Instrumented builds count the time blocked and, in push mode, how long after the
+//start of our exchange each neighbor's data arrived.
+template <typename T, typename Packer> void ProcessNode<T, Packer>::waitPending(ExchangePlan<packed_type>& plan, int slot){
+    double start_us = instrument_comms ? CommStats::nowUs() : 0.0;
+    m_pending_exchange.wait();
+    if constexpr(instrument_comms){
+        m_stats.record(-1, CommPhase::Wait, CommStats::nowUs() - start_us);
+        for(size_t n = 0; n < plan.m_arrival_us[slot].size(); n++){
+            double delay_us = std::max(0.0, plan.m_arrival_us[slot][n] - plan.m_begin_us);
+            m_stats.record(plan.m_recv_ranks[n], CommPhase::Wait, delay_us);
+        }
+    }
+}
+
+//upcxx::barrier(), counted in m_stats. Pull mode loops can call it around their exchanges.
+template <typename T, typename Packer> void ProcessNode<T, Packer>::barrier(){
+    double start_us = instrument_comms ? CommStats::nowUs() : 0.0;
+    upcxx::barrier();
+    if constexpr(instrument_comms) m_stats.record(-1, CommPhase::Barrier, CommStats::nowUs() - start_us);
 }
 
-template <typename T> void ProcessNode<T>::recvAndUnpack(){
-    std::unordered_map<int, upcxx::global_ptr<DataNode<T>>> recv_data;
+template <typename T, typename Packer> void ProcessNode<T, Packer>::recvAndUnpack(){
+    if(m_plan_compiled){
+        beginExchange();
+        finishExchange();
+        return;
+    }
+
+    std::unordered_map<int, upcxx::global_ptr<packed_type>> recv_data;
     
-    //receive data from neighbors
+    //receive data from neighbors, those on our node are read in place
     upcxx::future<> future_all = upcxx::make_future();
     for(auto pair : m_neighbor_data){
         int process_id = pair.first;
-        upcxx::global_ptr<DataNode<T>> temp_recv = upcxx::new_array<DataNode<T>>(m_neighbor_data_sizes.at(process_id));
+        if(pair.second.is_local()) continue;
+        upcxx::global_ptr<packed_type> temp_recv = upcxx::new_array<packed_type>(m_neighbor_data_sizes.at(process_id));
         upcxx::future<> f = upcxx::copy(m_neighbor_data.at(process_id), temp_recv, m_neighbor_data_sizes.at(process_id));
+        if constexpr(instrument_comms){
+            double start_us = CommStats::nowUs();
+            size_t bytes = m_neighbor_data_sizes.at(process_id)*sizeof(packed_type);
+            f = f.then([this, process_id, start_us, bytes](){
+                m_stats.record(process_id, CommPhase::Transfer, CommStats::nowUs() - start_us, bytes);
+            });
+        }
         future_all = upcxx::when_all(future_all, f);
         recv_data[process_id] = temp_recv;
     }
+    double wait_us = instrument_comms ? CommStats::nowUs() : 0.0;
     future_all.wait();
+    if constexpr(instrument_comms) m_stats.record(-1, CommPhase::Wait, CommStats::nowUs() - wait_us);
 
     //unpack recv_data
     for(auto pair : m_unpack_map){
         int process_id = pair.first;
+        double start_us = instrument_comms ? CommStats::nowUs() : 0.0;
+        upcxx::global_ptr<packed_type> source = m_neighbor_data.at(process_id);
+        const packed_type* packed = source.is_local() ? source.local() : recv_data.at(process_id).local();
         for(unsigned int i = 0; i < m_neighbor_data_sizes.at(process_id); i++){
-            m_data_nodes[pair.second[i]].m_data = recv_data.at(process_id).local()[i].m_data;
+            Packer::unpack(packed[i], value(pair.second[i]));
+        }
+        if constexpr(instrument_comms){
+            m_stats.record(process_id, CommPhase::Unpack, CommStats::nowUs() - start_us, m_neighbor_data_sizes.at(process_id)*sizeof(packed_type));
         }
     }
 
@@ -99,3 +1318,2750 @@ template <typename T> void ProcessNode<T>::recvAndUnpack(){
         upcxx::delete_array(pair.second);
     }
 }
+
+//Saves this rank's cells, buffers, maps and decomposition to <path>.<rank> so restore() can resume without
+//rebuilding the decomposition. The file is written next to the old one and renamed over it, so a crash while
+//writing keeps the previous checkpoint. Needs the CSR or Dense layout and a trivially copyable T. The halo
+//cells are saved as they are, so a run resumes at the same point in its step loop. Schedules are not saved.
+template <typename T, typename Packer> bool ProcessNode<T, Packer>::checkpoint(const std::string& path) const {
+    return writeCheckpoint(path, std::vector<int32_t>());
+}
+
+//Collective. Loads a checkpoint written with the same number of ranks and redoes the handshake with the
+//neighbors, and compiles the exchange plan if one was compiled before. Costs O(local cells) per rank plus
+//one round trip. Meant for a node that has not been set up yet. Returns false on every rank if any rank's file
+//is missing or does not match, in which case the ranks that did load their file keep its state.
+template <typename T, typename Packer> bool ProcessNode<T, Packer>::restore(const std::string& path){
+    clearExchangePlan();
+    std::vector<int32_t> geometry;
+    bool ok = readCheckpoint(path, geometry);
+    if(upcxx::reduce_all(ok ? 0 : 1, upcxx::op_fast_add).wait() != 0) return false;
+    rewire(m_exchange_mode, m_plan_compiled);
+    return true;
+}
+
+template <typename T, typename Packer>
+bool ProcessNode<T, Packer>::writeCheckpoint(const std::string& path, const std::vector<int32_t>& geometry) const {
+    static_assert(std::is_trivially_copyable<T>::value, "checkpoints store cells as raw bytes");
+    if(m_layout == CellLayout::Nodes) return false;
+
+    //values are stored as a single run, so gather the buffers
+    std::vector<T> values(m_values);
+    for(const std::vector<T>& buffer : m_other_buffers) values.insert(values.end(), buffer.begin(), buffer.end());
+    std::vector<uint64_t> layer_ends(m_layer_ends.begin(), m_layer_ends.end());
+    std::vector<uint64_t> adj_offsets(m_adj_offsets.begin(), m_adj_offsets.end());
+    std::vector<int64_t> global_ids(m_global_ids.begin(), m_global_ids.end());
+    auto flatten = [](const std::unordered_map<int, std::vector<int>>& map, std::vector<int32_t>& ranks, std::vector<int32_t>& cells){
+        std::map<int, const std::vector<int>*> sorted;
+        for(auto& pair : map) sorted[pair.first] = &pair.second;
+        for(auto& pair : sorted){
+            ranks.push_back(pair.first);
+            ranks.push_back(pair.second->size());
+            cells.insert(cells.end(), pair.second->begin(), pair.second->end());
+        }
+    };
+    std::vector<int32_t> pack_ranks, pack_cells, unpack_ranks, unpack_cells;
+    flatten(m_pack_map, pack_ranks, pack_cells);
+    flatten(m_unpack_map, unpack_ranks, unpack_cells);
+
+    const int num_sections = (int)CheckpointSection::Count;
+    std::pair<const void*, std::pair<size_t, size_t>> sections[num_sections];
+    auto section = [&](CheckpointSection id, const void* data, size_t count, size_t element_bytes){
+        sections[(int)id] = std::make_pair(data, std::make_pair(count, element_bytes));
+    };
+    section(CheckpointSection::Values, values.data(), values.size(), sizeof(T));
+    section(CheckpointSection::GhostFlags, m_ghost_flags.data(), m_ghost_flags.size(), 1);
+    section(CheckpointSection::AdjOffsets, adj_offsets.data(), adj_offsets.size(), sizeof(uint64_t));
+    section(CheckpointSection::AdjIndices, m_adj_indices.data(), m_adj_indices.size(), sizeof(int32_t));
+    section(CheckpointSection::GlobalIds, global_ids.data(), global_ids.size(), sizeof(int64_t));
+    section(CheckpointSection::LayerEnds, layer_ends.data(), layer_ends.size(), sizeof(uint64_t));
+    section(CheckpointSection::PackRanks, pack_ranks.data(), pack_ranks.size(), sizeof(int32_t));
+    section(CheckpointSection::PackCells, pack_cells.data(), pack_cells.size(), sizeof(int32_t));
+    section(CheckpointSection::UnpackRanks, unpack_ranks.data(), unpack_ranks.size(), sizeof(int32_t));
+    section(CheckpointSection::UnpackCells, unpack_cells.data(), unpack_cells.size(), sizeof(int32_t));
+    section(CheckpointSection::Geometry, geometry.data(), geometry.size(), sizeof(int32_t));
+
+    CheckpointHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.m_magic, checkpoint_magic, sizeof(header.m_magic));
+    header.m_version = checkpoint_version;
+    header.m_value_bytes = sizeof(T);
+    header.m_rank = upcxx::rank_me();
+    header.m_num_ranks = upcxx::rank_n();
+    header.m_layout = (int32_t)m_layout;
+    header.m_halo_width = m_halo_width;
+    header.m_exchange_mode = (int32_t)m_exchange_mode;
+    header.m_plan_compiled = m_plan_compiled;
+    header.m_num_cells = m_num_data_nodes;
+    header.m_num_buffers = 1 + m_other_buffers.size();
+    header.m_num_sections = num_sections;
+
+    //sections start 8 byte aligned so the mapped file can be read in place
+    std::vector<uint64_t> table;
+    off_t offset = sizeof(header) + 2*num_sections*sizeof(uint64_t);
+    for(int k = 0; k < num_sections; k++){
+        offset = (offset + 7) & ~(off_t)7;
+        table.push_back(offset);
+        table.push_back(sections[k].second.first);
+        offset += sections[k].second.first*sections[k].second.second;
+    }
+
+    std::string file_path = path + "." + std::to_string(upcxx::rank_me());
+    std::string temp_path = file_path + ".tmp";
+    int fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) return false;
+    bool ok = writeFully(fd, &header, sizeof(header), 0) &&
+              writeFully(fd, table.data(), table.size()*sizeof(uint64_t), sizeof(header));
+    for(int k = 0; k < num_sections && ok; k++){
+        ok = writeFully(fd, sections[k].first, sections[k].second.first*sections[k].second.second, table[2*k]);
+    }
+    ok = ::fsync(fd) == 0 && ok;
+    ok = ::close(fd) == 0 && ok;
+    return ok && ::rename(temp_path.c_str(), file_path.c_str()) == 0;
+}
+
+//Maps <path>.<rank> and copies its sections into this node, local work only. Leaves the node untouched and
+//returns false if the file is unreadable or does not belong to this rank and run.
+template <typename T, typename Packer>
+bool ProcessNode<T, Packer>::readCheckpoint(const std::string& path, std::vector<int32_t>& geometry){
+    std::string file_path = path + "." + std::to_string(upcxx::rank_me());
+    int fd = ::open(file_path.c_str(), O_RDONLY);
+    if(fd < 0) return false;
+    struct stat file_stat;
+    size_t file_bytes = ::fstat(fd, &file_stat) == 0 ? file_stat.st_size : 0;
+    void* mapped = file_bytes >= sizeof(CheckpointHeader) ? ::mmap(NULL, file_bytes, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    ::close(fd);
+    if(mapped == MAP_FAILED) return false;
+    const char* file = (const char*)mapped;
+
+    CheckpointHeader header;
+    std::memcpy(&header, file, sizeof(header));
+    bool ok = std::memcmp(header.m_magic, checkpoint_magic, sizeof(header.m_magic)) == 0 &&
+              header.m_version <= checkpoint_version && header.m_value_bytes == sizeof(T) &&
+              header.m_rank == upcxx::rank_me() && header.m_num_ranks == upcxx::rank_n() &&
+              header.m_layout != (int32_t)CellLayout::Nodes && header.m_num_buffers > 0 &&
+              sizeof(header) + 2*header.m_num_sections*sizeof(uint64_t) <= file_bytes;
+    const uint64_t* table = (const uint64_t*)(file + sizeof(header));
+    //a section this file has, or an empty one, checked against the file size
+    auto section = [&](CheckpointSection id, size_t element_bytes, size_t& count) -> const char* {
+        count = 0;
+        if(!ok || (uint64_t)id >= header.m_num_sections) return NULL;
+        uint64_t begin = table[2*(int)id];
+        count = table[2*(int)id + 1];
+        if(begin > file_bytes || count > (file_bytes - begin) / element_bytes){
+            ok = false;
+            count = 0;
+            return NULL;
+        }
+        return file + begin;
+    };
+    auto read = [&](CheckpointSection id, auto& out){
+        typedef typename std::decay<decltype(out[0])>::type value_type;
+        size_t count;
+        const char* data = section(id, sizeof(value_type), count);
+        out.resize(count);
+        if(count > 0) std::memcpy(out.data(), data, count*sizeof(value_type));
+    };
+
+    std::vector<T> values;
+    std::vector<unsigned char> ghost_flags;
+    std::vector<uint64_t> adj_offsets, layer_ends;
+    std::vector<int32_t> adj_indices, pack_ranks, pack_cells, unpack_ranks, unpack_cells;
+    std::vector<int64_t> global_ids;
+    read(CheckpointSection::Values, values);
+    read(CheckpointSection::GhostFlags, ghost_flags);
+    read(CheckpointSection::AdjOffsets, adj_offsets);
+    read(CheckpointSection::AdjIndices, adj_indices);
+    read(CheckpointSection::GlobalIds, global_ids);
+    read(CheckpointSection::LayerEnds, layer_ends);
+    read(CheckpointSection::PackRanks, pack_ranks);
+    read(CheckpointSection::PackCells, pack_cells);
+    read(CheckpointSection::UnpackRanks, unpack_ranks);
+    read(CheckpointSection::UnpackCells, unpack_cells);
+    read(CheckpointSection::Geometry, geometry);
+    ::munmap(mapped, file_bytes);
+    ok = ok && values.size() == header.m_num_cells*header.m_num_buffers;
+    if(!ok) return false;
+
+    auto unflatten = [](const std::vector<int32_t>& ranks, const std::vector<int32_t>& cells,
+                        std::unordered_map<int, std::vector<int>>& map){
+        map.clear();
+        size_t begin = 0;
+        for(size_t k = 0; k + 1 < ranks.size() && begin + ranks[k+1] <= cells.size(); k += 2){
+            map[ranks[k]].assign(cells.begin() + begin, cells.begin() + begin + ranks[k+1]);
+            begin += ranks[k+1];
+        }
+    };
+    m_layout = (CellLayout)header.m_layout;
+    m_halo_width = header.m_halo_width;
+    m_exchange_mode = (ExchangeMode)header.m_exchange_mode;
+    m_plan_compiled = header.m_plan_compiled != 0;
+    m_num_data_nodes = header.m_num_cells;
+    m_values.assign(values.begin(), values.begin() + m_num_data_nodes);
+    m_other_buffers.assign(header.m_num_buffers - 1, std::vector<T>());
+    for(size_t b = 1; b < header.m_num_buffers; b++){
+        m_other_buffers[b - 1].assign(values.begin() + b*m_num_data_nodes, values.begin() + (b + 1)*m_num_data_nodes);
+    }
+    m_ghost_flags.swap(ghost_flags);
+    m_adj_offsets.assign(adj_offsets.begin(), adj_offsets.end());
+    m_adj_indices.swap(adj_indices);
+    m_global_ids.assign(global_ids.begin(), global_ids.end());
+    m_global_to_local.clear();
+    for(size_t i = 0; i < m_global_ids.size(); i++) m_global_to_local[m_global_ids[i]] = i;
+    m_layer_ends.assign(layer_ends.begin(), layer_ends.end());
+    unflatten(pack_ranks, pack_cells, m_pack_map);
+    unflatten(unpack_ranks, unpack_cells, m_unpack_map);
+    return true;
+}
+
+//Collective. Sets up the packed buffers and the handshake for the current maps, as the decomposition builders do.
+template <typename T, typename Packer> void ProcessNode<T, Packer>::rewire(ExchangeMode mode, bool compile_plan){
+    m_plan_compiled = false;
+    allocatePackedData();
+    bcastGPTRs();
+    upcxx::barrier();
+    classifyCells();
+    if(compile_plan) compileExchangePlan(mode);
+}
+
+//Unit that FieldGroup messages are laid out in, so every field's block starts suitably aligned.
+struct alignas(16) FieldWord {
+    unsigned char m_bytes[16];
+};
+
+//Exchanges the halos of several fields, possibly of different T and Packer, that share one decomposition, with
+//one push-mode message per neighbor instead of one per field. The first field added supplies the pack/unpack
+//maps, the others only need the same local cell numbering and cell count, e.g. built by the same
+//LatticeDecomposition or given copies of the first field's maps, and need no handshake or plan of their own.
+//As with ExchangePhase, the unpack list for a rank must be as long as its pack list for us.
+//A neighbor's message holds one block per field in the exchange's mask, in field order, and the mask travels
+//with the arrival so the receiver knows which blocks came.
+class FieldGroup {
+    public:
+    static constexpr int max_fields = 64;
+    static constexpr unsigned long long all_fields = ~0ull;
+
+    template <typename T, typename Packer> int addField(ProcessNode<T, Packer>& node);
+    bool compile();
+    void clear();
+    void packData(unsigned long long mask = all_fields);
+    upcxx::future<> beginExchange();
+    void finishExchange();
+    void recvAndUnpack();
+
+    private:
+    struct Field {
+        void* m_node;
+        const size_t* m_num_cells;
+        const std::unordered_map<int, std::vector<int>>* m_pack_map;
+        const std::unordered_map<int, std::vector<int>>* m_unpack_map;
+        size_t m_packed_size;
+        void (*m_pack)(void* node, const int* cells, size_t count, unsigned char* out);
+        void (*m_unpack)(void* node, const int* cells, size_t count, const unsigned char* in);
+    };
+    template <typename T, typename Packer> static void packField(void* node, const int* cells, size_t count, unsigned char* out);
+    template <typename T, typename Packer> static void unpackField(void* node, const int* cells, size_t count, const unsigned char* in);
+    size_t blockWords(int field, size_t count) const;
+    size_t messageWords(unsigned long long mask, size_t count) const;
+    void armArrivals(int slot);
+    void markArrival(int slot, int source_rank, unsigned long long mask);
+
+    public:
+    std::vector<Field> m_fields;
+    //the maps of the first field, flattened in rank order like ExchangePlan
+    std::vector<int> m_send_ranks;
+    std::vector<size_t> m_send_offsets;
+    std::vector<int> m_send_indices;
+    std::vector<int> m_recv_ranks;
+    std::vector<size_t> m_recv_offsets;
+    std::vector<int> m_recv_indices;
+
+    //every neighbor's region holds two slots of all fields, see ExchangePlan::m_recv_slot_size
+    std::vector<size_t> m_recv_word_offsets;
+    size_t m_recv_slot_words = 0;
+    upcxx::global_ptr<FieldWord> m_recv_buffer;
+    std::vector<size_t> m_send_word_offsets;
+    std::vector<FieldWord> m_send_storage;
+    std::vector<upcxx::global_ptr<FieldWord>> m_send_targets;
+    std::vector<size_t> m_send_slot_strides;
+    std::vector<FieldWord*> m_send_locals;
+
+    unsigned long long m_mask = all_fields;
+    std::vector<unsigned long long> m_recv_masks[2];
+    std::unique_ptr<upcxx::promise<>> m_arrivals[2];
+    upcxx::future<> m_arrived[2];
+    std::unique_ptr<upcxx::promise<>> m_send_promise;
+    upcxx::future<> m_pending_exchange;
+    unsigned long m_exchange_count = 0;
+    bool m_compiled = false;
+
+    //Transfer and Wait counters when UNICUBE_INSTRUMENT is defined, packing and unpacking are not split by field
+    CommStats m_stats;
+
+    std::unique_ptr<upcxx::dist_object<FieldGroup*>> m_dist_self;
+};
+
+//Returns the field's bit in the exchange masks, or -1 when the group is full. Fields must be added in the same
+//order on every rank and before compile().
+template <typename T, typename Packer> int FieldGroup::addField(ProcessNode<T, Packer>& node){
+    if((int)m_fields.size() == max_fields) return -1;
+    Field field = {&node, &node.m_num_data_nodes, &node.m_pack_map, &node.m_unpack_map, sizeof(typename Packer::packed_type),
+                   &FieldGroup::packField<T, Packer>, &FieldGroup::unpackField<T, Packer>};
+    m_fields.push_back(field);
+    return m_fields.size() - 1;
+}
+
+template <typename T, typename Packer>
+void FieldGroup::packField(void* node, const int* cells, size_t count, unsigned char* out){
+    ProcessNode<T, Packer>& proc_node = *static_cast<ProcessNode<T, Packer>*>(node);
+    typename Packer::packed_type* packed = reinterpret_cast<typename Packer::packed_type*>(out);
+    for(size_t i = 0; i < count; i++) Packer::pack(proc_node.value(cells[i]), packed[i]);
+}
+
+template <typename T, typename Packer>
+void FieldGroup::unpackField(void* node, const int* cells, size_t count, const unsigned char* in){
+    ProcessNode<T, Packer>& proc_node = *static_cast<ProcessNode<T, Packer>*>(node);
+    const typename Packer::packed_type* packed = reinterpret_cast<const typename Packer::packed_type*>(in);
+    for(size_t i = 0; i < count; i++) Packer::unpack(packed[i], proc_node.value(cells[i]));
+}
+
+inline size_t FieldGroup::blockWords(int field, size_t count) const {
+    return (count*m_fields[field].m_packed_size + sizeof(FieldWord) - 1) / sizeof(FieldWord);
+}
+
+inline size_t FieldGroup::messageWords(unsigned long long mask, size_t count) const {
+    size_t words = 0;
+    for(int k = 0; k < (int)m_fields.size(); k++){
+        if(mask >> k & 1) words += blockWords(k, count);
+    }
+    return words;
+}
+
+//Collective, like ProcessNode::compileExchangePlan() in push mode. Returns false on every rank, without setting
+//anything up, if any rank's fields differ in their number of cells.
+inline bool FieldGroup::compile(){
+    clear();
+    bool ok = !m_fields.empty();
+    for(const Field& field : m_fields) ok = ok && *field.m_num_cells == *m_fields[0].m_num_cells;
+    if(upcxx::reduce_all(ok ? 0 : 1, upcxx::op_fast_add).wait() != 0) return false;
+    if(!m_dist_self) m_dist_self.reset(new upcxx::dist_object<FieldGroup*>(this));
+
+    const std::unordered_map<int, std::vector<int>>& pack_map = *m_fields[0].m_pack_map;
+    const std::unordered_map<int, std::vector<int>>& unpack_map = *m_fields[0].m_unpack_map;
+    for(auto& pair : pack_map) m_send_ranks.push_back(pair.first);
+    std::sort(m_send_ranks.begin(), m_send_ranks.end());
+    m_send_offsets.push_back(0);
+    m_send_word_offsets.push_back(0);
+    for(int process_id : m_send_ranks){
+        const std::vector<int>& locations = pack_map.at(process_id);
+        m_send_indices.insert(m_send_indices.end(), locations.begin(), locations.end());
+        m_send_offsets.push_back(m_send_indices.size());
+        m_send_word_offsets.push_back(m_send_word_offsets.back() + messageWords(all_fields, locations.size()));
+    }
+    m_send_storage.resize(m_send_word_offsets.back());
+
+    for(auto& pair : unpack_map) m_recv_ranks.push_back(pair.first);
+    std::sort(m_recv_ranks.begin(), m_recv_ranks.end());
+    m_recv_offsets.push_back(0);
+    m_recv_word_offsets.push_back(0);
+    for(int process_id : m_recv_ranks){
+        const std::vector<int>& locations = unpack_map.at(process_id);
+        m_recv_indices.insert(m_recv_indices.end(), locations.begin(), locations.end());
+        m_recv_offsets.push_back(m_recv_indices.size());
+        m_recv_word_offsets.push_back(m_recv_word_offsets.back() + messageWords(all_fields, locations.size()));
+    }
+    m_recv_slot_words = m_recv_word_offsets.back();
+    if(m_recv_slot_words > 0) m_recv_buffer = upcxx::new_array<FieldWord>(2*m_recv_slot_words);
+
+    //armed before the barrier below since a neighbor may push as soon as it leaves it
+    armArrivals(0);
+    armArrivals(1);
+    m_send_targets.resize(m_send_ranks.size());
+    m_send_slot_strides.resize(m_send_ranks.size());
+    upcxx::barrier();
+
+    upcxx::future<> all_sent = upcxx::make_future();
+    for(size_t n = 0; n < m_recv_ranks.size(); n++){
+        upcxx::future<> f = upcxx::rpc(m_recv_ranks[n],
+                    [](upcxx::dist_object<FieldGroup*>& self, int dest_rank, upcxx::global_ptr<FieldWord> target,
+                       size_t slot_stride){
+                FieldGroup& group = **self;
+                size_t s = std::lower_bound(group.m_send_ranks.begin(), group.m_send_ranks.end(), dest_rank) -
+                           group.m_send_ranks.begin();
+                group.m_send_targets[s] = target;
+                group.m_send_slot_strides[s] = slot_stride;
+            }, *m_dist_self, upcxx::rank_me(), m_recv_buffer + m_recv_word_offsets[n], m_recv_slot_words);
+        all_sent = upcxx::when_all(all_sent, f);
+    }
+    all_sent.wait();
+    upcxx::barrier();
+
+    for(upcxx::global_ptr<FieldWord> target : m_send_targets){
+        m_send_locals.push_back(target.is_local() ? target.local() : NULL);
+    }
+    m_compiled = true;
+    return true;
+}
+
+//Collective, as neighbors may still be writing into our receive buffer.
+inline void FieldGroup::clear(){
+    if(m_compiled) upcxx::barrier();
+    if(m_recv_buffer) upcxx::delete_array(m_recv_buffer);
+    m_recv_buffer = upcxx::global_ptr<FieldWord>();
+    m_send_ranks.clear();
+    m_send_offsets.clear();
+    m_send_indices.clear();
+    m_recv_ranks.clear();
+    m_recv_offsets.clear();
+    m_recv_indices.clear();
+    m_recv_word_offsets.clear();
+    m_recv_slot_words = 0;
+    m_send_word_offsets.clear();
+    m_send_storage.clear();
+    m_send_targets.clear();
+    m_send_slot_strides.clear();
+    m_send_locals.clear();
+    m_exchange_count = 0;
+    m_compiled = false;
+}
+
+inline void FieldGroup::armArrivals(int slot){
+    m_arrivals[slot].reset(new upcxx::promise<>());
+    m_arrivals[slot]->require_anonymous(m_recv_ranks.size());
+    m_arrived[slot] = m_arrivals[slot]->finalize();
+    m_recv_masks[slot].assign(m_recv_ranks.size(), 0);
+}
+
+inline void FieldGroup::markArrival(int slot, int source_rank, unsigned long long mask){
+    size_t n = std::lower_bound(m_recv_ranks.begin(), m_recv_ranks.end(), source_rank) - m_recv_ranks.begin();
+    m_recv_masks[slot][n] = mask;
+    m_arrivals[slot]->fulfill_anonymous(1);
+}
+
+//Packs the fields in mask for every neighbor, one neighbor's list of cells at a time so that it is read from
+//memory once for all of them. Neighbors on our node are packed straight into their receive buffer.
+inline void FieldGroup::packData(unsigned long long mask){
+    m_mask = mask;
+    int slot = m_exchange_count % 2;
+    for(size_t n = 0; n < m_send_ranks.size(); n++){
+        FieldWord* out = m_send_locals[n] ? m_send_locals[n] + slot*m_send_slot_strides[n] :
+                                            m_send_storage.data() + m_send_word_offsets[n];
+        const int* cells = m_send_indices.data() + m_send_offsets[n];
+        size_t count = m_send_offsets[n+1] - m_send_offsets[n];
+        for(int k = 0; k < (int)m_fields.size(); k++){
+            if(!(mask >> k & 1)) continue;
+            m_fields[k].m_pack(m_fields[k].m_node, cells, count, out->m_bytes);
+            out += blockWords(k, count);
+        }
+    }
+}
+
+//Sends what packData() staged, one put per neighbor covering only the fields in its mask.
+inline upcxx::future<> FieldGroup::beginExchange(){
+    int slot = m_exchange_count % 2;
+    m_send_promise.reset(new upcxx::promise<>());
+    auto arrival = [](upcxx::dist_object<FieldGroup*>& self, int slot, int source_rank, unsigned long long mask){
+        (*self)->markArrival(slot, source_rank, mask);
+    };
+    for(size_t n = 0; n < m_send_ranks.size(); n++){
+        if(m_send_locals[n]){
+            std::atomic_thread_fence(std::memory_order_release);
+            upcxx::rpc_ff(m_send_ranks[n], arrival, *m_dist_self, slot, upcxx::rank_me(), m_mask);
+            continue;
+        }
+        size_t words = messageWords(m_mask, m_send_offsets[n+1] - m_send_offsets[n]);
+        auto completions = upcxx::remote_cx::as_rpc(arrival, *m_dist_self, slot, upcxx::rank_me(), m_mask) |
+                           upcxx::operation_cx::as_promise(*m_send_promise);
+        const FieldWord* source = m_send_storage.data() + m_send_word_offsets[n];
+        upcxx::global_ptr<FieldWord> target = m_send_targets[n] + slot*m_send_slot_strides[n];
+        if constexpr(instrument_comms){
+            int rank = m_send_ranks[n];
+            double start_us = CommStats::nowUs();
+            upcxx::rput(source, target, words, completions | upcxx::operation_cx::as_future()).then(
+                [this, rank, start_us, words](){
+                    m_stats.record(rank, CommPhase::Transfer, CommStats::nowUs() - start_us, words*sizeof(FieldWord));
+                });
+        } else {
+            upcxx::rput(source, target, words, completions);
+        }
+    }
+    m_pending_exchange = upcxx::when_all(m_arrived[slot], m_send_promise->finalize());
+    return m_pending_exchange;
+}
+
+//Waits for the exchange and unpacks the fields each neighbor sent.
+inline void FieldGroup::finishExchange(){
+    int slot = m_exchange_count % 2;
+    double start_us = instrument_comms ? CommStats::nowUs() : 0.0;
+    m_pending_exchange.wait();
+    if constexpr(instrument_comms) m_stats.record(-1, CommPhase::Wait, CommStats::nowUs() - start_us);
+    const FieldWord* recv_buffer = m_recv_buffer.local() + slot*m_recv_slot_words;
+    for(size_t n = 0; n < m_recv_ranks.size(); n++){
+        const FieldWord* in = recv_buffer + m_recv_word_offsets[n];
+        const int* cells = m_recv_indices.data() + m_recv_offsets[n];
+        size_t count = m_recv_offsets[n+1] - m_recv_offsets[n];
+        for(int k = 0; k < (int)m_fields.size(); k++){
+            if(!(m_recv_masks[slot][n] >> k & 1)) continue;
+            m_fields[k].m_unpack(m_fields[k].m_node, cells, count, in->m_bytes);
+            in += blockWords(k, count);
+        }
+    }
+    //a neighbor can only reuse this slot after receiving our next exchange, which happens after this
+    armArrivals(slot);
+    m_exchange_count++;
+}
+
+inline void FieldGroup::recvAndUnpack(){
+    beginExchange();
+    finishExchange();
+}
+
+//Range over the particles of one cell of a ParticleLayer, for(P& particle : layer.cell(i)).
+template <typename P> struct ParticleRange {
+    P* m_begin;
+    P* m_end;
+
+    P* begin() const { return m_begin; }
+    P* end() const { return m_end; }
+    size_t size() const { return m_end - m_begin; }
+};
+
+//Particles or agents that live in the owned cells of a decomposed ProcessNode (or LatticeProcessNode) and move
+//between cells, any number per cell. They are kept in one arena sorted by cell, so a cell's particles are
+//contiguous and cell(i) is a pointer range. After a step moveTo() names each particle's new cell, which may be
+//any local cell including a ghost, and the collective migrate() sends the particles that landed in ghosts to the
+//ranks owning those cells, one RPC per neighbor carrying all of its emigrants, then re-sorts the arena.
+//Particles travel as their position in the neighbor's unpack list, so the node needs no global ids, and a
+//particle may move at most as far as the halo reaches per migrate(). P must be Serializable for UPC++, which
+//trivially copyable types are, and types with heap members such as std::vector can declare
+//UPCXX_SERIALIZED_FIELDS, so particles need not have a fixed size.
+template <typename P> class ParticleLayer {
+    public:
+    template <typename Node> void attach(Node& node);
+    void add(int cell, const P& particle);
+    ParticleRange<P> cell(int i);
+    size_t numParticles() const;
+    void moveTo(size_t k, int cell);
+    void remove(size_t k);
+    size_t migrate();
+
+    private:
+    void receive(int slot, int source_rank, const upcxx::view<uint32_t>& positions, const upcxx::view<P>& particles);
+    void armArrivals(int slot);
+
+    public:
+    //all particles sorted by cell, cell i's are m_particles[m_cell_offsets[i] .. m_cell_offsets[i+1]). Particles
+    //added since the last migrate() follow the sorted ones. m_destinations[k] is where particle k goes at the
+    //next migrate(), its current cell unless moveTo() or remove() changed it.
+    std::vector<P> m_particles;
+    std::vector<size_t> m_cell_offsets;
+    std::vector<int32_t> m_destinations;
+
+    //for each local cell the index of the neighbor owning it in m_send_ranks and its position in that neighbor's
+    //unpack list, -1 for owned cells and -2 for ghosts nobody fills
+    std::vector<int32_t> m_ghost_neighbors;
+    std::vector<uint32_t> m_ghost_positions;
+    std::vector<int> m_send_ranks;
+    //ranks we own ghosts of, with the cells we pack for them flattened in rank order
+    std::vector<int> m_recv_ranks;
+    std::vector<size_t> m_recv_offsets;
+    std::vector<int> m_recv_cells;
+
+    //emigrants per neighbor, and immigrants staged per slot since a neighbor one migrate() ahead may send early
+    std::vector<std::vector<uint32_t>> m_out_positions;
+    std::vector<std::vector<P>> m_out_particles;
+    std::vector<int32_t> m_in_cells[2];
+    std::vector<P> m_in_particles[2];
+    std::unique_ptr<upcxx::promise<>> m_arrivals[2];
+    upcxx::future<> m_arrived[2];
+    unsigned long m_migration_count = 0;
+
+    //scratch for re-sorting the arena
+    std::vector<P> m_sorted;
+    std::vector<size_t> m_counts;
+
+    std::unique_ptr<upcxx::dist_object<ParticleLayer*>> m_dist_self;
+};
+
+//Collective. Takes the cells, ghosts and pack/unpack maps of a node that has been decomposed, and starts with no
+//particles. Must be called again when the node's maps change, which drops the particles.
+template <typename P> template <typename Node> void ParticleLayer<P>::attach(Node& node){
+    size_t num_cells = node.m_num_data_nodes;
+    m_particles.clear();
+    m_destinations.clear();
+    m_cell_offsets.assign(num_cells + 1, 0);
+    m_ghost_neighbors.assign(num_cells, -1);
+    m_ghost_positions.assign(num_cells, 0);
+    for(size_t i = 0; i < num_cells; i++){
+        if(node.isGhost(i)) m_ghost_neighbors[i] = -2;
+    }
+
+    m_send_ranks.clear();
+    for(auto& pair : node.m_unpack_map) m_send_ranks.push_back(pair.first);
+    std::sort(m_send_ranks.begin(), m_send_ranks.end());
+    for(size_t n = 0; n < m_send_ranks.size(); n++){
+        const std::vector<int>& locations = node.m_unpack_map.at(m_send_ranks[n]);
+        for(size_t j = 0; j < locations.size(); j++){
+            if(!node.isGhost(locations[j])) continue;
+            m_ghost_neighbors[locations[j]] = n;
+            m_ghost_positions[locations[j]] = j;
+        }
+    }
+    m_recv_ranks.clear();
+    for(auto& pair : node.m_pack_map) m_recv_ranks.push_back(pair.first);
+    std::sort(m_recv_ranks.begin(), m_recv_ranks.end());
+    m_recv_offsets.assign(1, 0);
+    m_recv_cells.clear();
+    for(int process_id : m_recv_ranks){
+        const std::vector<int>& locations = node.m_pack_map.at(process_id);
+        m_recv_cells.insert(m_recv_cells.end(), locations.begin(), locations.end());
+        m_recv_offsets.push_back(m_recv_cells.size());
+    }
+    m_out_positions.assign(m_send_ranks.size(), std::vector<uint32_t>());
+    m_out_particles.assign(m_send_ranks.size(), std::vector<P>());
+    m_migration_count = 0;
+
+    //armed before the barrier since a neighbor may migrate as soon as it leaves it
+    if(!m_dist_self) m_dist_self.reset(new upcxx::dist_object<ParticleLayer*>(this));
+    armArrivals(0);
+    armArrivals(1);
+    upcxx::barrier();
+}
+
+//The particle joins the arena at the next migrate(), cell must be owned or a ghost that someone fills.
+template <typename P> void ParticleLayer<P>::add(int cell, const P& particle){
+    m_particles.push_back(particle);
+    m_destinations.push_back(cell);
+}
+
+template <typename P> inline ParticleRange<P> ParticleLayer<P>::cell(int i){
+    ParticleRange<P> range = {m_particles.data() + m_cell_offsets[i], m_particles.data() + m_cell_offsets[i+1]};
+    return range;
+}
+
+template <typename P> inline size_t ParticleLayer<P>::numParticles() const {
+    return m_particles.size();
+}
+
+//k indexes m_particles, so the particles of cell(i) are m_cell_offsets[i] onwards.
+template <typename P> inline void ParticleLayer<P>::moveTo(size_t k, int cell){
+    m_destinations[k] = cell;
+}
+
+template <typename P> inline void ParticleLayer<P>::remove(size_t k){
+    m_destinations[k] = -1;
+}
+
+template <typename P> void ParticleLayer<P>::armArrivals(int slot){
+    m_arrivals[slot].reset(new upcxx::promise<>());
+    m_arrivals[slot]->require_anonymous(m_recv_ranks.size());
+    m_arrived[slot] = m_arrivals[slot]->finalize();
+}
+
+//Called by a neighbor's migrate() RPC, which may carry no particles at all.
+template <typename P>
+void ParticleLayer<P>::receive(int slot, int source_rank, const upcxx::view<uint32_t>& positions, const upcxx::view<P>& particles){
+    size_t n = std::lower_bound(m_recv_ranks.begin(), m_recv_ranks.end(), source_rank) - m_recv_ranks.begin();
+    size_t num_cells = m_recv_offsets[n+1] - m_recv_offsets[n];
+    //views of non-trivial types deserialize as they are iterated, so both are walked with iterators
+    auto particle = particles.begin();
+    for(uint32_t position : positions){
+        //positions past our pack list would name ghosts the sender fills from elsewhere and should not happen
+        m_in_cells[slot].push_back(position < num_cells ? m_recv_cells[m_recv_offsets[n] + position] : -1);
+        m_in_particles[slot].push_back(*particle);
+        ++particle;
+    }
+    m_arrivals[slot]->fulfill_anonymous(1);
+}
+
+//Collective. Sends every particle whose destination is a ghost to that ghost's owner, receives the neighbors'
+//emigrants and sorts the arena by cell again, which renumbers the particles. Returns how many particles left
+//this rank. Particles moved to ghosts that no neighbor fills are dropped, as are removed ones.
+template <typename P> size_t ParticleLayer<P>::migrate(){
+    int slot = m_migration_count % 2;
+    size_t num_cells = m_cell_offsets.size() - 1;
+    m_counts.assign(num_cells + 1, 0);
+    size_t num_emigrants = 0;
+    for(size_t k = 0; k < m_particles.size(); k++){
+        int32_t destination = m_destinations[k];
+        if(destination < 0) continue;
+        int32_t n = m_ghost_neighbors[destination];
+        if(n == -2){
+            m_destinations[k] = -1;
+        } else if(n >= 0){
+            m_out_positions[n].push_back(m_ghost_positions[destination]);
+            m_out_particles[n].push_back(std::move(m_particles[k]));
+            m_destinations[k] = -1;
+            num_emigrants++;
+        } else {
+            m_counts[destination]++;
+        }
+    }
+
+    //every neighbor hears from us, since that is how it knows we are done, and views are serialized before
+    //rpc_ff() returns so the outboxes can be cleared right away
+    for(size_t n = 0; n < m_send_ranks.size(); n++){
+        upcxx::rpc_ff(m_send_ranks[n],
+                      [](upcxx::dist_object<ParticleLayer*>& self, int slot, int source_rank,
+                         const upcxx::view<uint32_t>& positions, const upcxx::view<P>& particles){
+                (*self)->receive(slot, source_rank, positions, particles);
+            }, *m_dist_self, slot, upcxx::rank_me(),
+            upcxx::make_view(m_out_positions[n].begin(), m_out_positions[n].end()),
+            upcxx::make_view(m_out_particles[n].begin(), m_out_particles[n].end()));
+        m_out_positions[n].clear();
+        m_out_particles[n].clear();
+    }
+    m_arrived[slot].wait();
+
+    std::vector<int32_t>& in_cells = m_in_cells[slot];
+    for(int32_t cell : in_cells){
+        if(cell >= 0) m_counts[cell]++;
+    }
+    //counting sort into m_sorted, m_counts becomes each cell's next free place
+    size_t total = 0;
+    for(size_t i = 0; i < num_cells; i++){
+        m_cell_offsets[i] = total;
+        total += m_counts[i];
+        m_counts[i] = m_cell_offsets[i];
+    }
+    m_cell_offsets[num_cells] = total;
+    m_sorted.resize(total);
+    for(size_t k = 0; k < m_particles.size(); k++){
+        if(m_destinations[k] >= 0) m_sorted[m_counts[m_destinations[k]]++] = std::move(m_particles[k]);
+    }
+    for(size_t e = 0; e < in_cells.size(); e++){
+        if(in_cells[e] >= 0) m_sorted[m_counts[in_cells[e]]++] = std::move(m_in_particles[slot][e]);
+    }
+    std::swap(m_particles, m_sorted);
+    m_destinations.resize(total);
+    for(size_t i = 0; i < num_cells; i++){
+        std::fill(m_destinations.begin() + m_cell_offsets[i], m_destinations.begin() + m_cell_offsets[i+1], (int32_t)i);
+    }
+    in_cells.clear();
+    m_in_particles[slot].clear();
+    //a neighbor can only send to this slot again after our next migrate() has sent to it
+    armArrivals(slot);
+    m_migration_count++;
+    return num_emigrants;
+}
+
+//The default order of cells for wireProcessNode(), by global id.
+struct GlobalIdKey {
+    unsigned long long operator()(long long id) const { return id; }
+};
+
+//Builds the local cells, ghost layers, connectivity and pack/unpack maps of proc_node from the cells this rank
+//owns, as DataNodes or as CSR adjacency depending on proc_node.m_layout. neighbors(global_id, out) appends
+//the global ids adjacent to a cell and owner(global_id) returns the rank that owns it, both only have to
+//answer for cells within reach of this rank so the cost is proportional to the local subdomain. Owned cells
+//come first in the given order, followed by the ghosts of each layer up to proc_node.m_halo_width in turn,
+//grouped by owner and ordered by key(global_id), see m_layer_ends. Both sides of every exchange list their
+//cells in ascending key, which keeps pack and unpack orders in agreement without any communication, so key
+//must be the same function on every rank. Passing owned cells sorted by key makes packing and unpacking
+//sweep memory in order. Collective, since it ends with bcastGPTRs().
+
+template <typename T, typename Packer, typename NeighborFn, typename OwnerFn, typename KeyFn = GlobalIdKey>
+void wireProcessNode(ProcessNode<T, Packer>& proc_node, const std::vector<long long>& owned_cells,
+                     NeighborFn neighbors, OwnerFn owner, KeyFn key = KeyFn()){
+    size_t num_owned = owned_cells.size();
+    int halo_width = std::max(1, proc_node.m_halo_width);
+    std::unordered_map<long long, int>& global_to_local = proc_node.m_global_to_local;
+    global_to_local.clear();
+    global_to_local.reserve(2*num_owned);
+    for(size_t i = 0; i < num_owned; i++) global_to_local[owned_cells[i]] = i;
+
+    //collect the owned cells' edges, then grow the halo one layer of ghosts at a time
+    std::vector<size_t> edge_offsets(1, 0);
+    std::vector<long long> edges;
+    std::vector<std::tuple<int, int, unsigned long long, long long>> ghosts;
+    std::unordered_set<long long> seen_ghosts;
+    std::vector<long long> cell_neighbors;
+    for(size_t i = 0; i < num_owned; i++){
+        cell_neighbors.clear();
+        neighbors(owned_cells[i], cell_neighbors);
+        for(long long nbr : cell_neighbors){
+            edges.push_back(nbr);
+            if(global_to_local.count(nbr) == 0 && seen_ghosts.insert(nbr).second){
+                ghosts.push_back(std::make_tuple(1, owner(nbr), key(nbr), nbr));
+            }
+        }
+        edge_offsets.push_back(edges.size());
+    }
+    size_t layer_begin = 0;
+    for(int layer = 2; layer <= halo_width; layer++){
+        size_t layer_end = ghosts.size();
+        for(size_t k = layer_begin; k < layer_end; k++){
+            cell_neighbors.clear();
+            neighbors(std::get<3>(ghosts[k]), cell_neighbors);
+            for(long long nbr : cell_neighbors){
+                if(global_to_local.count(nbr) == 0 && seen_ghosts.insert(nbr).second){
+                    ghosts.push_back(std::make_tuple(layer, owner(nbr), key(nbr), nbr));
+                }
+            }
+        }
+        layer_begin = layer_end;
+    }
+    std::sort(ghosts.begin(), ghosts.end());
+
+    size_t num_local_cells = num_owned + ghosts.size();
+    proc_node.m_global_ids.assign(owned_cells.begin(), owned_cells.end());
+    proc_node.m_layer_ends.assign(halo_width + 1, num_owned);
+    std::vector<int> ghost_owner(num_local_cells, upcxx::rank_me());
+    for(size_t k = 0; k < ghosts.size(); k++){
+        global_to_local[std::get<3>(ghosts[k])] = num_owned + k;
+        proc_node.m_global_ids.push_back(std::get<3>(ghosts[k]));
+        ghost_owner[num_owned + k] = std::get<1>(ghosts[k]);
+        for(int layer = std::get<0>(ghosts[k]); layer <= halo_width; layer++) proc_node.m_layer_ends[layer]++;
+    }
+
+    //ghosts are linked to whichever of their neighbors are local, which is all of them below the last layer
+    for(size_t k = 0; k < ghosts.size(); k++){
+        cell_neighbors.clear();
+        neighbors(std::get<3>(ghosts[k]), cell_neighbors);
+        for(long long nbr : cell_neighbors){
+            if(global_to_local.count(nbr) > 0) edges.push_back(nbr);
+        }
+        edge_offsets.push_back(edges.size());
+    }
+    std::vector<int32_t> local_edges(edges.size());
+    for(size_t e = 0; e < edges.size(); e++) local_edges[e] = global_to_local.at(edges[e]);
+
+    proc_node.m_num_data_nodes = num_local_cells;
+    if(proc_node.m_layout == CellLayout::CSR){
+        proc_node.m_adj_offsets.assign(edge_offsets.begin(), edge_offsets.end());
+        proc_node.m_adj_indices.swap(local_edges);
+        proc_node.m_values.assign(num_local_cells, T());
+        proc_node.m_ghost_flags.assign(num_local_cells, 0);
+        for(size_t i = num_owned; i < num_local_cells; i++) proc_node.m_ghost_flags[i] = 1;
+    } else {
+        proc_node.m_data_nodes = new DataNode<T>[num_local_cells];
+        for(size_t i = 0; i < num_local_cells; i++){
+            DataNode<T>& dn = proc_node.m_data_nodes[i];
+            dn.m_ghost = i >= num_owned;
+            dn.m_data = T();
+            dn.m_num_neighbors = edge_offsets[i+1] - edge_offsets[i];
+            dn.m_neighbors = new DataNode<T>*[dn.m_num_neighbors];
+            for(int j = 0; j < dn.m_num_neighbors; j++){
+                dn.m_neighbors[j] = &proc_node.m_data_nodes[local_edges[edge_offsets[i] + j]];
+            }
+        }
+    }
+    const std::vector<int32_t>& adjacency = proc_node.m_layout == CellLayout::CSR ? proc_node.m_adj_indices : local_edges;
+
+    //an owned cell is packed for every rank owning a cell within halo_width hops of it. Those paths never
+    //leave the local cells, so a search out of each rank's ghosts finds them.
+    proc_node.m_pack_map.clear();
+    proc_node.m_unpack_map.clear();
+    for(size_t i = num_owned; i < num_local_cells; i++){
+        proc_node.m_unpack_map[ghost_owner[i]].push_back(i);
+    }
+    std::vector<int> visited(num_local_cells, -1);
+    std::vector<int> frontier, next_frontier;
+    std::vector<unsigned long long> keys(num_local_cells);
+    for(size_t i = 0; i < num_local_cells; i++) keys[i] = key(proc_node.m_global_ids[i]);
+    for(auto& pair : proc_node.m_unpack_map){
+        int rank = pair.first;
+        frontier.assign(pair.second.begin(), pair.second.end());
+        for(int i : frontier) visited[i] = rank;
+        std::vector<int>& locations = proc_node.m_pack_map[rank];
+        for(int hop = 0; hop < halo_width; hop++){
+            next_frontier.clear();
+            for(int i : frontier){
+                for(size_t e = edge_offsets[i]; e < edge_offsets[i+1]; e++){
+                    int j = adjacency[e];
+                    if(visited[j] == rank) continue;
+                    visited[j] = rank;
+                    next_frontier.push_back(j);
+                    if(j < (int)num_owned) locations.push_back(j);
+                }
+            }
+            frontier.swap(next_frontier);
+        }
+        //both sides sort by key, which follows the local order when the owned cells were numbered by it
+        std::sort(locations.begin(), locations.end(), [&](int a, int b){ return keys[a] < keys[b]; });
+        std::sort(pair.second.begin(), pair.second.end(), [&](int a, int b){ return keys[a] < keys[b]; });
+    }
+
+    proc_node.allocatePackedData();
+    proc_node.bcastGPTRs();
+    upcxx::barrier();
+    proc_node.classifyCells();
+}
+
+enum class LatticeType { SimpleCubic, FCC, BCC };
+
+//Orders for numbering cells. Natural is the global id, x-major, where the neighbors of a cell across y and
+//z are rows and planes apart. Morton and Hilbert follow space-filling curves that keep nearby cells close
+//in memory, Hilbert more so as its consecutive keys are always adjacent cells.
+enum class CellOrder { Natural, Morton, Hilbert };
+
+//the most bits per coordinate whose curve keys fit in 64 bits
+const int max_curve_bits = 21;
+
+//Curve keys of points with coordinates below 2^bits, bits must be at most max_curve_bits. Keys sharing their
+//first 3*k bits cover an aligned cube with sides of 2^(bits-k) on both curves.
+inline unsigned long long mortonKey(const int p[3], int bits){
+    unsigned long long key = 0;
+    for(int b = bits - 1; b >= 0; b--){
+        for(int d = 0; d < 3; d++) key = (key << 1) | ((p[d] >> b) & 1);
+    }
+    return key;
+}
+
+inline void mortonPoint(unsigned long long key, int bits, int p[3]){
+    p[0] = p[1] = p[2] = 0;
+    for(int b = bits - 1; b >= 0; b--){
+        for(int d = 0; d < 3; d++) p[d] |= ((key >> (3*b + 2 - d)) & 1) << b;
+    }
+}
+
+//J. Skilling, "Programming the Hilbert curve", AIP Conference Proceedings 707 (2004): the point is turned
+//into the transposed key in place, whose bits interleave like a Morton key.
+inline unsigned long long hilbertKey(const int p[3], int bits){
+    unsigned int x[3] = {(unsigned int)p[0], (unsigned int)p[1], (unsigned int)p[2]};
+    for(unsigned int q = 1u << (bits - 1); q > 1; q >>= 1){
+        unsigned int mask = q - 1;
+        for(int d = 0; d < 3; d++){
+            if(x[d] & q){
+                x[0] ^= mask;
+            } else {
+                unsigned int swapped = (x[0] ^ x[d]) & mask;
+                x[0] ^= swapped;
+                x[d] ^= swapped;
+            }
+        }
+    }
+    x[1] ^= x[0];
+    x[2] ^= x[1];
+    unsigned int t = 0;
+    for(unsigned int q = 1u << (bits - 1); q > 1; q >>= 1){
+        if(x[2] & q) t ^= q - 1;
+    }
+    int transposed[3] = {(int)(x[0] ^ t), (int)(x[1] ^ t), (int)(x[2] ^ t)};
+    return mortonKey(transposed, bits);
+}
+
+inline void hilbertPoint(unsigned long long key, int bits, int p[3]){
+    mortonPoint(key, bits, p);
+    unsigned int x[3] = {(unsigned int)p[0], (unsigned int)p[1], (unsigned int)p[2]};
+    unsigned int t = x[2] >> 1;
+    x[2] ^= x[1];
+    x[1] ^= x[0];
+    x[0] ^= t;
+    for(unsigned int q = 2; q != (1u << bits); q <<= 1){
+        unsigned int mask = q - 1;
+        for(int d = 2; d >= 0; d--){
+            if(x[d] & q){
+                x[0] ^= mask;
+            } else {
+                unsigned int swapped = (x[0] ^ x[d]) & mask;
+                x[0] ^= swapped;
+                x[d] ^= swapped;
+            }
+        }
+    }
+    for(int d = 0; d < 3; d++) p[d] = x[d];
+}
+
+//Adds up the time a rank spends on its own cells between start() and stop(), as LatticeDecomposition::rebalance()
+//expects. Time spent waiting on neighbors must be left out or every rank looks as slow as the slowest.
+class StepTimer {
+    public:
+    void start();
+    void stop();
+    void reset();
+
+    double m_seconds = 0.0;
+
+    private:
+    std::chrono::steady_clock::time_point m_start;
+};
+
+inline void StepTimer::start(){
+    m_start = std::chrono::steady_clock::now();
+}
+
+inline void StepTimer::stop(){
+    m_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+}
+
+inline void StepTimer::reset(){
+    m_seconds = 0.0;
+}
+
+//A box of lattice sites on an integer grid split into blocks over a grid of ranks, laid out like the
+//3DFCC example: a site's global id is z + y*dims[2] + x*dims[1]*dims[2], a rank's id is its block
+//coordinates in the same order, and the last block in each dimension takes the remainder. FCC sites are the
+//points with an even coordinate sum and BCC sites the points whose coordinates are all even or all odd,
+//so periodic FCC and BCC dimensions need to be even.
+struct LatticeDecomposition {
+    int m_dims[3];
+    int m_rank_dims[3];
+    LatticeType m_lattice;
+    bool m_periodic[3];
+    //the order ownedCells() lists a rank's cells in, which build() numbers them by. Boxes wider than
+    //2^max_curve_bits have no curve keys and keep the natural order.
+    CellOrder m_order = CellOrder::Natural;
+    //filled by partitionCurve(), rank r then owns the sites whose curve keys lie in
+    //[m_curve_splits[r], m_curve_splits[r+1]) instead of a block of m_rank_dims
+    std::vector<unsigned long long> m_curve_splits = {};
+
+    bool isSite(const int p[3]) const;
+    long long globalIndex(const int p[3]) const;
+    void globalCoords(long long idx, int p[3]) const;
+    bool wrap(int p[3]) const;
+    int neighborOffsets(int offsets[12][3]) const;
+    void neighbors(long long idx, std::vector<long long>& out) const;
+    void rankBlock(int rank, int start[3], int end[3]) const;
+    int rankOwner(const int p[3]) const;
+    std::vector<long long> ownedCells(int rank) const;
+    int curveBits() const;
+    unsigned long long curveKey(const int p[3]) const;
+    void curvePoint(unsigned long long key, int p[3]) const;
+    long long countSites(const int lo[3], const int hi[3]) const;
+    unsigned long long siteKey(long long position) const;
+    bool partitionCurve(int num_ranks);
+    template <typename T, typename Packer> bool rebalance(ProcessNode<T, Packer>& proc_node, double local_seconds,
+                                                          double tolerance = 1.1);
+
+    template <typename T, typename Packer> void build(ProcessNode<T, Packer>& proc_node) const;
+};
+
+inline bool LatticeDecomposition::isSite(const int p[3]) const {
+    switch(m_lattice){
+        case LatticeType::FCC: return (p[0] + p[1] + p[2]) % 2 == 0;
+        case LatticeType::BCC: return p[0] % 2 == p[1] % 2 && p[1] % 2 == p[2] % 2;
+        default: return true;
+    }
+}
+
+inline long long LatticeDecomposition::globalIndex(const int p[3]) const {
+    return p[2] + (long long)p[1]*m_dims[2] + (long long)p[0]*m_dims[1]*m_dims[2];
+}
+
+inline void LatticeDecomposition::globalCoords(long long idx, int p[3]) const {
+    long long plane = (long long)m_dims[1]*m_dims[2];
+    p[0] = idx / plane;
+    p[1] = (idx % plane) / m_dims[2];
+    p[2] = (idx % plane) % m_dims[2];
+}
+
+//moves p back into the box across periodic boundaries, returns false if it lies outside an open one
+inline bool LatticeDecomposition::wrap(int p[3]) const {
+    for(int d = 0; d < 3; d++){
+        if(p[d] >= 0 && p[d] < m_dims[d]) continue;
+        if(!m_periodic[d]) return false;
+        p[d] = ((p[d] % m_dims[d]) + m_dims[d]) % m_dims[d];
+    }
+    return true;
+}
+
+inline int LatticeDecomposition::neighborOffsets(int offsets[12][3]) const {
+    int count = 0;
+    for(int dx = -1; dx <= 1; dx++){
+        for(int dy = -1; dy <= 1; dy++){
+            for(int dz = -1; dz <= 1; dz++){
+                int nz = (dx != 0) + (dy != 0) + (dz != 0);
+                bool keep = false;
+                if(m_lattice == LatticeType::SimpleCubic) keep = nz == 1;
+                if(m_lattice == LatticeType::FCC) keep = nz == 2;
+                if(m_lattice == LatticeType::BCC) keep = nz == 3;
+                if(!keep) continue;
+                offsets[count][0] = dx;
+                offsets[count][1] = dy;
+                offsets[count][2] = dz;
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
+inline void LatticeDecomposition::neighbors(long long idx, std::vector<long long>& out) const {
+    int offsets[12][3];
+    int num_offsets = neighborOffsets(offsets);
+    int p[3];
+    globalCoords(idx, p);
+    for(int k = 0; k < num_offsets; k++){
+        int q[3] = {p[0] + offsets[k][0], p[1] + offsets[k][1], p[2] + offsets[k][2]};
+        if(wrap(q) && isSite(q)) out.push_back(globalIndex(q));
+    }
+}
+
+inline void LatticeDecomposition::rankBlock(int rank, int start[3], int end[3]) const {
+    int r[3] = {rank / (m_rank_dims[1]*m_rank_dims[2]),
+                (rank % (m_rank_dims[1]*m_rank_dims[2])) / m_rank_dims[2],
+                (rank % (m_rank_dims[1]*m_rank_dims[2])) % m_rank_dims[2]};
+    for(int d = 0; d < 3; d++){
+        int steps_per_rank = m_dims[d] / m_rank_dims[d];
+        start[d] = r[d]*steps_per_rank;
+        end[d] = (r[d] == m_rank_dims[d] - 1) ? m_dims[d] : start[d] + steps_per_rank;
+    }
+}
+
+inline int LatticeDecomposition::rankOwner(const int p[3]) const {
+    if(!m_curve_splits.empty()){
+        unsigned long long key = curveKey(p);
+        return std::upper_bound(m_curve_splits.begin(), m_curve_splits.end(), key) - m_curve_splits.begin() - 1;
+    }
+    int r[3];
+    for(int d = 0; d < 3; d++){
+        r[d] = p[d] / (m_dims[d] / m_rank_dims[d]);
+        if(r[d] >= m_rank_dims[d]) r[d] = m_rank_dims[d] - 1;
+    }
+    return r[2] + r[1]*m_rank_dims[2] + r[0]*m_rank_dims[1]*m_rank_dims[2];
+}
+
+//The sites of rank in m_order. With a curve partition the rank's key range is split into the aligned cubes it
+//covers, so the cost stays proportional to the cells owned.
+inline std::vector<long long> LatticeDecomposition::ownedCells(int rank) const {
+    std::vector<long long> cells;
+    auto add_box = [&](const int start[3], const int end[3]){
+        for(int x = std::max(0, start[0]); x < std::min(end[0], m_dims[0]); x++){
+            for(int y = std::max(0, start[1]); y < std::min(end[1], m_dims[1]); y++){
+                for(int z = std::max(0, start[2]); z < std::min(end[2], m_dims[2]); z++){
+                    int p[3] = {x, y, z};
+                    if(isSite(p)) cells.push_back(globalIndex(p));
+                }
+            }
+        }
+    };
+    if(m_curve_splits.empty()){
+        int start[3], end[3];
+        rankBlock(rank, start, end);
+        add_box(start, end);
+    } else {
+        unsigned long long first = m_curve_splits[rank], last = m_curve_splits[rank + 1];
+        int bits = curveBits();
+        //cube of key prefix at level, i.e. keys [prefix << shift, (prefix + 1) << shift)
+        std::function<void(unsigned long long, int)> visit = [&](unsigned long long prefix, int level){
+            int shift = 3*(bits - level);
+            unsigned long long begin = prefix << shift, end = (prefix + 1) << shift;
+            if(end <= first || begin >= last) return;
+            int lo[3], hi[3];
+            curvePoint(begin, lo);
+            for(int d = 0; d < 3; d++){
+                lo[d] &= ~((1 << (bits - level)) - 1);
+                hi[d] = lo[d] + (1 << (bits - level));
+            }
+            if(countSites(lo, hi) == 0) return;
+            if(begin >= first && end <= last){
+                add_box(lo, hi);
+                return;
+            }
+            for(int child = 0; child < 8; child++) visit(prefix*8 + child, level + 1);
+        };
+        visit(0, 0);
+    }
+    if(m_order != CellOrder::Natural){
+        std::vector<std::pair<unsigned long long, long long>> keyed;
+        keyed.reserve(cells.size());
+        for(long long idx : cells){
+            int p[3];
+            globalCoords(idx, p);
+            keyed.push_back(std::make_pair(curveKey(p), idx));
+        }
+        std::sort(keyed.begin(), keyed.end());
+        for(size_t k = 0; k < keyed.size(); k++) cells[k] = keyed[k].second;
+    }
+    return cells;
+}
+
+//bits per coordinate of the curve covering the box, at least one
+inline int LatticeDecomposition::curveBits() const {
+    int bits = 1;
+    while((1 << bits) < std::max(m_dims[0], std::max(m_dims[1], m_dims[2]))) bits++;
+    return bits;
+}
+
+inline unsigned long long LatticeDecomposition::curveKey(const int p[3]) const {
+    if(curveBits() > max_curve_bits) return globalIndex(p);
+    switch(m_order){
+        case CellOrder::Morton: return mortonKey(p, curveBits());
+        case CellOrder::Hilbert: return hilbertKey(p, curveBits());
+        default: return globalIndex(p);
+    }
+}
+
+inline void LatticeDecomposition::curvePoint(unsigned long long key, int p[3]) const {
+    if(curveBits() > max_curve_bits){
+        globalCoords(key, p);
+        return;
+    }
+    switch(m_order){
+        case CellOrder::Morton: mortonPoint(key, curveBits(), p); break;
+        case CellOrder::Hilbert: hilbertPoint(key, curveBits(), p); break;
+        default: globalCoords(key, p);
+    }
+}
+
+//number of sites in [lo, hi) clipped to the box, in closed form. A coordinate range has e even and o odd
+//values, FCC sites are the points whose parities sum to even, and the sum of (-1)^(x+y+z) over the box is
+//the product of e - o.
+inline long long LatticeDecomposition::countSites(const int lo[3], const int hi[3]) const {
+    long long all = 1, even = 1, odd = 1, signed_sum = 1;
+    for(int d = 0; d < 3; d++){
+        long long begin = std::max(0, lo[d]), end = std::min(hi[d], m_dims[d]);
+        if(end <= begin) return 0;
+        long long evens = (end + 1)/2 - (begin + 1)/2;
+        long long odds = (end - begin) - evens;
+        all *= end - begin;
+        even *= evens;
+        odd *= odds;
+        signed_sum *= evens - odds;
+    }
+    switch(m_lattice){
+        case LatticeType::FCC: return (all + signed_sum)/2;
+        case LatticeType::BCC: return even + odd;
+        default: return all;
+    }
+}
+
+//Splits the sites into num_ranks runs along a Hilbert curve, or a Morton curve if m_order is Morton, of
+//equal size to within one site. Unlike m_rank_dims this works for any rank count, and the runs are compact
+//because the curve is. m_order becomes the curve so owned cells are also numbered along it. Every rank
+//computes the same splits by walking down the curve's cubes and counting their sites, which takes
+//O(num_ranks*curveBits()) and no communication. rankBlock() and LatticeProcessNode do not apply afterwards.
+//Returns false and changes nothing if the box is wider than 2^max_curve_bits, whose keys would not fit.
+inline bool LatticeDecomposition::partitionCurve(int num_ranks){
+    if(curveBits() > max_curve_bits) return false;
+    if(m_order == CellOrder::Natural) m_order = CellOrder::Hilbert;
+    int lo[3] = {0, 0, 0};
+    long long total = countSites(lo, m_dims);
+    m_curve_splits.assign(1, 0);
+    for(int r = 1; r < num_ranks; r++) m_curve_splits.push_back(siteKey(total*r/num_ranks));
+    m_curve_splits.push_back(~0ull);
+    return true;
+}
+
+//The curve key of the site at position along the curve, found by descending into the child cube that holds
+//it at each level. Positions past the last site give the largest key.
+inline unsigned long long LatticeDecomposition::siteKey(long long position) const {
+    int bits = curveBits();
+    int lo[3] = {0, 0, 0};
+    if(position >= countSites(lo, m_dims)) return ~0ull;
+    unsigned long long prefix = 0;
+    for(int level = 1; level <= bits; level++){
+        int shift = 3*(bits - level);
+        for(int child = 0; child < 8; child++){
+            int child_lo[3], child_hi[3];
+            curvePoint((prefix*8 + child) << shift, child_lo);
+            for(int d = 0; d < 3; d++){
+                child_lo[d] &= ~((1 << (bits - level)) - 1);
+                child_hi[d] = child_lo[d] + (1 << (bits - level));
+            }
+            long long count = countSites(child_lo, child_hi);
+            if(position < count || child == 7){
+                prefix = prefix*8 + child;
+                break;
+            }
+            position -= count;
+        }
+    }
+    return prefix;
+}
+
+//Wires proc_node for this rank's cells in time and memory proportional to them, with cells numbered in
+//m_order. rank_n() must equal the product of m_rank_dims, or the rank count given to partitionCurve().
+//Collective.
+template <typename T, typename Packer> void LatticeDecomposition::build(ProcessNode<T, Packer>& proc_node) const {
+    auto key = [this](long long idx){
+        int p[3];
+        globalCoords(idx, p);
+        return curveKey(p);
+    };
+    wireProcessNode(proc_node, ownedCells(upcxx::rank_me()),
+                    [this](long long idx, std::vector<long long>& out){ neighbors(idx, out); },
+                    [this](long long idx){
+                        int p[3];
+                        globalCoords(idx, p);
+                        return rankOwner(p);
+                    }, key);
+}
+
+//Moves the curve splits so every rank gets the same share of the measured work, then migrates the cells that
+//changed owner and rewires proc_node in place. local_seconds is this rank's compute time since the last
+//call, e.g. from a StepTimer, and work is taken to be spread evenly over a rank's cells, so a hotspot is
+//narrowed down over a few calls. Nothing happens unless the slowest rank is more than tolerance times the
+//mean. Needs a curve partition and a proc_node built from this decomposition. The values of every buffer
+//move with their cells, ghosts come back empty until the next exchange and the exchange plan is compiled
+//again if it was before. Schedules are dropped. Collective, returns whether the partition changed.
+template <typename T, typename Packer>
+bool LatticeDecomposition::rebalance(ProcessNode<T, Packer>& proc_node, double local_seconds, double tolerance){
+    static_assert(std::is_trivially_copyable<T>::value, "migrated cells are sent as raw bytes");
+    int num_ranks = upcxx::rank_n();
+    if(m_curve_splits.empty() || num_ranks == 1) return false;
+
+    //every rank needs the times and sizes of all the runs to place the splits
+    size_t num_owned = proc_node.m_layer_ends.empty() ? 0 : proc_node.m_layer_ends[0];
+    std::vector<double> seconds(num_ranks, 0.0), counts(num_ranks, 0.0);
+    seconds[upcxx::rank_me()] = std::max(0.0, local_seconds);
+    counts[upcxx::rank_me()] = num_owned;
+    upcxx::reduce_all(seconds.data(), seconds.data(), num_ranks, upcxx::op_fast_add).wait();
+    upcxx::reduce_all(counts.data(), counts.data(), num_ranks, upcxx::op_fast_add).wait();
+    double total = 0.0, slowest = 0.0;
+    for(double t : seconds){
+        total += t;
+        slowest = std::max(slowest, t);
+    }
+    if(total <= 0.0 || slowest <= tolerance*total/num_ranks) return false;
+
+    //split r goes where the work of the runs before it adds up to r/num_ranks of the total
+    std::vector<unsigned long long> splits(1, 0);
+    int run = 0;
+    double run_begin = 0.0;
+    long long run_site = 0;
+    for(int r = 1; r < num_ranks; r++){
+        double target = total*r/num_ranks;
+        while(run < num_ranks - 1 && run_begin + seconds[run] <= target){
+            run_begin += seconds[run];
+            run_site += counts[run];
+            run++;
+        }
+        long long offset = seconds[run] > 0.0 ? (long long)((target - run_begin)/seconds[run]*counts[run]) : 0;
+        offset = std::min<long long>(std::max<long long>(offset, 0), counts[run]);
+        splits.push_back(std::max(splits.back(), siteKey(run_site + offset)));
+    }
+    splits.push_back(~0ull);
+
+    //keep copies of our cells, then send the ones that move in one RPC per destination
+    size_t num_buffers = 1 + proc_node.m_other_buffers.size();
+    std::vector<long long> old_ids(proc_node.m_global_ids.begin(), proc_node.m_global_ids.begin() + num_owned);
+    std::vector<T> old_values(num_owned*num_buffers);
+    for(size_t i = 0; i < num_owned; i++){
+        old_values[i*num_buffers] = proc_node.value(i);
+        for(size_t b = 1; b < num_buffers; b++) old_values[i*num_buffers + b] = proc_node.m_other_buffers[b - 1][i];
+    }
+    m_curve_splits = splits;
+    std::map<int, std::pair<std::vector<long long>, std::vector<T>>> outgoing;
+    for(size_t i = 0; i < num_owned; i++){
+        int p[3];
+        globalCoords(old_ids[i], p);
+        int rank = rankOwner(p);
+        if(rank == upcxx::rank_me()) continue;
+        outgoing[rank].first.push_back(old_ids[i]);
+        outgoing[rank].second.insert(outgoing[rank].second.end(), old_values.begin() + i*num_buffers,
+                                     old_values.begin() + (i + 1)*num_buffers);
+    }
+    typedef std::pair<std::vector<long long>, std::vector<T>> Batch;
+    upcxx::dist_object<Batch> incoming(Batch{});
+    upcxx::future<> all_sent = upcxx::make_future();
+    for(auto& pair : outgoing){
+        upcxx::future<> f = upcxx::rpc(pair.first,
+                    [](upcxx::dist_object<Batch>& in, const std::vector<long long>& ids, const std::vector<T>& values){
+                in->first.insert(in->first.end(), ids.begin(), ids.end());
+                in->second.insert(in->second.end(), values.begin(), values.end());
+            }, incoming, pair.second.first, pair.second.second);
+        all_sent = upcxx::when_all(all_sent, f);
+    }
+    all_sent.wait();
+    upcxx::barrier();
+
+    //tear down the old wiring, no neighbor reads our buffers any more
+    bool compile_plan = proc_node.m_plan_compiled;
+    ExchangeMode mode = proc_node.m_exchange_mode;
+    proc_node.clearExchangePlan();
+    proc_node.clearSchedule();
+    proc_node.m_schedule.clear();
+    proc_node.releasePackedData();
+    if(proc_node.m_layout == CellLayout::Nodes){
+        for(size_t i = 0; i < proc_node.m_num_data_nodes; i++) delete[] proc_node.m_data_nodes[i].m_neighbors;
+        delete[] proc_node.m_data_nodes;
+        proc_node.m_data_nodes = NULL;
+    }
+    upcxx::barrier();
+
+    build(proc_node);
+    std::unordered_map<long long, size_t> sources;
+    sources.reserve(old_ids.size() + incoming->first.size());
+    for(size_t i = 0; i < old_ids.size(); i++) sources[old_ids[i]] = i;
+    for(size_t k = 0; k < incoming->first.size(); k++) sources[incoming->first[k]] = old_ids.size() + k;
+    if(num_buffers > 1) proc_node.allocateBuffers(num_buffers);
+    size_t new_owned = proc_node.m_layer_ends[0];
+    for(size_t i = 0; i < new_owned; i++){
+        size_t source = sources.at(proc_node.m_global_ids[i]);
+        const T* values = source < old_ids.size() ? &old_values[source*num_buffers] :
+                                                    &incoming->second[(source - old_ids.size())*num_buffers];
+        proc_node.value(i) = values[0];
+        for(size_t b = 1; b < num_buffers; b++) proc_node.m_other_buffers[b - 1][i] = values[b];
+    }
+    if(compile_plan) proc_node.compileExchangePlan(mode);
+    return true;
+}
+
+//An unstructured graph of cells, such as an irregular mesh or a network, split over the ranks. Global cell ids
+//are the vertex ids. Every rank holds the whole graph and computes the same partition from it, so partitioning
+//needs no communication, but memory grows with the global graph rather than the local subdomain.
+struct GraphDecomposition {
+    //symmetric, without self loops or repeated edges, vertex v's neighbors are m_adjacency[m_offsets[v] .. m_offsets[v+1])
+    std::vector<size_t> m_offsets;
+    std::vector<int32_t> m_adjacency;
+    //the rank owning each vertex, filled by partitionBlock() or partitionMultilevel()
+    std::vector<int> m_owners;
+
+    //a graph with vertex and edge weights, one level of the multilevel partitioner
+    struct WeightedGraph {
+        std::vector<size_t> m_offsets;
+        std::vector<int32_t> m_adjacency;
+        std::vector<long long> m_edge_weights;
+        std::vector<long long> m_vertex_weights;
+
+        int32_t numVertices() const { return m_vertex_weights.size(); }
+    };
+
+    bool loadEdgeList(const std::string& path);
+    bool setEdges(long long num_vertices, const std::vector<std::pair<long long, long long>>& edges);
+    long long numVertices() const;
+    void partitionBlock(int num_parts);
+    void partitionMultilevel(int num_parts, double max_imbalance = 1.03, unsigned seed = 1);
+    long long edgeCut() const;
+    double imbalance(int num_parts) const;
+    std::vector<long long> ownedCells(int rank) const;
+    void neighbors(long long idx, std::vector<long long>& out) const;
+    int owner(long long idx) const;
+    template <typename T, typename Packer> void build(ProcessNode<T, Packer>& proc_node) const;
+
+    static WeightedGraph coarsen(const WeightedGraph& graph, long long max_vertex_weight, std::mt19937& rng,
+                                 std::vector<int32_t>& coarse_ids);
+    static void bisect(const WeightedGraph& graph, std::vector<int32_t>& vertices, int first_part, int num_parts,
+                       std::vector<int>& parts, std::mt19937& rng);
+    static void refine(const WeightedGraph& graph, int num_parts, long long max_part_weight, std::vector<int>& parts);
+};
+
+//Reads one edge per line as two vertex ids separated by whitespace, ignoring anything after them and lines
+//starting with # or %. Edges are made symmetric, and the vertex count is one more than the largest id, so
+//unused ids become isolated vertices. A file starting with a %%MatrixMarket coordinate banner is read as a
+//Matrix Market pattern instead: its size line gives the vertex count and its 1-based ids are shifted down.
+//Returns false if the file cannot be read or holds a line that is not an edge.
+inline bool GraphDecomposition::loadEdgeList(const std::string& path){
+    std::ifstream file(path);
+    if(!file) return false;
+    std::vector<std::pair<long long, long long>> edges;
+    long long num_vertices = 0;
+    bool matrix_market = false;
+    bool need_size = false;
+    bool ok = true;
+    std::string line;
+    for(bool first = true; ok && std::getline(file, line); first = false){
+        if(first && line.compare(0, 14, "%%MatrixMarket") == 0){
+            matrix_market = need_size = true;
+            ok = line.find("coordinate") != std::string::npos;
+            continue;
+        }
+        const char* cursor = line.c_str();
+        while(*cursor == ' ' || *cursor == '\t') cursor++;
+        if(*cursor == '#' || *cursor == '%' || *cursor == '\r' || *cursor == '\0') continue;
+        char* end;
+        long long u = std::strtoll(cursor, &end, 10);
+        ok = end != cursor;
+        cursor = end;
+        long long v = std::strtoll(cursor, &end, 10);
+        ok = ok && end != cursor;
+        if(need_size){
+            //rows and columns, the entry count that follows is not needed
+            num_vertices = std::max(u, v);
+            ok = ok && u >= 0 && v >= 0;
+            need_size = false;
+            continue;
+        }
+        if(matrix_market){
+            u--;
+            v--;
+        }
+        ok = ok && u >= 0 && v >= 0;
+        edges.push_back(std::make_pair(u, v));
+        if(!matrix_market) num_vertices = std::max(num_vertices, std::max(u, v) + 1);
+    }
+    ok = ok && !need_size && !file.bad();
+    return ok && setEdges(num_vertices, edges);
+}
+
+//Replaces the graph, dropping any partition. Returns false if an id is out of range or the vertex count does
+//not fit the int32_t adjacency.
+inline bool GraphDecomposition::setEdges(long long num_vertices, const std::vector<std::pair<long long, long long>>& edges){
+    if(num_vertices < 0 || num_vertices > std::numeric_limits<int32_t>::max()) return false;
+    for(const auto& edge : edges){
+        if(edge.first < 0 || edge.second < 0 || edge.first >= num_vertices || edge.second >= num_vertices) return false;
+    }
+    //both directions of every edge, bucketed by source
+    m_offsets.assign(num_vertices + 1, 0);
+    for(const auto& edge : edges){
+        if(edge.first == edge.second) continue;
+        m_offsets[edge.first + 1]++;
+        m_offsets[edge.second + 1]++;
+    }
+    for(long long v = 0; v < num_vertices; v++) m_offsets[v+1] += m_offsets[v];
+    m_adjacency.resize(m_offsets[num_vertices]);
+    std::vector<size_t> next(m_offsets.begin(), m_offsets.end() - 1);
+    for(const auto& edge : edges){
+        if(edge.first == edge.second) continue;
+        m_adjacency[next[edge.first]++] = edge.second;
+        m_adjacency[next[edge.second]++] = edge.first;
+    }
+    //sorted and without repeats, compacted in place
+    size_t write = 0;
+    for(long long v = 0; v < num_vertices; v++){
+        auto begin = m_adjacency.begin() + m_offsets[v];
+        auto end = m_adjacency.begin() + m_offsets[v+1];
+        std::sort(begin, end);
+        end = std::unique(begin, end);
+        m_offsets[v] = write;
+        for(auto it = begin; it != end; ++it) m_adjacency[write++] = *it;
+    }
+    m_offsets[num_vertices] = write;
+    m_adjacency.resize(write);
+    m_owners.clear();
+    return true;
+}
+
+inline long long GraphDecomposition::numVertices() const {
+    return m_offsets.empty() ? 0 : m_offsets.size() - 1;
+}
+
+//Splits the vertex ids into num_parts equal runs, which is what a mesh numbered without regard to locality
+//gets from a naive split.
+inline void GraphDecomposition::partitionBlock(int num_parts){
+    long long num_vertices = numVertices();
+    m_owners.resize(num_vertices);
+    for(long long v = 0; v < num_vertices; v++) m_owners[v] = v*num_parts/num_vertices;
+}
+
+//Partitions the graph into num_parts parts of at most max_imbalance times the mean size while keeping few
+//edges between parts. The graph is coarsened by heavy edge matching, the coarsest graph is split by recursive
+//bisection grown from peripheral vertices, and the split is projected back level by level with greedy
+//boundary refinement after each. Deterministic for a given seed, so every rank computes the same partition.
+inline void GraphDecomposition::partitionMultilevel(int num_parts, double max_imbalance, unsigned seed){
+    std::mt19937 rng(seed);
+    int32_t num_vertices = numVertices();
+    std::vector<WeightedGraph> levels(1);
+    levels[0].m_offsets = m_offsets;
+    levels[0].m_adjacency = m_adjacency;
+    levels[0].m_edge_weights.assign(m_adjacency.size(), 1);
+    levels[0].m_vertex_weights.assign(num_vertices, 1);
+
+    //coarse vertices are kept well below a part's size so the coarsest graph can still be balanced
+    int32_t coarsen_to = std::max(200, 20*num_parts);
+    long long max_vertex_weight = std::max(1LL, 3LL*num_vertices/(2LL*coarsen_to));
+    std::vector<std::vector<int32_t>> coarse_ids;
+    while(levels.back().numVertices() > coarsen_to){
+        std::vector<int32_t> ids;
+        WeightedGraph coarse = coarsen(levels.back(), max_vertex_weight, rng, ids);
+        //stop once matching stalls, e.g. on stars
+        if(coarse.numVertices() > 0.95*levels.back().numVertices()) break;
+        levels.push_back(std::move(coarse));
+        coarse_ids.push_back(std::move(ids));
+    }
+
+    long long max_part_weight = std::max((long long)std::ceil(max_imbalance*num_vertices/num_parts),
+                                         ((long long)num_vertices + num_parts - 1)/num_parts);
+    const WeightedGraph& coarsest = levels.back();
+    std::vector<int> parts(coarsest.numVertices(), 0);
+    std::vector<int32_t> vertices(coarsest.numVertices());
+    for(int32_t v = 0; v < coarsest.numVertices(); v++) vertices[v] = v;
+    bisect(coarsest, vertices, 0, num_parts, parts, rng);
+    for(size_t level = levels.size() - 1; ; level--){
+        //coarse vertices are heavy, so their levels are allowed to overshoot by one of them
+        long long slack = 0;
+        if(level > 0) slack = *std::max_element(levels[level].m_vertex_weights.begin(), levels[level].m_vertex_weights.end());
+        refine(levels[level], num_parts, max_part_weight + slack, parts);
+        if(level == 0) break;
+        std::vector<int> finer(levels[level - 1].numVertices());
+        for(int32_t v = 0; v < (int32_t)finer.size(); v++) finer[v] = parts[coarse_ids[level - 1][v]];
+        parts.swap(finer);
+    }
+    m_owners.swap(parts);
+}
+
+//Matches every vertex with its unmatched neighbor across the heaviest edge, visiting vertices in random order,
+//and merges each pair into one coarse vertex. coarse_ids maps the vertices of graph to those of the result.
+inline GraphDecomposition::WeightedGraph GraphDecomposition::coarsen(const WeightedGraph& graph, long long max_vertex_weight,
+                                                                     std::mt19937& rng, std::vector<int32_t>& coarse_ids){
+    int32_t num_vertices = graph.numVertices();
+    std::vector<int32_t> order(num_vertices);
+    for(int32_t v = 0; v < num_vertices; v++) order[v] = v;
+    //written out rather than std::shuffle, whose results differ between standard libraries
+    for(int32_t i = num_vertices - 1; i > 0; i--) std::swap(order[i], order[rng() % (i + 1)]);
+
+    std::vector<int32_t> match(num_vertices, -1);
+    for(int32_t v : order){
+        if(match[v] >= 0) continue;
+        int32_t best = v;
+        long long best_weight = 0;
+        for(size_t e = graph.m_offsets[v]; e < graph.m_offsets[v+1]; e++){
+            int32_t u = graph.m_adjacency[e];
+            if(match[u] >= 0 || graph.m_vertex_weights[v] + graph.m_vertex_weights[u] > max_vertex_weight) continue;
+            if(graph.m_edge_weights[e] > best_weight){
+                best = u;
+                best_weight = graph.m_edge_weights[e];
+            }
+        }
+        match[v] = best;
+        match[best] = v;
+    }
+
+    WeightedGraph coarse;
+    coarse_ids.assign(num_vertices, -1);
+    std::vector<int32_t> members;
+    for(int32_t v = 0; v < num_vertices; v++){
+        if(coarse_ids[v] >= 0) continue;
+        coarse_ids[v] = coarse_ids[match[v]] = coarse.m_vertex_weights.size();
+        coarse.m_vertex_weights.push_back(graph.m_vertex_weights[v] + (match[v] != v ? graph.m_vertex_weights[match[v]] : 0));
+        members.push_back(v);
+    }
+    //edges of each pair merged through a table of where each coarse neighbor already went
+    std::vector<size_t> slot_of(coarse.m_vertex_weights.size(), ~(size_t)0);
+    coarse.m_offsets.assign(1, 0);
+    for(int32_t c = 0; c < (int32_t)members.size(); c++){
+        size_t row_begin = coarse.m_adjacency.size();
+        int32_t pair[2] = {members[c], match[members[c]]};
+        for(int m = 0; m < (pair[0] == pair[1] ? 1 : 2); m++){
+            for(size_t e = graph.m_offsets[pair[m]]; e < graph.m_offsets[pair[m]+1]; e++){
+                int32_t d = coarse_ids[graph.m_adjacency[e]];
+                if(d == c) continue;
+                if(slot_of[d] != ~(size_t)0 && slot_of[d] >= row_begin){
+                    coarse.m_edge_weights[slot_of[d]] += graph.m_edge_weights[e];
+                } else {
+                    slot_of[d] = coarse.m_adjacency.size();
+                    coarse.m_adjacency.push_back(d);
+                    coarse.m_edge_weights.push_back(graph.m_edge_weights[e]);
+                }
+            }
+        }
+        coarse.m_offsets.push_back(coarse.m_adjacency.size());
+    }
+    return coarse;
+}
+
+//Assigns vertices, a subset of graph, to parts [first_part, first_part + num_parts) by splitting it in two in
+//proportion to the parts on each side and recursing. Each split grows a region breadth first from a
+//peripheral vertex, from a few random starts, and keeps the one cutting the fewest edges.
+inline void GraphDecomposition::bisect(const WeightedGraph& graph, std::vector<int32_t>& vertices, int first_part,
+                                       int num_parts, std::vector<int>& parts, std::mt19937& rng){
+    if(num_parts == 1 || vertices.empty()){
+        for(int32_t v : vertices) parts[v] = first_part;
+        return;
+    }
+    int left_parts = num_parts/2;
+    long long total = 0;
+    for(int32_t v : vertices) total += graph.m_vertex_weights[v];
+    long long target = total*left_parts/num_parts;
+
+    //parts[] holds first_part for the subset while splitting, -1 and -2 mark visits of the BFS passes
+    for(int32_t v : vertices) parts[v] = first_part;
+    std::vector<int32_t> queue, grown, best_grown;
+    long long best_cut = std::numeric_limits<long long>::max();
+    auto bfs = [&](int32_t seed, int mark, long long limit){
+        queue.assign(1, seed);
+        parts[seed] = mark;
+        long long weight = graph.m_vertex_weights[seed];
+        size_t next_vertex = 0;
+        for(size_t head = 0; head < queue.size() && weight < limit; head++){
+            int32_t v = queue[head];
+            for(size_t e = graph.m_offsets[v]; e < graph.m_offsets[v+1] && weight < limit; e++){
+                int32_t u = graph.m_adjacency[e];
+                if(parts[u] != first_part) continue;
+                parts[u] = mark;
+                queue.push_back(u);
+                weight += graph.m_vertex_weights[u];
+            }
+            //a disconnected subset continues from its next unvisited vertex
+            while(head + 1 == queue.size() && weight < limit && next_vertex < vertices.size()){
+                int32_t u = vertices[next_vertex++];
+                if(parts[u] != first_part) continue;
+                parts[u] = mark;
+                queue.push_back(u);
+                weight += graph.m_vertex_weights[u];
+            }
+        }
+    };
+    for(int attempt = 0; attempt < 4; attempt++){
+        //the last vertex a full search reaches is far from where it started
+        bfs(vertices[rng() % vertices.size()], -1, total);
+        int32_t seed = queue.back();
+        for(int32_t v : queue) parts[v] = first_part;
+        bfs(seed, -2, target);
+        grown = queue;
+        long long cut = 0;
+        for(int32_t v : grown){
+            for(size_t e = graph.m_offsets[v]; e < graph.m_offsets[v+1]; e++){
+                if(parts[graph.m_adjacency[e]] == first_part) cut += graph.m_edge_weights[e];
+            }
+        }
+        for(int32_t v : grown) parts[v] = first_part;
+        if(cut < best_cut){
+            best_cut = cut;
+            best_grown.swap(grown);
+        }
+    }
+
+    //each side is marked with the first of its parts, which no other pending subset uses
+    for(int32_t v : best_grown) parts[v] = -2;
+    std::vector<int32_t> left, right;
+    for(int32_t v : vertices) (parts[v] == -2 ? left : right).push_back(v);
+    for(int32_t v : left) parts[v] = first_part;
+    for(int32_t v : right) parts[v] = first_part + left_parts;
+    vertices.clear();
+    vertices.shrink_to_fit();
+    bisect(graph, left, first_part, left_parts, parts, rng);
+    bisect(graph, right, first_part + left_parts, num_parts - left_parts, parts, rng);
+}
+
+//Greedy k-way refinement. Each pass moves every vertex to the neighboring part it has the most edge weight to
+//when that cuts fewer edges, or as many while evening out the parts, and keeps parts under max_part_weight.
+//Vertices of overweight parts move even at a loss, to the best neighboring part or else the lightest one.
+inline void GraphDecomposition::refine(const WeightedGraph& graph, int num_parts, long long max_part_weight, std::vector<int>& parts){
+    int32_t num_vertices = graph.numVertices();
+    std::vector<long long> part_weights(num_parts, 0);
+    for(int32_t v = 0; v < num_vertices; v++) part_weights[parts[v]] += graph.m_vertex_weights[v];
+    std::vector<long long> connection(num_parts, 0);
+    std::vector<int> touched;
+    for(int pass = 0; pass < 10; pass++){
+        size_t num_moves = 0;
+        for(int32_t v = 0; v < num_vertices; v++){
+            int from = parts[v];
+            long long weight = graph.m_vertex_weights[v];
+            if(part_weights[from] == weight) continue;
+            touched.clear();
+            for(size_t e = graph.m_offsets[v]; e < graph.m_offsets[v+1]; e++){
+                int p = parts[graph.m_adjacency[e]];
+                if(connection[p] == 0) touched.push_back(p);
+                connection[p] += graph.m_edge_weights[e];
+            }
+            bool overweight = part_weights[from] > max_part_weight;
+            int to = from;
+            long long best_gain = overweight ? std::numeric_limits<long long>::min() : 0;
+            for(int p : touched){
+                if(p == from || part_weights[p] + weight > max_part_weight) continue;
+                long long gain = connection[p] - connection[from];
+                bool evens_out = part_weights[p] + weight < part_weights[from];
+                if(gain > best_gain || (gain == best_gain && evens_out && (to == from || part_weights[p] < part_weights[to]))){
+                    to = p;
+                    best_gain = gain;
+                }
+            }
+            for(int p : touched) connection[p] = 0;
+            if(to == from && overweight){
+                to = std::min_element(part_weights.begin(), part_weights.end()) - part_weights.begin();
+            }
+            //a tie that would not even out the parts is not worth a move
+            if(to == from || (!overweight && best_gain == 0 && part_weights[to] + weight >= part_weights[from])) continue;
+            parts[v] = to;
+            part_weights[from] -= weight;
+            part_weights[to] += weight;
+            num_moves++;
+        }
+        if(num_moves == 0) break;
+    }
+}
+
+//Edges whose ends are owned by different ranks, each counted once.
+inline long long GraphDecomposition::edgeCut() const {
+    long long cut = 0;
+    for(long long v = 0; v < numVertices(); v++){
+        for(size_t e = m_offsets[v]; e < m_offsets[v+1]; e++){
+            if(m_adjacency[e] > v && m_owners[m_adjacency[e]] != m_owners[v]) cut++;
+        }
+    }
+    return cut;
+}
+
+//The largest part over the mean part size.
+inline double GraphDecomposition::imbalance(int num_parts) const {
+    std::vector<long long> sizes(num_parts, 0);
+    for(int owner : m_owners) sizes[owner]++;
+    long long largest = *std::max_element(sizes.begin(), sizes.end());
+    return numVertices() > 0 ? (double)largest*num_parts/numVertices() : 1.0;
+}
+
+inline std::vector<long long> GraphDecomposition::ownedCells(int rank) const {
+    std::vector<long long> cells;
+    for(long long v = 0; v < numVertices(); v++){
+        if(m_owners[v] == rank) cells.push_back(v);
+    }
+    return cells;
+}
+
+inline void GraphDecomposition::neighbors(long long idx, std::vector<long long>& out) const {
+    out.insert(out.end(), m_adjacency.begin() + m_offsets[idx], m_adjacency.begin() + m_offsets[idx+1]);
+}
+
+inline int GraphDecomposition::owner(long long idx) const {
+    return m_owners[idx];
+}
+
+//Wires proc_node for this rank's vertices after a partition with rank_n() parts, with ghosts and pack/unpack
+//maps from wireProcessNode(). Collective.
+template <typename T, typename Packer> void GraphDecomposition::build(ProcessNode<T, Packer>& proc_node) const {
+    wireProcessNode(proc_node, ownedCells(upcxx::rank_me()),
+                    [this](long long idx, std::vector<long long>& out){ neighbors(idx, out); },
+                    [this](long long idx){ return owner(idx); });
+}
+
+//Compile-time lattices for LatticeProcessNode. Sites are in primitive coordinates, so every point of the
+//grid is a site and the dense field has no holes. offsets[k] is the displacement to the k-th neighbor.
+template <int Dims> struct CubicLattice;
+
+template <> struct CubicLattice<1> {
+    static constexpr int dims = 1;
+    static constexpr int num_neighbors = 2;
+    static constexpr int offsets[2][3] = {{-1, 0, 0}, {1, 0, 0}};
+};
+
+template <> struct CubicLattice<2> {
+    static constexpr int dims = 2;
+    static constexpr int num_neighbors = 4;
+    static constexpr int offsets[4][3] = {{-1, 0, 0}, {1, 0, 0}, {0, -1, 0}, {0, 1, 0}};
+};
+
+template <> struct CubicLattice<3> {
+    static constexpr int dims = 3;
+    static constexpr int num_neighbors = 6;
+    static constexpr int offsets[6][3] = {{-1, 0, 0}, {1, 0, 0}, {0, -1, 0}, {0, 1, 0}, {0, 0, -1}, {0, 0, 1}};
+};
+
+//primitive vectors (0,1,1)/2, (1,0,1)/2, (1,1,0)/2
+struct FCCLattice {
+    static constexpr int dims = 3;
+    static constexpr int num_neighbors = 12;
+    static constexpr int offsets[12][3] = {{-1, 0, 0}, {1, 0, 0}, {0, -1, 0}, {0, 1, 0}, {0, 0, -1}, {0, 0, 1},
+                                           {-1, 1, 0}, {1, -1, 0}, {-1, 0, 1}, {1, 0, -1}, {0, -1, 1}, {0, 1, -1}};
+};
+
+//primitive vectors (-1,1,1)/2, (1,-1,1)/2, (1,1,-1)/2
+struct BCCLattice {
+    static constexpr int dims = 3;
+    static constexpr int num_neighbors = 8;
+    static constexpr int offsets[8][3] = {{-1, 0, 0}, {1, 0, 0}, {0, -1, 0}, {0, 1, 0}, {0, 0, -1}, {0, 0, 1},
+                                          {-1, -1, -1}, {1, 1, 1}};
+};
+
+//every cell of the surrounding 3x3x3 block, as in D3Q27 lattice Boltzmann or 3D cellular automata
+struct MooreLattice {
+    static constexpr int dims = 3;
+    static constexpr int num_neighbors = 26;
+    static constexpr int offsets[26][3] = {{-1, -1, -1}, {-1, -1, 0}, {-1, -1, 1}, {-1, 0, -1}, {-1, 0, 0}, {-1, 0, 1},
+                                           {-1, 1, -1}, {-1, 1, 0}, {-1, 1, 1}, {0, -1, -1}, {0, -1, 0}, {0, -1, 1},
+                                           {0, 0, -1}, {0, 0, 1}, {0, 1, -1}, {0, 1, 0}, {0, 1, 1},
+                                           {1, -1, -1}, {1, -1, 0}, {1, -1, 1}, {1, 0, -1}, {1, 0, 0}, {1, 0, 1},
+                                           {1, 1, -1}, {1, 1, 0}, {1, 1, 1}};
+};
+
+//A ProcessNode for structured lattices that stores no adjacency at all. Each rank holds its block of the
+//global box plus m_halo_width layers of halo cells as a dense row-major array in m_values, so the k-th
+//neighbor of cell i is m_values[i + m_strides[k]]. Rows run along the last active dimension and are
+//contiguous, which lets a stencil over a row compile to fixed-offset loads. Halo cells past an open boundary
+//are never exchanged and keep whatever value the caller gives them, and applyStencil() does not count them as
+//neighbors. Dimensions past Lattice::dims must have size 1.
+template <typename T, typename Lattice, typename Packer = PackTraits<T>>
+class LatticeProcessNode : public ProcessNode<T, Packer> {
+    public:
+    static constexpr int dims = Lattice::dims;
+    static constexpr int num_neighbors = Lattice::num_neighbors;
+
+    void build(const int global_dims[3], const int rank_dims[3], const bool periodic[3]);
+    void compileSweep();
+    bool checkpoint(const std::string& path) const;
+    bool restore(const std::string& path);
+
+    bool isGhost(int i) const;
+    void globalCoords(int i, int p[3]) const;
+    int localIndex(const int p[3]) const;
+    template <typename F> void forEachRow(CellRegion region, F f) const;
+
+    private:
+    void layoutBlock();
+    template <typename F> void forEachHaloCell(int rank, F f) const;
+    int faceNeighbor(int d, int direction) const;
+    void appendSlab(std::vector<int>& cells, int d, int layer) const;
+    void appendRingRows(std::vector<std::pair<int, int>>& rows, int ring) const;
+    void appendOpenCells(const std::vector<std::pair<int, int>>& rows, std::vector<std::pair<int, uint32_t>>& cells) const;
+
+    public:
+    LatticeDecomposition m_decomp;
+    int m_start[3];
+    int m_extent[3];
+    int m_pad[3];
+    int m_box[3];
+    int m_box_strides[3];
+    int m_strides[Lattice::num_neighbors];
+
+    //the runs forEachRow() visits, indexed by CellRegion, so loops over rows can be split between threads
+    std::vector<std::pair<int, int>> m_rows[3];
+    //the runs of the halo ring k + 1 layers out for every ring but the last, clipped at open boundaries
+    std::vector<std::vector<std::pair<int, int>>> m_halo_rows;
+    //the cells of m_rows and m_halo_rows with neighbors past an open boundary, each with the mask of the
+    //neighbors k that are inside the global box
+    std::vector<std::pair<int, uint32_t>> m_open_cells[3];
+    std::vector<std::vector<std::pair<int, uint32_t>>> m_halo_open_cells;
+};
+
+//Allocates the padded block of this rank and wires the halo exchange. Collective, every rank must set the
+//same m_halo_width beforehand.
+template <typename T, typename Lattice, typename Packer>
+void LatticeProcessNode<T, Lattice, Packer>::build(const int global_dims[3], const int rank_dims[3], const bool periodic[3]){
+    //field by field so an m_order set by the caller is kept, the blocks of m_rank_dims take no curve splits
+    for(int d = 0; d < 3; d++){
+        m_decomp.m_dims[d] = global_dims[d];
+        m_decomp.m_rank_dims[d] = rank_dims[d];
+        m_decomp.m_periodic[d] = periodic[d];
+    }
+    m_decomp.m_lattice = LatticeType::SimpleCubic;
+    m_decomp.m_curve_splits.clear();
+    layoutBlock();
+    this->m_values.assign(this->m_num_data_nodes, T());
+
+    //every rank lists the halo cells of a block in that block's index order, so pack and unpack orders agree
+    this->m_pack_map.clear();
+    this->m_unpack_map.clear();
+    forEachHaloCell(upcxx::rank_me(), [&](int owner, int index, const int*){
+        this->m_unpack_map[owner].push_back(index);
+    });
+    for(auto& pair : this->m_unpack_map){
+        int rank = pair.first;
+        forEachHaloCell(rank, [&](int owner, int, const int q[3]){
+            if(owner == upcxx::rank_me()) this->m_pack_map[rank].push_back(localIndex(q));
+        });
+    }
+
+    this->allocatePackedData();
+    this->bcastGPTRs();
+    upcxx::barrier();
+}
+
+//The padded block of this rank and its rows, computed from m_decomp and m_halo_width alone.
+template <typename T, typename Lattice, typename Packer> void LatticeProcessNode<T, Lattice, Packer>::layoutBlock(){
+    int end[3];
+    m_decomp.rankBlock(upcxx::rank_me(), m_start, end);
+    for(int d = 0; d < 3; d++){
+        m_extent[d] = end[d] - m_start[d];
+        m_pad[d] = d < dims ? std::max(1, this->m_halo_width) : 0;
+        m_box[d] = m_extent[d] + 2*m_pad[d];
+    }
+    m_box_strides[2] = 1;
+    m_box_strides[1] = m_box[2];
+    m_box_strides[0] = m_box[1]*m_box[2];
+    for(int k = 0; k < num_neighbors; k++){
+        m_strides[k] = 0;
+        for(int d = 0; d < 3; d++) m_strides[k] += Lattice::offsets[k][d]*m_box_strides[d];
+    }
+
+    this->m_layout = CellLayout::Dense;
+    this->m_num_data_nodes = (size_t)m_box[0]*m_box[1]*m_box[2];
+
+    for(int region = 0; region < 3; region++){
+        m_rows[region].clear();
+        forEachRow((CellRegion)region, [&](int begin, int length){
+            m_rows[region].push_back(std::make_pair(begin, length));
+        });
+    }
+    m_halo_rows.assign(m_pad[0] - 1, std::vector<std::pair<int, int>>());
+    for(int ring = 1; ring < m_pad[0]; ring++) appendRingRows(m_halo_rows[ring - 1], ring);
+
+    for(int region = 0; region < 3; region++){
+        m_open_cells[region].clear();
+        appendOpenCells(m_rows[region], m_open_cells[region]);
+    }
+    m_halo_open_cells.assign(m_halo_rows.size(), std::vector<std::pair<int, uint32_t>>());
+    for(size_t ring = 0; ring < m_halo_rows.size(); ring++) appendOpenCells(m_halo_rows[ring], m_halo_open_cells[ring]);
+}
+
+//Like ProcessNode::checkpoint(), with m_decomp stored so restore() can lay out the block again.
+template <typename T, typename Lattice, typename Packer>
+bool LatticeProcessNode<T, Lattice, Packer>::checkpoint(const std::string& path) const {
+    std::vector<int32_t> geometry;
+    for(int d = 0; d < 3; d++){
+        geometry.push_back(m_decomp.m_dims[d]);
+        geometry.push_back(m_decomp.m_rank_dims[d]);
+        geometry.push_back(m_decomp.m_periodic[d]);
+    }
+    geometry.push_back((int32_t)m_decomp.m_lattice);
+    return this->writeCheckpoint(path, geometry);
+}
+
+//Collective, see ProcessNode::restore(). Only the rows and strides are recomputed, the halo lists come from the file.
+template <typename T, typename Lattice, typename Packer>
+bool LatticeProcessNode<T, Lattice, Packer>::restore(const std::string& path){
+    this->clearExchangePlan();
+    std::vector<int32_t> geometry;
+    bool ok = this->readCheckpoint(path, geometry) && geometry.size() == 10 && this->m_layout == CellLayout::Dense;
+    if(upcxx::reduce_all(ok ? 0 : 1, upcxx::op_fast_add).wait() != 0) return false;
+    for(int d = 0; d < 3; d++){
+        m_decomp.m_dims[d] = geometry[3*d];
+        m_decomp.m_rank_dims[d] = geometry[3*d + 1];
+        m_decomp.m_periodic[d] = geometry[3*d + 2] != 0;
+    }
+    m_decomp.m_lattice = (LatticeType)geometry[9];
+    layoutBlock();
+    this->rewire(this->m_exchange_mode, this->m_plan_compiled);
+    return true;
+}
+
+//Replaces the direct halo exchange with a schedule of one phase per dimension, in which every rank trades a
+//face with each of its two face neighbors. A face includes the halo layers filled by the earlier phases, so
+//edge and corner cells are forwarded through the faces and a rank sends at most 2*dims messages, however
+//many of the 26 surrounding blocks its lattice reaches. With deep halos a face is m_halo_width layers thick
+//and comes from the face neighbor alone, so every block must be at least that thick. Collective.
+template <typename T, typename Lattice, typename Packer>
+void LatticeProcessNode<T, Lattice, Packer>::compileSweep(){
+    this->m_schedule.assign(dims, ExchangePhase());
+    for(int d = 0; d < dims; d++){
+        ExchangePhase& phase = this->m_schedule[d];
+        //our face on the low side lands in the high halo layers of the neighbor below and vice versa, and both
+        //sides list the two faces in the same order for when both neighbors are the same rank
+        for(int direction = -1; direction <= 1; direction += 2){
+            int neighbor = faceNeighbor(d, direction);
+            if(neighbor < 0) continue;
+            int first = direction < 0 ? m_pad[d] : m_extent[d];
+            for(int layer = first; layer < first + m_pad[d]; layer++) appendSlab(phase.m_pack_map[neighbor], d, layer);
+        }
+        for(int direction = 1; direction >= -1; direction -= 2){
+            int neighbor = faceNeighbor(d, direction);
+            if(neighbor < 0) continue;
+            int first = direction > 0 ? m_pad[d] + m_extent[d] : 0;
+            for(int layer = first; layer < first + m_pad[d]; layer++) appendSlab(phase.m_unpack_map[neighbor], d, layer);
+        }
+    }
+    this->compileSchedule();
+}
+
+//the rank whose block touches ours on the given side of dimension d, or -1 past an open boundary
+template <typename T, typename Lattice, typename Packer>
+int LatticeProcessNode<T, Lattice, Packer>::faceNeighbor(int d, int direction) const {
+    const int* rank_dims = m_decomp.m_rank_dims;
+    int rank = upcxx::rank_me();
+    int r[3] = {rank / (rank_dims[1]*rank_dims[2]), (rank / rank_dims[2]) % rank_dims[1], rank % rank_dims[2]};
+    r[d] += direction;
+    if(r[d] < 0 || r[d] >= rank_dims[d]){
+        if(!m_decomp.m_periodic[d]) return -1;
+        r[d] = (r[d] + rank_dims[d]) % rank_dims[d];
+    }
+    return r[2] + r[1]*rank_dims[2] + r[0]*rank_dims[1]*rank_dims[2];
+}
+
+//Appends the cells with coordinate layer in dimension d, spanning the halo in the dimensions before d and
+//only the owned cells in the ones after it, in index order. The halo past an open boundary is left out, as in
+//the direct plan. Face neighbors share the extents of every other dimension, so both ends of a phase produce
+//matching lists.
+template <typename T, typename Lattice, typename Packer>
+void LatticeProcessNode<T, Lattice, Packer>::appendSlab(std::vector<int>& cells, int d, int layer) const {
+    int begin[3], end[3];
+    for(int e = 0; e < 3; e++){
+        begin[e] = e < d ? 0 : m_pad[e];
+        end[e] = e < d ? m_box[e] : m_pad[e] + m_extent[e];
+        if(e >= d || m_decomp.m_periodic[e]) continue;
+        int low = m_pad[e] - m_start[e];
+        begin[e] = std::max(begin[e], low);
+        end[e] = std::min(end[e], low + m_decomp.m_dims[e]);
+    }
+    begin[d] = layer;
+    end[d] = layer + 1;
+    for(int x = begin[0]; x < end[0]; x++){
+        for(int y = begin[1]; y < end[1]; y++){
+            for(int z = begin[2]; z < end[2]; z++){
+                cells.push_back(x*m_box_strides[0] + y*m_box_strides[1] + z*m_box_strides[2]);
+            }
+        }
+    }
+}
+
+//Calls f(owner, index, global_coords) for every halo cell of rank's block within m_halo_width hops of one of
+//its owned cells, skipping cells past open boundaries. index is the cell's position in that rank's padded
+//block.
+template <typename T, typename Lattice, typename Packer> template <typename F>
+void LatticeProcessNode<T, Lattice, Packer>::forEachHaloCell(int rank, F f) const {
+    int start[3], end[3], box[3], box_strides[3];
+    m_decomp.rankBlock(rank, start, end);
+    for(int d = 0; d < 3; d++) box[d] = end[d] - start[d] + 2*m_pad[d];
+    box_strides[2] = 1;
+    box_strides[1] = box[2];
+    box_strides[0] = box[1]*box[2];
+    auto owned = [&](const int c[3]){
+        for(int d = 0; d < 3; d++){
+            if(c[d] < m_pad[d] || c[d] >= box[d] - m_pad[d]) return false;
+        }
+        return true;
+    };
+    auto real = [&](const int c[3]){
+        for(int d = 0; d < 3; d++){
+            int q = start[d] + c[d] - m_pad[d];
+            if(!m_decomp.m_periodic[d] && (q < 0 || q >= m_decomp.m_dims[d])) return false;
+        }
+        return true;
+    };
+
+    //Walks the halo in index order. Only rows on the outside of the block are walked in full, the others
+    //contribute the cells past their two ends.
+    const int r = dims - 1;
+    auto walk_halo = [&](auto visit){
+        int c[3] = {0, 0, 0};
+        int outer_n[2] = {r > 0 ? box[0] : 1, r > 1 ? box[1] : 1};
+        for(int a = 0; a < outer_n[0]; a++){
+            for(int b = 0; b < outer_n[1]; b++){
+                if(r > 0) c[0] = a;
+                if(r > 1) c[1] = b;
+                bool outer_halo = false;
+                for(int d = 0; d < r; d++){
+                    if(c[d] < m_pad[d] || c[d] >= box[d] - m_pad[d]) outer_halo = true;
+                }
+                for(c[r] = 0; c[r] < box[r]; c[r] = (outer_halo || c[r] + 1 != m_pad[r]) ? c[r] + 1 : box[r] - m_pad[r]){
+                    visit(c);
+                }
+            }
+        }
+    };
+
+    //hop distances of the halo cells from the block. A path out of the block leaves it from a cell the
+    //halo's first layer touches, so the search starts from those cells.
+    const unsigned char unreached = 255;
+    std::vector<unsigned char> hops((size_t)box[0]*box[1]*box[2], unreached);
+    std::vector<int> frontier, next_frontier;
+    walk_halo([&](const int c[3]){
+        int index = c[0]*box_strides[0] + c[1]*box_strides[1] + c[2]*box_strides[2];
+        bool first_layer = false;
+        for(int k = 0; k < num_neighbors && !first_layer; k++){
+            int from[3];
+            for(int d = 0; d < 3; d++) from[d] = c[d] - Lattice::offsets[k][d];
+            first_layer = owned(from);
+        }
+        if(!first_layer || !real(c)) return;
+        hops[index] = 1;
+        frontier.push_back(index);
+    });
+    for(int hop = 2; hop <= m_pad[0] && hop < unreached; hop++){
+        next_frontier.clear();
+        for(int index : frontier){
+            int c[3];
+            for(int d = 0; d < 3; d++) c[d] = (index / box_strides[d]) % box[d];
+            for(int k = 0; k < num_neighbors; k++){
+                int to[3];
+                bool in_box = true;
+                for(int d = 0; d < 3; d++){
+                    to[d] = c[d] + Lattice::offsets[k][d];
+                    if(to[d] < 0 || to[d] >= box[d]) in_box = false;
+                }
+                if(!in_box || owned(to) || !real(to)) continue;
+                int to_index = to[0]*box_strides[0] + to[1]*box_strides[1] + to[2]*box_strides[2];
+                if(hops[to_index] != unreached) continue;
+                hops[to_index] = hop;
+                next_frontier.push_back(to_index);
+            }
+        }
+        frontier.swap(next_frontier);
+    }
+
+    walk_halo([&](const int c[3]){
+        int index = c[0]*box_strides[0] + c[1]*box_strides[1] + c[2]*box_strides[2];
+        if(hops[index] == unreached) return;
+        int q[3];
+        for(int d = 0; d < 3; d++) q[d] = start[d] + c[d] - m_pad[d];
+        m_decomp.wrap(q);
+        f(m_decomp.rankOwner(q), index, q);
+    });
+}
+
+//Appends the rows of the cells exactly ring layers outside the owned block in index order, leaving out the
+//cells past open boundaries.
+template <typename T, typename Lattice, typename Packer>
+void LatticeProcessNode<T, Lattice, Packer>::appendRingRows(std::vector<std::pair<int, int>>& rows, int ring) const {
+    int begin[3], end[3], inner_begin[3], inner_end[3];
+    for(int d = 0; d < 3; d++){
+        int grow = d < dims ? ring : 0;
+        int inner_grow = std::max(0, grow - 1);
+        begin[d] = m_pad[d] - grow;
+        end[d] = m_pad[d] + m_extent[d] + grow;
+        inner_begin[d] = m_pad[d] - inner_grow;
+        inner_end[d] = m_pad[d] + m_extent[d] + inner_grow;
+        if(m_decomp.m_periodic[d]) continue;
+        int low = m_pad[d] - m_start[d];
+        int high = low + m_decomp.m_dims[d];
+        begin[d] = std::max(begin[d], low);
+        end[d] = std::min(end[d], high);
+        inner_begin[d] = std::max(inner_begin[d], low);
+        inner_end[d] = std::min(inner_end[d], high);
+    }
+    const int r = dims - 1;
+    int outer_begin[2], outer_end[2];
+    for(int d = 0; d < 2; d++){
+        outer_begin[d] = d < r ? begin[d] : 0;
+        outer_end[d] = d < r ? end[d] : 1;
+    }
+    for(int a = outer_begin[0]; a < outer_end[0]; a++){
+        for(int b = outer_begin[1]; b < outer_end[1]; b++){
+            int base = (r > 0 ? a*m_box_strides[0] : 0) + (r > 1 ? b*m_box_strides[1] : 0);
+            bool inner = (r < 1 || (a >= inner_begin[0] && a < inner_end[0])) &&
+                         (r < 2 || (b >= inner_begin[1] && b < inner_end[1]));
+            if(!inner){
+                rows.push_back(std::make_pair(base + begin[r], end[r] - begin[r]));
+                continue;
+            }
+            if(inner_begin[r] > begin[r]) rows.push_back(std::make_pair(base + begin[r], inner_begin[r] - begin[r]));
+            if(end[r] > inner_end[r]) rows.push_back(std::make_pair(base + inner_end[r], end[r] - inner_end[r]));
+        }
+    }
+}
+
+//Appends every cell of rows that has a neighbor past an open boundary, with the mask of its neighbors inside
+//the global box.
+template <typename T, typename Lattice, typename Packer>
+void LatticeProcessNode<T, Lattice, Packer>::appendOpenCells(const std::vector<std::pair<int, int>>& rows,
+                                                             std::vector<std::pair<int, uint32_t>>& cells) const {
+    static_assert(num_neighbors <= 32, "neighbor masks are 32 bits");
+    const uint32_t all = num_neighbors == 32 ? ~0u : (1u << num_neighbors) - 1;
+    for(const std::pair<int, int>& row : rows){
+        for(int i = row.first; i < row.first + row.second; i++){
+            int p[3];
+            globalCoords(i, p);
+            uint32_t mask = all;
+            for(int k = 0; k < num_neighbors; k++){
+                for(int d = 0; d < dims; d++){
+                    int q = p[d] + Lattice::offsets[k][d];
+                    if(!m_decomp.m_periodic[d] && (q < 0 || q >= m_decomp.m_dims[d])) mask &= ~(1u << k);
+                }
+            }
+            if(mask != all) cells.push_back(std::make_pair(i, mask));
+        }
+    }
+}
+
+template <typename T, typename Lattice, typename Packer>
+inline bool LatticeProcessNode<T, Lattice, Packer>::isGhost(int i) const {
+    for(int d = 0; d < dims; d++){
+        int c = (i / m_box_strides[d]) % m_box[d];
+        if(c < m_pad[d] || c >= m_pad[d] + m_extent[d]) return true;
+    }
+    return false;
+}
+
+//global coordinates of cell i, halo cells across a periodic boundary are not wrapped back into the box
+template <typename T, typename Lattice, typename Packer>
+inline void LatticeProcessNode<T, Lattice, Packer>::globalCoords(int i, int p[3]) const {
+    for(int d = 0; d < 3; d++) p[d] = m_start[d] + (i / m_box_strides[d]) % m_box[d] - m_pad[d];
+}
+
+//index of the owned cell at global coordinates p, or -1 if this rank does not own it
+template <typename T, typename Lattice, typename Packer>
+inline int LatticeProcessNode<T, Lattice, Packer>::localIndex(const int p[3]) const {
+    int index = 0;
+    for(int d = 0; d < 3; d++){
+        int c = p[d] - m_start[d];
+        if(c < 0 || c >= m_extent[d]) return -1;
+        index += (c + m_pad[d])*m_box_strides[d];
+    }
+    return index;
+}
+
+//Calls f(begin, length) for every contiguous run of cells in region. Interior cells only read owned cells,
+//so they can be updated while a split-phase exchange is in flight, and Boundary is the rest of Owned.
+template <typename T, typename Lattice, typename Packer> template <typename F>
+void LatticeProcessNode<T, Lattice, Packer>::forEachRow(CellRegion region, F f) const {
+    const int r = dims - 1;
+    int outer_begin[2], outer_end[2];
+    for(int d = 0; d < 2; d++){
+        outer_begin[d] = d < r ? m_pad[d] : 0;
+        outer_end[d] = d < r ? m_pad[d] + m_extent[d] : 1;
+    }
+    int row_begin = m_pad[r];
+    int row_length = m_extent[r];
+    for(int a = outer_begin[0]; a < outer_end[0]; a++){
+        for(int b = outer_begin[1]; b < outer_end[1]; b++){
+            int base = a*m_box_strides[0] + b*m_box_strides[1] + row_begin;
+            bool outer_face = (r > 0 && (a == outer_begin[0] || a == outer_end[0] - 1)) ||
+                              (r > 1 && (b == outer_begin[1] || b == outer_end[1] - 1));
+            if(region == CellRegion::Owned){
+                f(base, row_length);
+            } else if(region == CellRegion::Interior){
+                if(!outer_face && row_length > 2) f(base + 1, row_length - 2);
+            } else if(outer_face){
+                f(base, row_length);
+            } else {
+                f(base, 1);
+                if(row_length > 1) f(base + row_length - 1, 1);
+            }
+        }
+    }
+}
+
+//Instruction sets applyStencil() can use.
+enum class SimdLevel { Scalar, AVX2, AVX512 };
+
+//The widest instruction set the running CPU supports, checked once.
+inline SimdLevel detectSimdLevel(){
+#ifdef UNICUBE_X86_SIMD
+    static const SimdLevel level = __builtin_cpu_supports("avx512f") ? SimdLevel::AVX512 :
+                                   (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) ? SimdLevel::AVX2 :
+                                   SimdLevel::Scalar;
+    return level;
+#else
+    return SimdLevel::Scalar;
+#endif
+}
+
+//A linear stencil, out(i) = (m_center + m_degree*deg(i))*u(i) + m_neighbor*(sum of u over i's neighbors).
+//Diffusion with rate D is {1, D, -D}.
+template <typename T> struct StencilCoeffs {
+    T m_center;
+    T m_neighbor;
+    T m_degree;
+};
+
+//Scalar and generic vector kernels. The vector kernels use GCC vector extensions rather than intrinsics and
+//are inlined into the target-specific wrappers below, so the same source compiles to AVX2 or AVX-512.
+//The ELLPACK kernels run over the block's cells [begin, end), which must be multiples of EllBlock::padding.
+template <typename T> void ellStencilScalar(const StencilCoeffs<T>& coeffs, const EllBlock& block, size_t begin, size_t end,
+                                            const T* u, T* out){
+    size_t n = block.m_cells.size();
+    T base = coeffs.m_center - coeffs.m_neighbor*block.m_width;
+    T slope = coeffs.m_degree + coeffs.m_neighbor;
+    for(size_t c = begin; c < end; c++){
+        int32_t i = block.m_cells[c];
+        T sum = T();
+        for(int k = 0; k < block.m_width; k++) sum += u[block.m_indices[k*n + c]];
+        //the padded neighbors are the cell itself, which the self weight takes back out
+        out[i] = (base + slope*(T)block.m_degrees[c])*u[i] + coeffs.m_neighbor*sum;
+    }
+}
+
+//N is the lattice's neighbor count, known at compile time so the neighbor loop unrolls.
+template <typename T, int N> void rowStencilScalar(const StencilCoeffs<T>& coeffs, const int* strides,
+                                                   const T* u, T* out, int begin, int end){
+    T self = coeffs.m_center + coeffs.m_degree*N;
+    for(int i = begin; i < end; i++){
+        T sum = T();
+        for(int k = 0; k < N; k++) sum += u[i + strides[k]];
+        out[i] = self*u[i] + coeffs.m_neighbor*sum;
+    }
+}
+
+#ifdef UNICUBE_X86_SIMD
+template <typename T, int W> __attribute__((always_inline)) inline
+void ellStencilVector(const StencilCoeffs<T>& coeffs, const EllBlock& block, size_t begin, size_t end,
+                      const T* u, T* out){
+    typedef T vec __attribute__((vector_size(W*sizeof(T))));
+    typedef int32_t ivec __attribute__((vector_size(W*sizeof(int32_t))));
+    size_t n = block.m_cells.size();
+    T base = coeffs.m_center - coeffs.m_neighbor*block.m_width;
+    T slope = coeffs.m_degree + coeffs.m_neighbor;
+    for(size_t c = begin; c < end; c += W){
+        const int32_t* cells = block.m_cells.data() + c;
+        vec sum = {};
+        for(int k = 0; k < block.m_width; k++){
+            const int32_t* idx = block.m_indices.data() + k*n + c;
+            vec x = {};
+            for(int l = 0; l < W; l++) x[l] = u[idx[l]];
+            sum += x;
+        }
+        vec self = {};
+        ivec degrees;
+        for(int l = 0; l < W; l++) self[l] = u[cells[l]];
+        std::memcpy(&degrees, block.m_degrees.data() + c, sizeof(ivec));
+        vec result = (base + slope*__builtin_convertvector(degrees, vec))*self + coeffs.m_neighbor*sum;
+        for(int l = 0; l < W; l++) out[cells[l]] = result[l];
+    }
+}
+
+template <typename T, int N, int W> __attribute__((always_inline)) inline
+void rowStencilVector(const StencilCoeffs<T>& coeffs, const int* strides, const T* u, T* out, int begin, int end){
+    typedef T vec __attribute__((vector_size(W*sizeof(T))));
+    T self = coeffs.m_center + coeffs.m_degree*N;
+    int i = begin;
+    for(; i + W <= end; i += W){
+        vec sum = {};
+        for(int k = 0; k < N; k++){
+            vec x;
+            std::memcpy(&x, u + i + strides[k], sizeof(vec));
+            sum += x;
+        }
+        vec center;
+        std::memcpy(&center, u + i, sizeof(vec));
+        vec result = self*center + coeffs.m_neighbor*sum;
+        std::memcpy(out + i, &result, sizeof(vec));
+    }
+    rowStencilScalar<T, N>(coeffs, strides, u, out, i, end);
+}
+
+template <typename T> __attribute__((target("avx2,fma")))
+void ellStencilAVX2(const StencilCoeffs<T>& coeffs, const EllBlock& block, size_t begin, size_t end,
+                    const T* u, T* out){
+    ellStencilVector<T, 32/sizeof(T)>(coeffs, block, begin, end, u, out);
+}
+
+template <typename T> __attribute__((target("avx512f")))
+void ellStencilAVX512(const StencilCoeffs<T>& coeffs, const EllBlock& block, size_t begin, size_t end,
+                      const T* u, T* out){
+    ellStencilVector<T, 64/sizeof(T)>(coeffs, block, begin, end, u, out);
+}
+
+template <typename T, int N> __attribute__((target("avx2,fma")))
+void rowStencilAVX2(const StencilCoeffs<T>& coeffs, const int* strides, const T* u, T* out, int begin, int end){
+    rowStencilVector<T, N, 32/sizeof(T)>(coeffs, strides, u, out, begin, end);
+}
+
+template <typename T, int N> __attribute__((target("avx512f")))
+void rowStencilAVX512(const StencilCoeffs<T>& coeffs, const int* strides, const T* u, T* out, int begin, int end){
+    rowStencilVector<T, N, 64/sizeof(T)>(coeffs, strides, u, out, begin, end);
+}
+#endif
+
+template <typename T> void ellStencil(const StencilCoeffs<T>& coeffs, const EllBlock& block, size_t begin, size_t end,
+                                      const T* u, T* out, SimdLevel level){
+#ifdef UNICUBE_X86_SIMD
+    if constexpr(std::is_same<T, float>::value || std::is_same<T, double>::value){
+        if(level == SimdLevel::AVX512) return ellStencilAVX512(coeffs, block, begin, end, u, out);
+        if(level == SimdLevel::AVX2) return ellStencilAVX2(coeffs, block, begin, end, u, out);
+    }
+#endif
+    ellStencilScalar(coeffs, block, begin, end, u, out);
+}
+
+template <typename T, int N> void rowStencil(const StencilCoeffs<T>& coeffs, const int* strides,
+                                             const T* u, T* out, int begin, int end, SimdLevel level){
+#ifdef UNICUBE_X86_SIMD
+    if constexpr(std::is_same<T, float>::value || std::is_same<T, double>::value){
+        if(level == SimdLevel::AVX512) return rowStencilAVX512<T, N>(coeffs, strides, u, out, begin, end);
+        if(level == SimdLevel::AVX2) return rowStencilAVX2<T, N>(coeffs, strides, u, out, begin, end);
+    }
+#endif
+    rowStencilScalar<T, N>(coeffs, strides, u, out, begin, end);
+}
+
+//cells handed to a pool thread at a time by applyStencil(), a multiple of EllBlock::padding
+const size_t stencil_grain = 2048;
+
+//Applies coeffs to region of proc_node's current() state and writes the result into next(), see
+//allocateBuffers(). Needs the CSR layout and classifyCells(), the cells are compiled into ELLPACK form on
+//first use. Unless region is Interior the first halo_layers ghost layers are updated as well, which with
+//m_halo_width = k lets step s after an exchange run with halo_layers = k - 1 - s. level defaults to the
+//best the CPU supports and is only used for float and double payloads.
+template <typename T, typename Packer>
+void applyStencil(const StencilCoeffs<T>& coeffs, ProcessNode<T, Packer>& proc_node,
+                  CellRegion region = CellRegion::Owned, int halo_layers = 0, SimdLevel level = detectSimdLevel()){
+    if(!proc_node.m_stencil_compiled) proc_node.compileStencil();
+    const T* u = proc_node.current();
+    T* out = proc_node.next();
+    int num_blocks = std::min<int>(proc_node.m_stencil_blocks.size(), 2 + std::max(0, halo_layers));
+    for(int b = 0; b < num_blocks; b++){
+        if(region == (b == 0 ? CellRegion::Boundary : CellRegion::Interior)) continue;
+        const EllBlock& block = proc_node.m_stencil_blocks[b];
+        parallelFor(proc_node.m_thread_pool, 0, block.m_cells.size(), stencil_grain, [&](size_t begin, size_t end){
+            ellStencil(coeffs, block, begin, end, u, out, level);
+        });
+    }
+}
+
+//The structured version, where every row of region is a run of fixed-offset loads. halo_layers counts
+//rings of the padded block here, which may include a few cells no owned cell depends on. The rows use the full
+//degree, so the cells next to an open boundary are computed again afterwards with their true degree.
+template <typename T, typename Lattice, typename Packer>
+void applyStencil(const StencilCoeffs<T>& coeffs, LatticeProcessNode<T, Lattice, Packer>& proc_node,
+                  CellRegion region = CellRegion::Owned, int halo_layers = 0, SimdLevel level = detectSimdLevel()){
+    const T* u = proc_node.current();
+    T* out = proc_node.next();
+    size_t row_grain = std::max<size_t>(1, stencil_grain / std::max(1, proc_node.m_extent[Lattice::dims - 1]));
+    auto apply_rows = [&](const std::vector<std::pair<int, int>>& rows){
+        parallelFor(proc_node.m_thread_pool, 0, rows.size(), row_grain, [&](size_t begin, size_t end){
+            for(size_t r = begin; r < end; r++){
+                int row_begin = rows[r].first;
+                rowStencil<T, Lattice::num_neighbors>(coeffs, proc_node.m_strides, u, out, row_begin, row_begin + rows[r].second, level);
+            }
+        });
+    };
+    auto apply_open = [&](const std::vector<std::pair<int, uint32_t>>& cells){
+        parallelFor(proc_node.m_thread_pool, 0, cells.size(), stencil_grain, [&](size_t begin, size_t end){
+            for(size_t c = begin; c < end; c++){
+                int i = cells[c].first;
+                uint32_t mask = cells[c].second;
+                T sum = T();
+                int degree = 0;
+                for(int k = 0; k < Lattice::num_neighbors; k++){
+                    if(!(mask & (1u << k))) continue;
+                    sum += u[i + proc_node.m_strides[k]];
+                    degree++;
+                }
+                out[i] = (coeffs.m_center + coeffs.m_degree*(T)degree)*u[i] + coeffs.m_neighbor*sum;
+            }
+        });
+    };
+    apply_rows(proc_node.m_rows[(int)region]);
+    apply_open(proc_node.m_open_cells[(int)region]);
+    if(region == CellRegion::Interior) return;
+    int num_rings = std::min<int>(proc_node.m_halo_rows.size(), halo_layers);
+    for(int ring = 0; ring < num_rings; ring++){
+        apply_rows(proc_node.m_halo_rows[ring]);
+        apply_open(proc_node.m_halo_open_cells[ring]);
+    }
+}
+
+//Binary snapshot files written by SnapshotWriter, read by tools/snapshot.py. A file starts with this header,
+//then m_file_ranks pairs of uint64 (first cell, cell count) placing each rank's cells within a frame, then
+//the int64 global id of every cell and then one frame per snapshot: the int64 step followed by m_num_cells
+//packed values. Every frame has the same size, so frame f starts at a fixed offset and a file cut short by a
+//crash is still readable up to its last whole frame. All fields are in the writer's byte order.
+struct SnapshotHeader {
+    char m_magic[8];
+    uint32_t m_version;
+    uint32_t m_value_bytes;
+    //0 for values the reader has to interpret itself, then float, double, int32_t and int64_t
+    uint32_t m_value_type;
+    int32_t m_global_dims[3];
+    int32_t m_rank_dims[3];
+    int32_t m_num_ranks;
+    int32_t m_first_rank;
+    int32_t m_file_ranks;
+    int32_t m_every;
+    int32_t m_reserved;
+    uint64_t m_num_cells;
+};
+static_assert(sizeof(SnapshotHeader) == 72, "SnapshotHeader must keep its on-disk layout");
+
+static constexpr char snapshot_magic[8] = {'U', 'C', 'S', 'N', 'A', 'P', '\0', '\0'};
+static constexpr uint32_t snapshot_version = 1;
+
+template <typename P> constexpr uint32_t snapshotValueType(){
+    return std::is_same<P, float>::value ? 1 : std::is_same<P, double>::value ? 2 :
+           std::is_same<P, int32_t>::value ? 3 : std::is_same<P, int64_t>::value ? 4 : 0;
+}
+
+//PerRank writes <path>.<rank> for every rank, Shared writes a single file at path that every rank fills in
+//place with pwrite().
+enum class SnapshotMode { PerRank, Shared };
+
+//Writes the owned cells of a ProcessNode every m_every steps, packed with its Packer so only the exchanged
+//part of a cell is stored. write() packs into one of two staging buffers and returns, a background thread
+//does the I/O, so compute only waits when both buffers are still being written. Ghost cells are not written.
+//Every rank has to call write() with the same steps. The background thread does not call UPC++.
+template <typename T, typename Packer = PackTraits<T>> class SnapshotWriter {
+    public:
+    typedef typename Packer::packed_type packed_type;
+    static_assert(std::is_trivially_copyable<packed_type>::value, "snapshots store packed values as raw bytes");
+
+    ~SnapshotWriter();
+
+    //Collective. global_dims and rank_dims only describe the run to readers and may be NULL. Returns false
+    //if the file could not be created on any rank.
+    bool open(ProcessNode<T, Packer>& proc_node, const std::string& path, int every, SnapshotMode mode = SnapshotMode::PerRank,
+              const int global_dims[3] = NULL, const int rank_dims[3] = NULL);
+    template <typename Lattice>
+    bool open(LatticeProcessNode<T, Lattice, Packer>& proc_node, const std::string& path, int every,
+              SnapshotMode mode = SnapshotMode::PerRank);
+    void write(ProcessNode<T, Packer>& proc_node, long long step);
+    //waits for the frames in flight
+    void flush();
+    //flushes and closes the file, false if any write failed
+    bool close();
+
+    private:
+    bool openCells(const std::string& path, int every, SnapshotMode mode, const int global_dims[3], const int rank_dims[3]);
+    void writeLoop();
+    void writeFrame(int slot);
+    void writeAll(const void* data, size_t bytes, off_t offset);
+
+    public:
+    int m_every = 1;
+    //local index and global id of every cell written, ids default to the cell's position in the frame
+    std::vector<int> m_cells;
+    std::vector<long long> m_ids;
+
+    private:
+    int m_fd = -1;
+    bool m_writes_step = false;
+    uint64_t m_cell_offset = 0;
+    size_t m_frame_bytes = 0;
+    off_t m_data_offset = 0;
+    long long m_num_frames = 0;
+    int m_next_slot = 0;
+    std::atomic<bool> m_failed{false};
+
+    std::vector<packed_type> m_staging[2];
+    long long m_steps[2];
+    long long m_frames[2];
+    bool m_queued[2] = {false, false};
+    bool m_stop = false;
+    std::mutex m_mutex;
+    std::condition_variable m_work;
+    std::condition_variable m_idle;
+    std::thread m_thread;
+};
+
+template <typename T, typename Packer> SnapshotWriter<T, Packer>::~SnapshotWriter(){
+    close();
+}
+
+template <typename T, typename Packer>
+bool SnapshotWriter<T, Packer>::open(ProcessNode<T, Packer>& proc_node, const std::string& path, int every, SnapshotMode mode,
+                                     const int global_dims[3], const int rank_dims[3]){
+    m_cells.clear();
+    m_ids.clear();
+    for(size_t i = 0; i < proc_node.m_num_data_nodes; i++){
+        if(proc_node.isGhost(i)) continue;
+        m_cells.push_back(i);
+        if(!proc_node.m_global_ids.empty()) m_ids.push_back(proc_node.m_global_ids[i]);
+    }
+    return openCells(path, every, mode, global_dims, rank_dims);
+}
+
+template <typename T, typename Packer> template <typename Lattice>
+bool SnapshotWriter<T, Packer>::open(LatticeProcessNode<T, Lattice, Packer>& proc_node, const std::string& path, int every,
+                                     SnapshotMode mode){
+    m_cells.clear();
+    m_ids.clear();
+    for(const std::pair<int, int>& row : proc_node.m_rows[(int)CellRegion::Owned]){
+        for(int i = row.first; i < row.first + row.second; i++){
+            int p[3];
+            proc_node.globalCoords(i, p);
+            m_cells.push_back(i);
+            m_ids.push_back(proc_node.m_decomp.globalIndex(p));
+        }
+    }
+    return openCells(path, every, mode, proc_node.m_decomp.m_dims, proc_node.m_decomp.m_rank_dims);
+}
+
+//Lays out the file, writes the header, rank table and ids and starts the background thread.
+template <typename T, typename Packer>
+bool SnapshotWriter<T, Packer>::openCells(const std::string& path, int every, SnapshotMode mode,
+                                          const int global_dims[3], const int rank_dims[3]){
+    close();
+    m_failed = false;
+    m_every = std::max(1, every);
+    m_num_frames = 0;
+    m_next_slot = 0;
+    bool shared = mode == SnapshotMode::Shared;
+
+    //a shared file places the ranks one after another, which needs everyone's cell count
+    int num_file_ranks = shared ? upcxx::rank_n() : 1;
+    std::vector<uint64_t> counts(num_file_ranks, 0);
+    counts[shared ? upcxx::rank_me() : 0] = m_cells.size();
+    if(shared) upcxx::reduce_all(counts.data(), counts.data(), counts.size(), upcxx::op_fast_add).wait();
+    std::vector<uint64_t> table;
+    uint64_t num_cells = 0;
+    for(int r = 0; r < num_file_ranks; r++){
+        if(!shared || r == upcxx::rank_me()) m_cell_offset = num_cells;
+        table.push_back(num_cells);
+        table.push_back(counts[r]);
+        num_cells += counts[r];
+    }
+    if(m_ids.size() != m_cells.size()){
+        m_ids.resize(m_cells.size());
+        for(size_t k = 0; k < m_cells.size(); k++) m_ids[k] = m_cell_offset + k;
+    }
+
+    SnapshotHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.m_magic, snapshot_magic, sizeof(header.m_magic));
+    header.m_version = snapshot_version;
+    header.m_value_bytes = sizeof(packed_type);
+    header.m_value_type = snapshotValueType<packed_type>();
+    for(int d = 0; d < 3; d++){
+        header.m_global_dims[d] = global_dims ? global_dims[d] : 0;
+        header.m_rank_dims[d] = rank_dims ? rank_dims[d] : 0;
+    }
+    header.m_num_ranks = upcxx::rank_n();
+    header.m_first_rank = shared ? 0 : upcxx::rank_me();
+    header.m_file_ranks = num_file_ranks;
+    header.m_every = m_every;
+    header.m_num_cells = num_cells;
+    off_t ids_offset = sizeof(header) + table.size()*sizeof(uint64_t);
+    m_data_offset = ids_offset + num_cells*sizeof(int64_t);
+    m_frame_bytes = sizeof(int64_t) + num_cells*sizeof(packed_type);
+    m_writes_step = !shared || upcxx::rank_me() == 0;
+
+    //rank 0 creates a shared file before the others open it
+    std::string file_path = shared ? path : path + "." + std::to_string(upcxx::rank_me());
+    if(m_writes_step) m_fd = ::open(file_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(shared){
+        upcxx::barrier();
+        if(!m_writes_step) m_fd = ::open(file_path.c_str(), O_WRONLY);
+    }
+    if(m_fd >= 0){
+        if(m_writes_step){
+            writeAll(&header, sizeof(header), 0);
+            writeAll(table.data(), table.size()*sizeof(uint64_t), sizeof(header));
+        }
+        std::vector<int64_t> ids(m_ids.begin(), m_ids.end());
+        writeAll(ids.data(), ids.size()*sizeof(int64_t), ids_offset + m_cell_offset*sizeof(int64_t));
+    }
+    bool ok = m_fd >= 0 && !m_failed;
+    if(shared) ok = upcxx::reduce_all(ok ? 0 : 1, upcxx::op_fast_add).wait() == 0;
+    if(!ok){
+        if(m_fd >= 0) ::close(m_fd);
+        m_fd = -1;
+        return false;
+    }
+
+    m_staging[0].resize(m_cells.size());
+    m_staging[1].resize(m_cells.size());
+    m_stop = false;
+    m_thread = std::thread(&SnapshotWriter::writeLoop, this);
+    return true;
+}
+
+//Packs the owned cells if step is a multiple of m_every and queues them for the background thread.
+template <typename T, typename Packer> void SnapshotWriter<T, Packer>::write(ProcessNode<T, Packer>& proc_node, long long step){
+    if(m_fd < 0 || step % m_every != 0) return;
+    int slot = m_next_slot;
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_idle.wait(lock, [&](){ return !m_queued[slot]; });
+    }
+    packed_type* staging = m_staging[slot].data();
+    parallelFor(proc_node.m_thread_pool, 0, m_cells.size(), ProcessNode<T, Packer>::pack_grain, [&](size_t begin, size_t end){
+        for(size_t k = begin; k < end; k++) Packer::pack(proc_node.value(m_cells[k]), staging[k]);
+    });
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_steps[slot] = step;
+        m_frames[slot] = m_num_frames++;
+        m_queued[slot] = true;
+    }
+    m_work.notify_one();
+    m_next_slot = 1 - slot;
+}
+
+template <typename T, typename Packer> void SnapshotWriter<T, Packer>::flush(){
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_idle.wait(lock, [&](){ return !m_queued[0] && !m_queued[1]; });
+}
+
+template <typename T, typename Packer> bool SnapshotWriter<T, Packer>::close(){
+    if(m_fd < 0) return !m_failed;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_work.notify_one();
+    m_thread.join();
+    if(::close(m_fd) != 0) m_failed = true;
+    m_fd = -1;
+    return !m_failed;
+}
+
+//Frames are written in the order they were queued, alternating between the staging buffers.
+template <typename T, typename Packer> void SnapshotWriter<T, Packer>::writeLoop(){
+    int slot = 0;
+    while(true){
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_work.wait(lock, [&](){ return m_queued[slot] || m_stop; });
+        if(!m_queued[slot]) return;
+        lock.unlock();
+        writeFrame(slot);
+        lock.lock();
+        m_queued[slot] = false;
+        lock.unlock();
+        m_idle.notify_all();
+        slot = 1 - slot;
+    }
+}
+
+template <typename T, typename Packer> void SnapshotWriter<T, Packer>::writeFrame(int slot){
+    off_t frame_offset = m_data_offset + (off_t)m_frames[slot]*m_frame_bytes;
+    if(m_writes_step){
+        int64_t step = m_steps[slot];
+        writeAll(&step, sizeof(step), frame_offset);
+    }
+    writeAll(m_staging[slot].data(), m_staging[slot].size()*sizeof(packed_type),
+             frame_offset + sizeof(int64_t) + m_cell_offset*sizeof(packed_type));
+}
+
+//failures are reported by close()
+template <typename T, typename Packer> void SnapshotWriter<T, Packer>::writeAll(const void* data, size_t bytes, off_t offset){
+    if(!writeFully(m_fd, data, bytes, offset)) m_failed = true;
+}